@@ -0,0 +1,591 @@
+/**
+ * @file bench.c
+ * @brief Benchmarks the `ramdisk.c` SPANK hooks without a slurmd.
+ *
+ * Links the plugin against a mock SPANK runtime, and drives the
+ * init -> init_post_opt -> exit lifecycle of many steps, one after another and
+ * then concurrently. Each step runs in its own process (as each has its own
+ * slurmstepd), within a private mount namespace - and a user namespace when
+ * run unprivileged - so nothing touches the node's real mounts.
+ *
+ * Reports hook latency percentiles, steps per second, and any mounts, RAM
+ * disks, shared memory or file descriptors left behind.
+ *
+ * gcc -O2 -pthread -o ramdisk-bench bench/bench.c
+ */
+#define _GNU_SOURCE
+
+// keep the RAM disks within a tmpfs of our own
+#ifndef RAMDISK_ROOT
+#define RAMDISK_ROOT "/tmp/ramdisk-bench"
+#endif
+
+#include "../ramdisk.c"
+
+#include <getopt.h>
+#include <stdarg.h>
+
+#define BENCH_MAX_OPTIONS 32
+#define BENCH_DEFAULT_STEPS 1000
+#define BENCH_DEFAULT_SIZE "64M"
+#define BENCH_LINE_LEN 256
+#define PROC_SELF_FD "/proc/self/fd"
+#define PROC_SETGROUPS "/proc/self/setgroups"
+#define PROC_UID_MAP "/proc/self/uid_map"
+#define PROC_GID_MAP "/proc/self/gid_map"
+
+/**
+ * @brief The hooks we time, in the order slurmstepd calls them
+ */
+enum bench_hook { HOOK_INIT, HOOK_INIT_POST_OPT, HOOK_EXIT, HOOKS };
+
+static const char *hook_names[HOOKS] = {"init", "init_post_opt", "exit"};
+
+/**
+ * @brief What each step reports back to the harness
+ */
+struct step_result {
+  int failed;
+  int errors;
+  int leaked_fds;
+  uint64_t latency[HOOKS];
+};
+
+/**
+ * @brief The values the mock SPANK runtime hands the plugin
+ */
+static struct {
+  uint32_t job;
+  uint32_t step;
+  uid_t uid;
+  gid_t gid;
+  uint64_t step_memory;
+  uint64_t job_memory;
+  int verbose;
+  int errors;
+} mock = {.job = 1000, .step_memory = 4096, .job_memory = 8192};
+
+// `name[=value]` plugin options applied to every step, as if given to `srun`
+static char *bench_options[BENCH_MAX_OPTIONS];
+static int n_bench_options;
+
+static int enter_sandbox(void);
+static int run_pass(const char *name, int steps, int concurrency,
+                    uint32_t first_step);
+static void run_step(uint32_t step, int out);
+static int apply_option(char *option);
+static void report_latency(const char *pass, enum bench_hook hook,
+                           uint64_t latency[], int n);
+static int compare_u64(const void *a, const void *b);
+static int count_lines(const char *path);
+static int count_fds(void);
+static int count_ramdisks_left(void);
+static int write_file(const char *path, const char *value);
+static void mock_log(const char *level, const char *format, va_list args);
+
+/**
+ * @brief Runs the benchmark
+ *
+ * @param argc argument count
+ * @param argv argument values
+ * @return int
+ */
+int main(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"steps", required_argument, NULL, 'n'},
+      {"concurrency", required_argument, NULL, 'c'},
+      {"option", required_argument, NULL, 'o'},
+      {"job", required_argument, NULL, 'j'},
+      {"step-mem", required_argument, NULL, 'm'},
+      {"job-mem", required_argument, NULL, 'M'},
+      {"verbose", no_argument, NULL, 'v'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+
+  int steps = BENCH_DEFAULT_STEPS;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int concurrency = cpus > 1 ? cpus : 2;
+  bench_options[n_bench_options++] = "ramdisk=" BENCH_DEFAULT_SIZE;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:c:o:j:m:M:vh", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      steps = atoi(optarg);
+      break;
+    case 'c':
+      concurrency = atoi(optarg);
+      break;
+    case 'o':
+      if (n_bench_options == BENCH_MAX_OPTIONS) {
+        fprintf(stderr, "bench: too many options\n");
+        return EXIT_FAILURE;
+      }
+      bench_options[n_bench_options++] = optarg;
+      break;
+    case 'j':
+      mock.job = strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      mock.step_memory = strtoull(optarg, NULL, 10);
+      break;
+    case 'M':
+      mock.job_memory = strtoull(optarg, NULL, 10);
+      break;
+    case 'v':
+      mock.verbose = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-n steps] [-c concurrency] [-o name[=value]]... "
+              "[-j job] [-m step-mem] [-M job-mem] [-v]\n"
+              "  -o passes a plugin option (without its `--`) to every step, "
+              "e.g. -o ramdisk=1G -o ramdisk-fs=ext4\n",
+              argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (steps <= 0 || concurrency <= 0) {
+    fprintf(stderr, "bench: steps and concurrency must be positive\n");
+    return EXIT_FAILURE;
+  }
+
+  if (enter_sandbox() != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  mock.uid = getuid();
+  mock.gid = getgid();
+
+  uint64_t shmem_before = 0;
+  uint64_t shmem_after = 0;
+  read_meminfo("Shmem", &shmem_before);
+  int mounts_before = count_lines(MOUNTINFO_SELF);
+
+  int rc = run_pass("sequential", steps, 1, 0);
+  if (concurrency > 1 &&
+      run_pass("concurrent", steps, concurrency, steps) != EXIT_SUCCESS) {
+    rc = EXIT_FAILURE;
+  }
+
+  read_meminfo("Shmem", &shmem_after);
+  int mounts_leaked = count_lines(MOUNTINFO_SELF) - mounts_before;
+  int ramdisks_leaked = count_ramdisks_left();
+  printf("leaks: mounts=%d ramdisks=%d shmem_kb=%" PRId64 "\n", mounts_leaked,
+         ramdisks_leaked, (int64_t)(shmem_after - shmem_before));
+  if (mounts_leaked != 0 || ramdisks_leaked != 0) {
+    rc = EXIT_FAILURE;
+  }
+
+  return rc;
+}
+
+/**
+ * @brief Moves us into a mount namespace of our own, with a tmpfs at
+ * `RAMDISK_ROOT`
+ * When run unprivileged, also enters a user namespace mapping us to root, so
+ * the plugin can mount (and `run_as_user` can switch to the mapped user).
+ *
+ * @return int
+ */
+static int enter_sandbox(void) {
+  uid_t uid = geteuid();
+  gid_t gid = getegid();
+  if (unshare(CLONE_NEWNS | (uid != 0 ? CLONE_NEWUSER : 0)) != 0) {
+    fprintf(stderr, "bench: failed to create namespaces: %s\n",
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (uid != 0) {
+    char map[BENCH_LINE_LEN];
+    snprintf(map, sizeof(map), "0 %d 1", uid);
+    if (write_file(PROC_SETGROUPS, "deny") != EXIT_SUCCESS ||
+        write_file(PROC_UID_MAP, map) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    snprintf(map, sizeof(map), "0 %d 1", gid);
+    if (write_file(PROC_GID_MAP, map) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ||
+      (mkdir(RAMDISK_ROOT, 0755) != 0 && errno != EEXIST) ||
+      mount(MOUNT_SOURCE_VIRTUAL, RAMDISK_ROOT, MOUNT_TYPE_TEMP,
+            MOUNT_FLAGS_NONE, "mode=755") != 0) {
+    fprintf(stderr, "bench: failed to mount %s: %s\n", RAMDISK_ROOT,
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Runs `steps` steps, keeping up to `concurrency` in flight, and
+ * reports their latency and throughput
+ *
+ * @param name the pass name to report
+ * @param steps the number of steps to run
+ * @param concurrency the number of steps run at once
+ * @param first_step the first step ID (each step gets its own)
+ * @return int
+ */
+static int run_pass(const char *name, int steps, int concurrency,
+                    uint32_t first_step) {
+  uint64_t(*latency)[HOOKS] = calloc(steps, sizeof(*latency));
+  int results[2];
+  if (latency == NULL || pipe(results) != 0 ||
+      fcntl(results[0], F_SETFL, O_NONBLOCK) != 0) {
+    fprintf(stderr, "bench: failed to set up the %s pass\n", name);
+    free(latency);
+    return EXIT_FAILURE;
+  }
+
+  int started = 0;
+  int running = 0;
+  int n_results = 0;
+  int failed = 0;
+  int errors = 0;
+  int leaked_fds = 0;
+  uint64_t start = timing_now();
+  while (started < steps || running > 0) {
+    while (started < steps && running < concurrency) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(results[0]);
+        run_step(first_step + started, results[1]);
+      }
+      if (pid < 0) {
+        fprintf(stderr, "bench: failed to fork: %s\n", strerror(errno));
+        break;
+      }
+      started++;
+      running++;
+    }
+
+    if (waitpid(-1, NULL, 0) > 0) {
+      running--;
+    } else if (errno == ECHILD) {
+      // fork failed with nothing left running
+      break;
+    }
+
+    // each step writes its result before exiting, so at most `concurrency`
+    // are ever waiting in the pipe
+    struct step_result result;
+    while (read(results[0], &result, sizeof(result)) == sizeof(result)) {
+      memcpy(latency[n_results++], result.latency, sizeof(result.latency));
+      failed += result.failed;
+      errors += result.errors;
+      leaked_fds += result.leaked_fds;
+    }
+  }
+  uint64_t elapsed = timing_now() - start;
+  close(results[0]);
+  close(results[1]);
+
+  // steps that died without reporting count as failures
+  failed += steps - n_results;
+  printf("%s: steps=%d concurrency=%d failed=%d errors=%d leaked_fds=%d "
+         "steps_per_second=%.1f\n",
+         name, steps, concurrency, failed, errors, leaked_fds,
+         elapsed > 0 ? steps * 1e9 / elapsed : 0.0);
+
+  uint64_t *samples = calloc(n_results > 0 ? n_results : 1, sizeof(*samples));
+  for (int hook = 0; samples != NULL && hook < HOOKS; hook++) {
+    for (int i = 0; i < n_results; i++) {
+      samples[i] = latency[i][hook];
+    }
+    report_latency(name, hook, samples, n_results);
+  }
+
+  free(samples);
+  free(latency);
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Runs a single step's hooks, as its slurmstepd would, and reports
+ * the result
+ * Runs in its own (forked) process, and doesn't return.
+ *
+ * @param step the step ID
+ * @param out the pipe to write the result to
+ */
+static void run_step(uint32_t step, int out) {
+  struct step_result result = {0};
+  mock.step = step;
+  int fds = count_fds();
+
+  uint64_t start = timing_now();
+  result.failed |= slurm_spank_init(NULL, 0, NULL) != ESPANK_SUCCESS;
+  result.latency[HOOK_INIT] = timing_now() - start;
+
+  // SPANK hands the options over between init and init_post_opt
+  for (int i = 0; i < n_bench_options; i++) {
+    result.failed |= apply_option(bench_options[i]) != ESPANK_SUCCESS;
+  }
+
+  start = timing_now();
+  result.failed |= slurm_spank_init_post_opt(NULL, 0, NULL) != ESPANK_SUCCESS;
+  result.latency[HOOK_INIT_POST_OPT] = timing_now() - start;
+
+  start = timing_now();
+  result.failed |= slurm_spank_exit(NULL, 0, NULL) != ESPANK_SUCCESS;
+  result.latency[HOOK_EXIT] = timing_now() - start;
+
+  result.errors = mock.errors;
+  result.leaked_fds = count_fds() - fds;
+  _exit(write(out, &result, sizeof(result)) == sizeof(result) ? EXIT_SUCCESS
+                                                               : EXIT_FAILURE);
+}
+
+/**
+ * @brief Applies a `name[=value]` plugin option through its callback
+ *
+ * @param option the option (modified in place)
+ * @return int
+ */
+static int apply_option(char *option) {
+  char name[BENCH_LINE_LEN];
+  const char *value = strchr(option, '=');
+  snprintf(name, sizeof(name), "%.*s",
+           value != NULL ? (int)(value - option) : (int)strlen(option),
+           option);
+
+  for (struct spank_option *entry = ramdisk_options; entry->name != NULL;
+       entry++) {
+    if (strcmp(entry->name, name) == 0) {
+      return entry->cb(entry->val, value != NULL ? value + 1 : NULL, 1);
+    }
+  }
+
+  fprintf(stderr, "bench: unknown option %s\n", name);
+  return ESPANK_ERROR;
+}
+
+/**
+ * @brief Prints the latency percentiles of one hook
+ *
+ * @param pass the pass name
+ * @param hook the hook
+ * @param latency each step's latency in nanoseconds (sorted in place)
+ * @param n the number of steps
+ */
+static void report_latency(const char *pass, enum bench_hook hook,
+                           uint64_t latency[], int n) {
+  if (n == 0) {
+    return;
+  }
+
+  qsort(latency, n, sizeof(*latency), compare_u64);
+  printf("%s: %s p50_us=%" PRIu64 " p99_us=%" PRIu64 " max_us=%" PRIu64 "\n",
+         pass, hook_names[hook], latency[(n - 1) / 2] / 1000,
+         latency[(n - 1) * 99 / 100] / 1000, latency[n - 1] / 1000);
+}
+
+/**
+ * @brief Orders unsigned 64-bit integers for `qsort`
+ *
+ * @param a the first value
+ * @param b the second value
+ * @return int
+ */
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Counts the lines of a file
+ *
+ * @param path the file
+ * @return int the line count, or -1 on failure
+ */
+static int count_lines(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+
+  int lines = 0;
+  int c;
+  while ((c = fgetc(file)) != EOF) {
+    lines += c == '\n';
+  }
+  fclose(file);
+  return lines;
+}
+
+/**
+ * @brief Counts our open file descriptors
+ *
+ * @return int
+ */
+static int count_fds(void) {
+  DIR *dir = opendir(PROC_SELF_FD);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  int fds = 0;
+  struct dirent *item;
+  while ((item = readdir(dir)) != NULL) {
+    fds += item->d_name[0] != '.';
+  }
+  closedir(dir);
+  return fds;
+}
+
+/**
+ * @brief Counts the RAM disk directories left under `RAMDISK_ROOT`
+ * Ignores the plugin's (hidden) state.
+ *
+ * @return int
+ */
+static int count_ramdisks_left(void) {
+  DIR *dir = opendir(RAMDISK_ROOT);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  int left = 0;
+  struct dirent *item;
+  while ((item = readdir(dir)) != NULL) {
+    if (item->d_name[0] != '.') {
+      printf("leaked: %s/%s\n", RAMDISK_ROOT, item->d_name);
+      left++;
+    }
+  }
+  closedir(dir);
+  return left;
+}
+
+/**
+ * @brief Writes a value to a file
+ *
+ * @param path the file
+ * @param value the value
+ * @return int
+ */
+static int write_file(const char *path, const char *value) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0 || write(fd, value, strlen(value)) != (ssize_t)strlen(value)) {
+    fprintf(stderr, "bench: failed to write %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Prints a plugin log message, when verbose
+ *
+ * @param level the log level
+ * @param format the message format
+ * @param args the message arguments
+ */
+static void mock_log(const char *level, const char *format, va_list args) {
+  if (!mock.verbose) {
+    return;
+  }
+  fprintf(stderr, "%s: ", level);
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+}
+
+// the mock SPANK runtime - only what the plugin uses
+
+#define MOCK_LOG(name, level)                                                  \
+  void name(const char *format, ...) {                                         \
+    va_list args;                                                              \
+    va_start(args, format);                                                    \
+    mock_log(level, format, args);                                             \
+    va_end(args);                                                              \
+  }
+
+MOCK_LOG(slurm_info, "info")
+MOCK_LOG(slurm_verbose, "verbose")
+MOCK_LOG(slurm_debug, "debug")
+MOCK_LOG(slurm_spank_log, "spank")
+
+void slurm_error(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  mock.errors++;
+  mock_log("error", format, args);
+  va_end(args);
+}
+
+spank_context_t spank_context(void) { return S_CTX_REMOTE; }
+
+spank_err_t spank_get_item(spank_t spank, spank_item_t item, ...) {
+  spank_err_t rc = ESPANK_SUCCESS;
+  va_list args;
+  va_start(args, item);
+  switch (item) {
+  case S_JOB_ID:
+    *va_arg(args, uint32_t *) = mock.job;
+    break;
+  case S_JOB_STEPID:
+    *va_arg(args, uint32_t *) = mock.step;
+    break;
+  case S_JOB_UID:
+    *va_arg(args, uid_t *) = mock.uid;
+    break;
+  case S_JOB_GID:
+    *va_arg(args, gid_t *) = mock.gid;
+    break;
+  case S_STEP_ALLOC_MEM:
+    *va_arg(args, uint64_t *) = mock.step_memory;
+    break;
+  case S_JOB_ALLOC_MEM:
+    *va_arg(args, uint64_t *) = mock.job_memory;
+    break;
+  default:
+    rc = ESPANK_NOT_AVAIL;
+  }
+  va_end(args);
+  return rc;
+}
+
+spank_err_t spank_getenv(spank_t spank, const char *var, char *buf, int len) {
+  const char *value = getenv(var);
+  if (value == NULL) {
+    return ESPANK_ENV_NOEXIST;
+  }
+  return snprintf(buf, len, "%s", value) < len ? ESPANK_SUCCESS
+                                               : ESPANK_NOSPACE;
+}
+
+spank_err_t spank_setenv(spank_t spank, const char *var, const char *val,
+                         int overwrite) {
+  return setenv(var, val, overwrite) == 0 ? ESPANK_SUCCESS : ESPANK_ERROR;
+}
+
+spank_err_t spank_unsetenv(spank_t spank, const char *var) {
+  return unsetenv(var) == 0 ? ESPANK_SUCCESS : ESPANK_ERROR;
+}
+
+spank_err_t spank_option_register(spank_t spank, struct spank_option *opt) {
+  return ESPANK_SUCCESS;
+}
+
+void slurm_init_update_node_msg(update_node_msg_t *msg) {
+  memset(msg, 0, sizeof(*msg));
+}
+
+int slurm_update_node(update_node_msg_t *msg) {
+  fprintf(stderr, "bench: would drain %s: %s\n", msg->node_names, msg->reason);
+  return SLURM_SUCCESS;
+}
+
+int slurm_get_errno(void) { return 0; }
+
+char *slurm_strerror(int errnum) { return "mocked"; }
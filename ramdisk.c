@@ -7,14 +7,124 @@
  *
  * @copyright Copyright (c) 2022
  */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <grp.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/loop.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
 #include <slurm/slurm.h>
 #include <slurm/spank.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// define to keep RAM disks (and their state) elsewhere by default, e.g. for
+// benchmarks - `root=` in `plugstack.conf` overrides it
+#ifndef RAMDISK_ROOT
+#define RAMDISK_ROOT "/ramdisks"
+#endif
+#define RAMDISK_MODE 0700
+#define ROOT_PATH_LEN 128
+// node-wide state, under the root given outside any `partition=` section
+#define STATE_DIR_NAME ".state"
+#define STATE_DIR_MODE 0700
+#define NODE_LEDGER_NAME "node.ledger"
+#define NODE_LEDGER_MAGIC 0x52414d4c45444752ULL
+// each step's RAM disks are reserved from the job's allocation, as files of
+// `<megabytes> <slurmstepd pid>` in `<job>.reserved`, changed under the job's
+// lock - job scoped RAM disks are reserved once, for the job
+#define JOB_LEDGER_SUFFIX ".reserved"
+#define JOB_LEDGER_JOB_ENTRY "job"
+#define JOB_LEDGER_LINE_LEN 64
+// block RAM disks lower the job's memory cgroup limit by their zram memory,
+// recording `<megabytes lowered> <limit written>` in `<job>.charged`
+#define JOB_CHARGE_SUFFIX ".charged"
+
+#define MEMINFO_PATH "/proc/meminfo"
+#define RECLAIM_WAIT_SECONDS 30
+#define RECLAIM_READY_TIMEOUT_MS 5000
+// namespaces and mounts slurmd reconciles the node ledger against
+#define RECONCILE_MAX_MOUNTS 4096
+// slurmd reaps RAM disks (and job state) left behind by steps whose
+// slurmstepd is gone, as it starts and then every `REAP_INTERVAL_SECONDS` -
+// steps are identified by slurmstepd's process title, `slurmstepd: [<step>]`
+#define REAP_INTERVAL_SECONDS 300
+#define REAP_MAX_STEPS 4096
+#define STEPD_TITLE "slurmstepd: ["
+#define RAMDISK_SUFFIX ".ramdisk"
+#define NUMA_INFIX ".numa"
+#define JOB_SCOPE_STEP "job"
+
+#define UNMOUNT_RETRIES 5
+#define UNMOUNT_BACKOFF_MS 100
+#define PROC_ROOT "/proc"
+// `--ramdisk-namespace` ramdisks are mounted in a namespace held open by a
+// child of slurmstepd, and reached from outside through its `/proc` entries
+#define NAMESPACE_ROOT PROC_ROOT "/%d/root%s"
+#define NAMESPACE_MOUNTS PROC_ROOT "/%d/ns/mnt"
+#define NODE_NAME_LEN 256
 
+// define (e.g. `-DTIMING_LOG_PATH=\"/var/log/slurm/ramdisk.jsonl\"`) to also
+// append each step's timings to a node-local JSON lines file
+#ifndef TIMING_LOG_PATH
+#define TIMING_LOG_PATH ""
+#endif
+#define TIMING_LINE_LEN 1024
+
+// peak usage is sampled through the step, and each step's appended to the
+// node-local accounting record - define to keep it elsewhere than the state
+// directory
+#ifndef USAGE_LOG_PATH
+#define USAGE_LOG_PATH ""
+#endif
+#define USAGE_LOG_NAME "usage.jsonl"
+#define USAGE_SAMPLE_SECONDS 5
+#define USAGE_LINE_LEN 512
+#define CGROUP_MEMORY_STAT "memory.stat"
+
+// jobs resize their RAM disk by writing a size to this file in it, which the
+// usage monitor checks every `RESIZE_POLL_SECONDS`, replacing it with the
+// outcome (as a `#` comment)
+#define RESIZE_FILE_NAME ".resize"
+#define RESIZE_POLL_SECONDS 1
+#define RESIZE_LINE_LEN 256
+// `--ramdisk-autogrow` grows a RAM disk by a quarter once it's 90% full
+#define AUTOGROW_FREE_PERCENT 10
+#define AUTOGROW_STEP_PERCENT 25
+#define TMPFS_MAGIC 0x01021994
+// v2 and v1 names respectively
+#define CGROUP_MEMORY_MAX "memory.max"
+#define CGROUP_MEMORY_LIMIT "memory.limit_in_bytes"
+#define CGROUP_MEMORY_CURRENT "memory.current"
+#define CGROUP_MEMORY_USAGE "memory.usage_in_bytes"
+// memory kept free of RAM disks for the application, as a percentage of the
+// allocation unless `--ramdisk-headroom` says otherwise
+#ifndef HEADROOM_DEFAULT_PERCENT
+#define HEADROOM_DEFAULT_PERCENT 10
+#endif
 #define DIRECTORY_PATH_LEN 255
+#define STEP_NAME_LEN 64
 #define INITIAL_DIR_MODE_RWX 0700
 
 #define MOUNT_OPTION_LEN 255
@@ -22,11 +132,131 @@
 #define MOUNT_TYPE_TEMP "tmpfs"
 #define MOUNT_FLAGS_NONE 0
 
+// block RAM disks (`--ramdisk-fs`, or compressed) are a filesystem on a zram
+// device - compressed ones may hold a multiple of the memory they use
+#define ZRAM_CONTROL "/sys/class/zram-control"
+#define ZRAM_BLOCK "/sys/block/%s/%s"
+#define ZRAM_DEVICE "/dev/zram"
+#define ZRAM_ALGORITHM_LEN 16
+#define ZRAM_DISKSIZE_RATIO 4
+#define ZRAM_MEM_USED_TOTAL 2
+#define ZRAM_MEM_LIMIT 3
+#define DEVICE_NAME_LEN 32
+#define DEVICE_WAIT_MS 1000
+#define SYS_DEV_BLOCK "/sys/dev/block/%u:%u"
+#define FS_TYPE_LEN 16
+
+// `--ramdisk-image` copies the image into the RAM disk, and loop mounts it
+#define IMAGE_FILE_NAME ".image"
+#define IMAGE_MOUNT_NAME "image"
+#define IMAGE_MOUNT_MODE 0755
+#define LOOP_CONTROL "/dev/loop-control"
+#define LOOP_DEVICE "/dev/loop%d"
+#define LOOP_RETRIES 8
+#define SQUASHFS_MAGIC "hsqs"
+#define EROFS_MAGIC 0xe0f5e1e2U
+#define EROFS_MAGIC_OFFSET 1024
+// `--ramdisk-overlay` stacks an overlay on the RAM disk, keeping its layers in
+// the RAM disk underneath
+#define OVERLAY_UPPER "upper"
+#define OVERLAY_WORK "work"
+#define MOUNT_TYPE_OVERLAY "overlay"
+#define OVERLAYFS_SUPER_MAGIC 0x794c7630
+
+// `--ramdisk-cache` datasets are shared by every job of a user on the node,
+// each in its own tmpfs, and bound read-only into the job's RAM disk
+#define CACHE_DIR_NAME ".cache"
+#define CACHE_STATE_NAME "cache"
+#define CACHE_LOCK_NAME "cache.lock"
+#define CACHE_MOUNT_NAME "cache"
+#define CACHE_KEY_LEN 17
+// the memory (in megabytes) the node's cache may use, unless `cache_max` is
+// set in `plugstack.conf`
+#define CACHE_MAX_DEFAULT 65536
+// entries are sized to the dataset, with tmpfs rounding each file up to pages
+#define CACHE_PAGE_SIZE 4096
+#define CACHE_MEASURE_FDS 64
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+#define MOUNTINFO_SELF "/proc/self/mountinfo"
+#define SUBMOUNTS_MAX 64
+#define MKFS_MAX_ARGS 16
+
+#define THP_SHMEM_ENABLED "/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+#define THP_MODE_LEN 16
+
+#define MPOL_MODE_LEN 16
+#define NUMA_MAX_NODES 1024
+#define NUMA_MAX_CPUS 8192
+#define NUMA_ONLINE "/sys/devices/system/node/online"
+#define NUMA_NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+
+// `--ramdisk-prefault` commits the free space with placeholder memfds, written
+// by a few threads per NUMA node (each with its own file, as tmpfs serialises
+// `fallocate` per file), and split on huge page boundaries
+#define PREFAULT_FILE_NAME "ramdisk-prefault"
+#define PREFAULT_THREADS_PER_NODE 4
+#define PREFAULT_MAX_THREADS 64
+#define PREFAULT_ALIGN (2 << 20)
+#define OOM_SCORE_ADJ_SELF "/proc/self/oom_score_adj"
+#define OOM_SCORE_ADJ_FIRST "1000"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_SELF "/proc/self/cgroup"
+
+#define STAGE_THREADS 16
+#define STAGE_CHUNK_SIZE (64L * 1024 * 1024)
+#define STAGE_BUFFER_SIZE (1024 * 1024)
+#define STAGE_IDLE_NSEC 100000L
+#define STAGE_POLL_NSEC 50000000L
+// files are copied beside their destination, then renamed over it
+#define STAGE_TEMP_SUFFIX ".ramdisk-XXXXXX"
+// keep stage-out (plus the grace before we kill it) inside the default KillWait
+#define STAGE_OUT_TIMEOUT 25
+#define STAGE_OUT_GRACE 3
+
 #define UNIT_MEGABYTES 'M'
 #define UNIT_GIGABYTES 'G'
 
+// submit-time memory request validation
+#define CMDLINE_SELF "/proc/self/cmdline"
+#define CMDLINE_LEN 65536
+#define CMDLINE_MAX_ARGS 1024
+#define SCRIPT_DIRECTIVE "#SBATCH"
+
 #define SPANK_PLUGIN_NAME "ramdisk"
 #define SPANK_OPTION_NAME "ramdisk"
+#define SPANK_OPTION_STAGE_IN "ramdisk-stage-in"
+#define SPANK_OPTION_STAGE_OUT "ramdisk-stage-out"
+#define SPANK_OPTION_HUGE "ramdisk-huge"
+#define SPANK_OPTION_MPOL "ramdisk-mpol"
+#define SPANK_OPTION_NUMA "ramdisk-numa"
+#define SPANK_OPTION_SCOPE "ramdisk-scope"
+#define SPANK_OPTION_TEARDOWN "ramdisk-teardown"
+#define SPANK_OPTION_COMPRESS "ramdisk-compress"
+#define SPANK_OPTION_FS "ramdisk-fs"
+#define SPANK_OPTION_IMAGE "ramdisk-image"
+#define SPANK_OPTION_OVERLAY "ramdisk-overlay"
+#define SPANK_OPTION_CACHE "ramdisk-cache"
+#define SPANK_OPTION_NAMESPACE "ramdisk-namespace"
+#define SPANK_OPTION_PREFAULT "ramdisk-prefault"
+#define SPANK_OPTION_AUTOGROW "ramdisk-autogrow"
+#define SPANK_OPTION_HEADROOM "ramdisk-headroom"
+// `plugstack.conf` arguments - those following `partition=NAME` only apply to
+// jobs in that partition, overriding the ones before any `partition=`
+#define PLUGIN_ARG_PARTITION "partition"
+#define PLUGIN_ARG_ROOT "root"
+#define PLUGIN_ARG_MODE "mode"
+#define PLUGIN_ARG_MAX_SIZE "max_size"
+#define PLUGIN_ARG_MIN_HEADROOM "min_headroom"
+#define PLUGIN_ARG_DEFAULT_HUGE "default_huge"
+#define PLUGIN_ARG_DEFAULT_MPOL "default_mpol"
+#define PLUGIN_ARG_NOSWAP "noswap"
+#define PLUGIN_ARG_NODE_MAX "node_max"
+#define PLUGIN_ARG_CACHE_MAX "cache_max"
+#define CONFIG_MAX_PARTITIONS 32
+#define PARTITION_NAME_LEN 64
 
 // in plugstack.h, but not spank.h
 #define SPANK_OPTION_ENV_PREFIX "_SLURM_SPANK_OPTION_"
@@ -39,22 +269,656 @@
 SPANK_PLUGIN("ramdisk", 1);
 
 static uint64_t ramdisk_size;
+static char stage_in_source[PATH_MAX];
+static char stage_out_destination[PATH_MAX];
+static char ramdisk_huge[THP_MODE_LEN];
+static char ramdisk_mpol[MPOL_MODE_LEN];
+static char ramdisk_mpol_nodes[MOUNT_OPTION_LEN];
+static int ramdisk_numa;
+static int ramdisk_prefault;
+// the total size `--ramdisk-autogrow` may grow the RAM disks to, in megabytes
+static uint64_t ramdisk_autogrow;
+// the memory left for the application, in megabytes, or a percentage of the
+// allocation when `ramdisk_headroom_percent` is set
+static uint64_t ramdisk_headroom;
+static int ramdisk_headroom_percent = HEADROOM_DEFAULT_PERCENT;
+// the memory every RAM disk on the node may use together (`node_max` in
+// `plugstack.conf`), in megabytes or as a percentage of `MemTotal` - or zero,
+// uncapped
+static uint64_t node_max;
+static int node_max_percent;
+// the memory the dataset cache may use (`cache_max` in `plugstack.conf`), in
+// megabytes - zero disables it
+static uint64_t cache_max = CACHE_MAX_DEFAULT;
+// summed by `measure_entry`, as `nftw` passes it nothing of ours
+static uint64_t measured_bytes;
+// set when `--ramdisk-scope=job`, or when a step attaches to the job's ramdisk
+static int ramdisk_job_scope;
+static int ramdisk_async_teardown;
+static char ramdisk_compress[ZRAM_ALGORITHM_LEN];
+static char ramdisk_fs[FS_TYPE_LEN];
+static char ramdisk_image[PATH_MAX];
+static char ramdisk_overlay[PATH_MAX];
+static char ramdisk_cache[PATH_MAX];
+// set when `--ramdisk-namespace=private|tmp`, and `tmp` also covers `/tmp`
+static int ramdisk_namespace;
+static int ramdisk_namespace_tmp;
+// the process holding the step's mount namespace, and our end of its pipe
+static pid_t namespace_holder;
+static int namespace_pipe = -1;
+// with `--ramdisk-prefault`, the processes holding each ramdisk's free memory
+static struct prefault_holder *prefault_holders;
+static int n_prefault_holders;
+
+// where `--ramdisk-namespace=tmp` binds the ramdisk
+static const char *const namespace_tmp_paths[] = {"/tmp", "/dev/shm"};
+
+/**
+ * @brief A filesystem we can build on a block RAM disk
+ * Options are tuned for RAM, where there's nothing to gain from journaling or
+ * spreading data for spinning disks. Discard hands freed blocks back to zram.
+ */
+struct block_filesystem {
+  const char *type;
+  const char *mkfs;
+  const char *mkfs_options[MKFS_MAX_ARGS];
+  const char *mount_options;
+};
+
+static const struct block_filesystem block_filesystems[] = {
+    // running out of memory mustn't remount the filesystem read-only
+    {.type = "ext4",
+     .mkfs = "/sbin/mkfs.ext4",
+     .mkfs_options = {"-q", "-F", "-m", "0", "-O", "^has_journal", "-E",
+                      "nodiscard", NULL},
+     .mount_options = "discard,errors=continue"},
+    // xfs always logs, but a few large allocation groups keep it lean
+    {.type = "xfs",
+     .mkfs = "/sbin/mkfs.xfs",
+     .mkfs_options = {"-q", "-f", "-K", "-d", "agcount=4", "-m", "reflink=1",
+                      NULL},
+     .mount_options = "discard"},
+};
+
+// NUMA nodes with their own RAM disk in `--ramdisk-numa` mode (set in
+// `slurm_spank_init_post_opt`, and inherited by the task hooks)
+static int ramdisk_numa_nodes[NUMA_MAX_NODES];
+static int n_ramdisk_numa_nodes;
+
+/**
+ * @brief Node-wide accounting shared by every slurmstepd on the node
+ * Memory-mapped from `node.ledger` in the state directory, and only updated
+ * atomically.
+ * `reclaiming` is memory (in megabytes) of detached RAM disks that the kernel
+ * is still freeing, and `reserved` the size of every live RAM disk - which
+ * slurmd reconciles with the node's mounts when it starts.
+ */
+struct node_ledger {
+  uint64_t magic;
+  uint64_t reclaiming;
+  uint64_t reserved;
+};
+
+/**
+ * @brief This step's reservation in the job's ledger
+ * Paths are resolved up front, so the usage monitor can update the reservation
+ * as the RAM disks are resized. `entry` is empty while nothing is reserved.
+ */
+struct job_reservation {
+  char lock[PATH_MAX];
+  char entry[PATH_MAX];
+  uint64_t allocation;
+};
+
+static struct job_reservation reservation;
+
+/**
+ * @brief Where the job's block RAM disks are charged to its memory cgroup
+ * zram memory isn't charged to any cgroup, so the job's limit is lowered by
+ * each device's memory limit while it exists. The charge is shared by the
+ * job's steps, so any of them finding the limit reset (as Slurm does when a
+ * step starts) lowers it again. Paths are resolved up front, for the usage
+ * monitor. `state` is empty while there's nothing to charge.
+ */
+struct job_charge {
+  char lock[PATH_MAX];
+  char state[PATH_MAX];
+  char limit[PATH_MAX];
+};
+
+static struct job_charge charge;
+
+/**
+ * @brief Site settings, from the `plugstack.conf` arguments
+ * `configs[0]` holds the arguments before any `partition=NAME`. Each partition
+ * named starts as a copy of it, overridden by the arguments following its
+ * `partition=`. Parsed once as the plugin loads, with `config` then pointed at
+ * the job's partition before any RAM disk is created or checked.
+ */
+struct ramdisk_config {
+  char partition[PARTITION_NAME_LEN];
+  // where RAM disks are mounted, and the mode of their root
+  char root[ROOT_PATH_LEN];
+  mode_t mode;
+  // the largest total size of a step's RAM disks, in megabytes (zero if any)
+  uint64_t max_size;
+  // the least `--ramdisk-headroom` a step may keep, in megabytes or as a
+  // percentage of the allocation
+  uint64_t min_headroom;
+  int min_headroom_percent;
+  // used for tmpfs RAM disks without `--ramdisk-huge` or `--ramdisk-mpol`
+  char default_huge[THP_MODE_LEN];
+  char default_mpol[MPOL_MODE_LEN];
+  char default_mpol_nodes[MOUNT_OPTION_LEN];
+  // mount tmpfs RAM disks with `noswap` (Linux 6.4+)
+  int noswap;
+};
+
+static struct ramdisk_config configs[CONFIG_MAX_PARTITIONS + 1] = {
+    {.root = RAMDISK_ROOT, .mode = RAMDISK_MODE}};
+static int n_configs = 1;
+static int config_loaded;
+static const struct ramdisk_config *config = &configs[0];
+
+/**
+ * @brief Where node-wide state lives
+ * Every step on the node must agree on these whatever its partition, so
+ * they're under the root given outside any `partition=` section.
+ */
+struct node_paths {
+  char state[PATH_MAX];
+  char ledger[PATH_MAX];
+  char cache[PATH_MAX];
+  char cache_state[PATH_MAX];
+  char cache_lock[PATH_MAX];
+  char usage_log[PATH_MAX];
+};
+
+static struct node_paths node_paths;
+
+/**
+ * @brief Phases of the hooks we time, accumulated per step
+ */
+enum timing_phase {
+  TIMING_GET_ITEM,
+  TIMING_GET_DIRECTORY,
+  TIMING_STAT,
+  TIMING_MKDIR,
+  TIMING_MOUNT,
+  TIMING_STAGE_IN,
+  TIMING_PREFAULT,
+  TIMING_INIT_POST_OPT,
+  TIMING_STAGE_OUT,
+  TIMING_UMOUNT,
+  TIMING_RMDIR,
+  TIMING_EXIT,
+  TIMING_PHASES
+};
+
+static const char *timing_names[TIMING_PHASES] = {
+    "get_item",  "get_directory", "stat",     "mkdir",
+    "mount",     "stage_in",      "prefault", "init_post_opt",
+    "stage_out", "umount",        "rmdir",    "exit"};
+
+// nanoseconds spent in each phase (both hooks run in the same slurmstepd)
+static uint64_t timings[TIMING_PHASES];
+
+/**
+ * @brief What a child working in the step's mount namespace reports back
+ * The child starts with our timings, so returns them whole.
+ */
+struct namespace_status {
+  int rc;
+  uint64_t timings[TIMING_PHASES];
+};
+
+/**
+ * @brief Memory requested at submission (in megabytes), as far as we can tell
+ * Zero means not requested (or `--mem=0`, i.e. the whole node). `uncertain` is
+ * set by any option we don't recognise exactly - an abbreviation, or one from
+ * a newer Slurm or another plugin - which may have hidden the request.
+ */
+struct memory_request {
+  uint64_t per_node;
+  uint64_t per_cpu;
+  char partition[PARTITION_NAME_LEN];
+  int uncertain;
+};
+
+/**
+ * @brief Samples the step's RAM disks in the background, tracking the peak
+ * Directories and the cgroup `memory.stat` are resolved up front, as the
+ * sampling thread can't use the spank instance.
+ */
+struct usage_monitor {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int running;
+  int n_directories;
+  char (*directories)[DIRECTORY_PATH_LEN];
+  char memory_stat[PATH_MAX];
+  // for resizing - the memory cgroup, and the allocation (in megabytes)
+  char cgroup[PATH_MAX];
+  uint64_t allocation;
+  uint64_t peak_size;
+  uint64_t peak_bytes;
+  uint64_t peak_memory;
+  uint64_t peak_inodes;
+  uint64_t peak_shmem;
+};
+
+static struct usage_monitor usage = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                     .wake = PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief Sweeps for orphaned RAM disks in the background, within slurmd
+ */
+struct orphan_reaper {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int running;
+};
+
+static struct orphan_reaper reaper = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                      .wake = PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief Source and destination for a stage-in or stage-out copy
+ */
+struct stage_paths {
+  const char *src;
+  const char *dst;
+  // seconds a stage-out may take
+  int timeout;
+};
+
+/**
+ * @brief A child holding the memory a RAM disk doesn't use yet
+ * Shrinks what it holds to the bytes sent over `socket`, and frees the rest
+ * once the socket closes - or it's killed, being the OOM killer's first pick.
+ */
+struct prefault_holder {
+  pid_t pid;
+  int socket;
+  uint64_t held;
+};
+
+/**
+ * @brief One thread committing part of a RAM disk's memory
+ */
+struct prefault_thread {
+  pthread_t thread;
+  int fd;
+  off_t length;
+  // CPUs to run on (empty to run anywhere)
+  cpu_set_t cpus;
+  int rc;
+};
+
+/**
+ * @brief Options shared between chunks of a single file being copied
+ * Chunks are written to `tmp`. The last chunk to finish applies the source
+ * mode, group and timestamps, and renames it over `dst` - unless any chunk
+ * failed (or was dropped at the deadline), which leaves `dst` as it was.
+ */
+struct copy_file {
+  char *src;
+  char *dst;
+  char *tmp;
+  struct stat st;
+  long remaining;
+  int failed;
+};
+
+/**
+ * @brief A unit of work for the copy engine - a directory to scan, or a byte
+ * range of a regular file to copy.
+ */
+struct copy_task {
+  char *src;
+  char *dst;
+  struct copy_file *file;
+  off_t offset;
+  off_t length;
+  struct copy_task *prev;
+  struct copy_task *next;
+};
+
+/**
+ * @brief Per-worker task deque - the owner works LIFO from the tail, thieves
+ * take the oldest (generally largest) work from the head.
+ */
+struct copy_deque {
+  pthread_mutex_t lock;
+  struct copy_task *head;
+  struct copy_task *tail;
+};
+
+struct copy_engine {
+  int n_workers;
+  struct copy_deque *deques;
+  long pending;
+  int failed;
+  int skip_unchanged;
+  // entry names skipped at the top level of the source (NULL terminated)
+  const char *const *exclude;
+  const char *root;
+  struct timespec deadline;
+  uint64_t files;
+  uint64_t bytes;
+  uint64_t skipped;
+};
+
+struct copy_worker {
+  struct copy_engine *engine;
+  int index;
+};
 
 static int parse_ramdisk_size(int val, const char *optarg, int remote);
+static int parse_stage_in(int val, const char *optarg, int remote);
+static int parse_stage_out(int val, const char *optarg, int remote);
+static int parse_huge(int val, const char *optarg, int remote);
+static int parse_mpol(int val, const char *optarg, int remote);
+static int parse_numa(int val, const char *optarg, int remote);
+static int parse_scope(int val, const char *optarg, int remote);
+static int parse_teardown(int val, const char *optarg, int remote);
+static int parse_compress(int val, const char *optarg, int remote);
+static int parse_fs(int val, const char *optarg, int remote);
+static int parse_image(int val, const char *optarg, int remote);
+static int parse_overlay(int val, const char *optarg, int remote);
+static int parse_cache(int val, const char *optarg, int remote);
+static int parse_namespace(int val, const char *optarg, int remote);
+static int parse_prefault(int val, const char *optarg, int remote);
+static int parse_autogrow(int val, const char *optarg, int remote);
+static int parse_headroom(int val, const char *optarg, int remote);
+static int parse_plugin_args(int ac, char **av);
+static int parse_plugin_arg(struct ramdisk_config *target, const char *arg,
+                            const char *value);
+static void select_config(const char *partition);
+static int parse_huge_mode(const char *value, char mode[]);
+static int parse_mpol_mode(const char *value, char mode[], char nodes[]);
+static int parse_share(const char *value, uint64_t *megabytes, int *percent);
+static const struct block_filesystem *get_block_filesystem(void);
+static int check_memory_request(void);
+static void read_memory_script(struct memory_request *request,
+                               const char *script);
+static void read_memory_environment(struct memory_request *request,
+                                    const char *prefix);
+static const char *read_memory_arguments(struct memory_request *request,
+                                         int argc, char *argv[]);
+static int parse_memory_option(struct memory_request *request,
+                               const char *name, const char *value);
+static int parse_memory(const char *value, uint64_t *megabytes);
+static int is_command(const char *arg);
+static int get_step_name(spank_t sp, char name[]);
 static int get_directory(spank_t sp, char directory[]);
+static int get_ramdisk_directory(spank_t sp, int index, char directory[]);
+static int count_ramdisks(void);
+static int create_ramdisks(spank_t sp, uint64_t size, uid_t uid, gid_t gid,
+                           const char *policy);
+static int destroy_ramdisks(spank_t sp);
+static int start_namespace(spank_t sp, uint64_t size, uid_t uid, gid_t gid,
+                           const char *policy);
+static int stop_namespace(spank_t sp);
+static int release_namespace(spank_t sp);
+static int enter_namespace(void);
+static int read_namespace_status(int fd);
+static int get_state_path(spank_t sp, const char *suffix, char path[]);
+static int lock_job(spank_t sp);
+static int lock_file(const char *path);
+static int set_reservation(spank_t sp);
+static int reserve_job_memory(spank_t sp, uint64_t size);
+static int update_reservation(uint64_t size, uint64_t *others);
+static uint64_t release_reservation(void);
+static int resize_reservation(uint64_t size, uint64_t *others);
+static int attach_job_ramdisk(spank_t sp);
+static int hold_job_ramdisk(spank_t sp);
+static int release_job_ramdisk(spank_t sp);
+static struct node_ledger *map_node_ledger(void);
+static int wait_for_reclaim(uint64_t size);
+static int reserve_node_memory(uint64_t size, uint64_t *reserved,
+                               uint64_t *cap);
+static void release_node_memory(uint64_t size);
+static int reconcile_node_ledger(void);
+static uint64_t get_mount_size(pid_t pid, const char *mountpoint);
+static const char *get_root_name(const char *mountpoint);
+static int start_reaper(void);
+static void stop_reaper(void);
+static void *reaper_loop(void *arg);
+static int reap_orphans(void);
+static int reap_ramdisk(const char *directory, uint64_t *freed);
+static void reap_state(char (*steps)[STEP_NAME_LEN], int n_steps);
+static int get_live_steps(char (*steps)[STEP_NAME_LEN], int max);
+static int is_live(const char *name, char (*steps)[STEP_NAME_LEN],
+                   int n_steps);
+static int detach_ramdisk(const char *directory, const char *device);
+static void leave_job_cgroup(void);
+static int unmount_ramdisk(spank_t sp, const char *directory);
+static int kill_holders(const char *directory, int signal);
+static int path_within(const char *path, const char *directory);
+static int drain_node(spank_t sp, const char *reason);
+static uint64_t timing_now(void);
+static void timing_add(enum timing_phase phase, uint64_t start);
+static void report_timings(spank_t sp);
+static int append_line(const char *path, const char *line, int length);
+static int start_usage_monitor(spank_t sp);
+static void stop_usage_monitor(void);
+static void *usage_monitor(void *arg);
+static void sample_usage(void);
+static void report_usage(spank_t sp);
+static void get_visible_path(const char *directory, char path[]);
+static void check_resize(void);
+static int read_resize_request(const char *path, uint64_t *size);
+static int remount_ramdisk(const char *directory, uint64_t size);
+static int get_memory_headroom(uint64_t *headroom);
+static uint64_t get_headroom(uint64_t allocation);
+static uint64_t get_allocation(uint64_t size);
+static int check_cgroup_memory(spank_t sp, uint64_t size, uint64_t headroom);
+static int read_memory_limit(const char *cgroup, uint64_t *limit,
+                             uint64_t *used);
+static int set_charge(spank_t sp);
+static int charge_job_memory(spank_t sp, int64_t size);
+static int adjust_charge(int64_t size);
+static void check_charge(void);
+static int read_charge_limit(uint64_t *limit);
+static int read_memory_stat(const char *path, const char *key,
+                            uint64_t *value);
+static int read_meminfo(const char *key, uint64_t *value);
+static int mount_tmpfs(const char *directory, uint64_t size, uid_t uid,
+                       gid_t gid, const char *policy);
+static int mount_block(const char *directory, uint64_t size, uid_t uid,
+                       gid_t gid, const struct block_filesystem *filesystem);
+static int prefault_ramdisks(spank_t sp);
+static int prefault_ramdisk(const char *directory, const unsigned char nodes[],
+                            struct prefault_holder *holder);
+static int hold_placeholders(const char *directory,
+                             const unsigned char nodes[], int socket);
+static int fill_placeholders(const char *directory,
+                             const unsigned char nodes[],
+                             struct prefault_thread threads[]);
+static void *prefault_worker(void *arg);
+static void release_prefault(void);
+static void stop_prefault(void);
+static int create_zram(uint64_t size, uint64_t disksize, char device[]);
+static int release_zram(const char *device);
+static int read_zram_stat(const char *device, int field, uint64_t *value);
+static int get_ramdisk_device(const char *directory, char device[]);
+static void set_ramdisk_env(spank_t sp, const char *directory);
+static int mount_image(spank_t sp, const char *directory, uid_t uid);
+static int stage_image(void *paths);
+static const char *get_image_type(int fd);
+static int attach_loop(int file, const char *image, char device[]);
+static void unmount_submounts(const char *directory);
+static int mount_overlay(spank_t sp, const char *directory, uid_t uid,
+                         gid_t gid);
+static int check_readable(void *path);
+static int is_overlay(const char *directory);
+static int mount_cache(spank_t sp, const char *directory, uid_t uid,
+                       gid_t gid);
+static int hold_cache(spank_t sp, const char *directory, const char *target);
+static int fill_cache(spank_t sp, const char *key, uid_t uid, gid_t gid);
+static uint64_t evict_cache(uint64_t needed);
+static int measure_dataset(void *bytes);
+static int measure_entry(const char *path, const struct stat *sb, int type,
+                         struct FTW *ftw);
+static void release_cache(const char *directory);
+static int lock_cache(void);
+static void get_cache_key(uid_t uid, const struct stat *st, char key[]);
+static int write_sysfs(const char *path, const char *value);
+static int run_command(char *const argv[]);
+static int check_shmem_thp(void);
+static int get_mount_policy(spank_t sp, char policy[], size_t length);
+static int get_step_nodes(spank_t sp, unsigned char nodes[]);
+static int get_cgroup_path(spank_t sp, const char *controller, char path[]);
+static int read_file(const char *path, char buffer[], size_t length);
+static int parse_list(const char *list, unsigned char set[], int max);
+static void format_list(const unsigned char set[], int max, char buffer[],
+                        size_t length);
+static int run_as_user(spank_t sp, int (*fn)(void *), void *arg,
+                       int timeout_seconds);
+static char *join_path(const char *directory, const char *name);
+static int stage_in(void *paths);
+static int stage_out(void *paths);
+static int copy_range(int in, int out, off_t offset, off_t length);
+static int copy_tree(struct copy_engine *engine, const char *src,
+                     const char *dst);
+
+static struct spank_option ramdisk_options[] = {
+    {.name = SPANK_OPTION_NAME,
+     .arginfo = "N[MG]",
+     .usage = "Create a RAM disk of N (MB, GB), allocating as "
+              "a portion of the memory requested.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_ramdisk_size},
+    {.name = SPANK_OPTION_STAGE_IN,
+     .arginfo = "SRC",
+     .usage = "Copy the file or directory contents at SRC into the RAM disk "
+              "before the tasks launch.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_stage_in},
+    {.name = SPANK_OPTION_STAGE_OUT,
+     .arginfo = "DEST",
+     .usage = "Copy the RAM disk contents into DEST when the step exits, "
+              "skipping files that are already up to date.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_stage_out},
+    {.name = SPANK_OPTION_HUGE,
+     .arginfo = "never|always|within_size|advise",
+     .usage = "Transparent huge page policy for the RAM disk (tmpfs huge=).",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_huge},
+    {.name = SPANK_OPTION_MPOL,
+     .arginfo = "bind|interleave|prefer|default[:NODES]",
+     .usage = "NUMA memory policy for the RAM disk (tmpfs mpol=). NODES "
+              "defaults to the memory nodes of the step's cpuset.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_mpol},
+    {.name = SPANK_OPTION_NUMA,
+     .arginfo = NULL,
+     .usage = "Split the RAM disk into one per NUMA node of the step, giving "
+              "each task the RAM disk local to its CPUs.",
+     .has_arg = 0,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_numa},
+    {.name = SPANK_OPTION_SCOPE,
+     .arginfo = "step|job",
+     .usage = "Lifetime of the RAM disk - the step (default), or the whole "
+              "allocation, shared with every step of the job on the node.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_scope},
+    {.name = SPANK_OPTION_TEARDOWN,
+     .arginfo = "sync|async",
+     .usage = "Unmount the RAM disk before the step completes (sync, default), "
+              "or detach it and free the memory in the background (async).",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_teardown},
+    {.name = SPANK_OPTION_COMPRESS,
+     .arginfo = "lz4|zstd",
+     .usage = "Compress the RAM disk (a zram device) with the given algorithm, "
+              "fitting more data in the same memory.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_compress},
+    {.name = SPANK_OPTION_FS,
+     .arginfo = "tmpfs|ext4|xfs",
+     .usage = "Filesystem for the RAM disk - tmpfs (default), or ext4 or xfs "
+              "on a memory-backed block device, e.g. for O_DIRECT.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_fs},
+    {.name = SPANK_OPTION_IMAGE,
+     .arginfo = "PATH",
+     .usage = "Load the SquashFS or EROFS image at PATH into the RAM disk, and "
+              "mount it read-only at $SLURM_JOB_RAMDISK/image.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_image},
+    {.name = SPANK_OPTION_OVERLAY,
+     .arginfo = "LOWERDIR",
+     .usage = "Overlay the RAM disk on LOWERDIR, reading unmodified files from "
+              "it and keeping changes in RAM.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_overlay},
+    {.name = SPANK_OPTION_CACHE,
+     .arginfo = "SRC",
+     .usage = "Share a read-only copy of SRC, cached in RAM on the node, with "
+              "your other jobs, at $SLURM_JOB_RAMDISK/cache.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_cache},
+    {.name = SPANK_OPTION_NAMESPACE,
+     .arginfo = "global|private|tmp",
+     .usage = "Mount the RAM disk for all to see (global, default), or only in "
+              "the step's own mount namespace (private), also over /tmp and "
+              "/dev/shm (tmp).",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_namespace},
+    {.name = SPANK_OPTION_PREFAULT,
+     .arginfo = NULL,
+     .usage = "Commit all of the RAM disk's memory before the tasks start, "
+              "failing the step if the node can't provide it.",
+     .has_arg = 0,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_prefault},
+    {.name = SPANK_OPTION_AUTOGROW,
+     .arginfo = "N[MG]",
+     .usage = "Grow the RAM disk as it fills, up to N (MB, GB) in total, while "
+              "the step's memory allows.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_autogrow},
+    {.name = SPANK_OPTION_HEADROOM,
+     .arginfo = "N[MG]|P%",
+     .usage = "Memory to keep free of the RAM disk for the application, as N "
+              "(MB, GB) or P% of the allocation.",
+     .has_arg = 1,
+     .val = 0,
+     .cb = (spank_opt_cb_f)parse_headroom},
+    SPANK_OPTIONS_TABLE_END};
 
 /**
- * @brief SPANK init hook to register the `--ramdisk` option
+ * @brief SPANK init hook to register the `--ramdisk` options
  * Called as the plugin loads, prior to option parsing options.
  * Clears any environment variables related to the ramdisk (path and size)
  *
- * Registers the `--ramdisk` option within allocator, remote, and local
- * contexts. That is, registers it for `sbatch`, and `srun` primarily.
+ * Registers the `--ramdisk` options within allocator, remote, and local
+ * contexts. That is, registers them for `sbatch`, and `srun` primarily.
  * Returns the register function success or failure.
  *
  * @param sp the spank instance
- * @param ac argument count passed in `plugstack.conf` (0 for this plugin)
- * @param av argument values passed in `plugstack.conf` (none)
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
  * @return int
  */
 int slurm_spank_init(spank_t sp, int ac, char **av) {
@@ -66,84 +930,238 @@ int slurm_spank_init(spank_t sp, int ac, char **av) {
   // drop the ramdisk path environment variable - it'll be set if we create one
   // in the step.
   spank_unsetenv(sp, "SLURM_JOB_RAMDISK");
+  spank_unsetenv(sp, "SLURM_JOB_RAMDISK_IMAGE");
+  spank_unsetenv(sp, "SLURM_JOB_RAMDISK_CACHE");
+  spank_unsetenv(sp, "SLURM_JOB_RAMDISK_RESIZE");
+
+  if (parse_plugin_args(ac, av) != EXIT_SUCCESS) {
+    return ESPANK_ERROR;
+  }
 
   spank_context_t context = spank_context();
 
   if (context == S_CTX_ALLOCATOR || context == S_CTX_REMOTE ||
       context == S_CTX_LOCAL) {
-    // register the `--ramdisk` option for allocator (sbatch), remote (compute
+    // register the `--ramdisk` options for allocator (sbatch), remote (compute
     // node steps), and local (srun, prior to offloading to remote)
-    struct spank_option ramdisk_option = {
-        .name = SPANK_OPTION_NAME,
-        .arginfo = "N[MG]",
-        .usage = "Create a RAM disk of N (MB, GB), allocating as "
-                 "a portion of the memory requested.",
-        .has_arg = 1,
-        .val = 0,
-        .cb = (spank_opt_cb_f)parse_ramdisk_size};
+    for (struct spank_option *option = ramdisk_options; option->name != NULL;
+         option++) {
+      spank_err_t rc = spank_option_register(sp, option);
+      if (rc != ESPANK_SUCCESS) {
+        return rc;
+      }
+    }
+  }
+
+  return ESPANK_SUCCESS;
+}
 
-    return spank_option_register(sp, &ramdisk_option);
+/**
+ * @brief SPANK slurmd init hook which reaps orphaned RAM disks
+ * Called as slurmd starts. Steps whose slurmstepd was killed (or that were
+ * running when the node went down without rebooting) never reach the exit
+ * hook, leaving their RAM disks mounted - so those are torn down now, and
+ * then periodically in the background. The ledger's reserved count drifts the
+ * same way, so it's then recounted from the RAM disks still mounted.
+ *
+ * Returns failure only on invalid `plugstack.conf` arguments.
+ *
+ * @param sp the spank instance
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
+ * @return int
+ */
+int slurm_spank_slurmd_init(spank_t sp, int ac, char **av) {
+  if (parse_plugin_args(ac, av) != EXIT_SUCCESS) {
+    return ESPANK_ERROR;
   }
 
+  reap_orphans();
+  reconcile_node_ledger();
+  start_reaper();
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief SPANK slurmd exit hook which stops the orphan reaper
+ *
+ * @param sp the spank instance
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
+ * @return int
+ */
+int slurm_spank_slurmd_exit(spank_t sp, int ac, char **av) {
+  stop_reaper();
   return ESPANK_SUCCESS;
 }
 
 /**
  * @brief SPANK post init hook which creates and mounts the RAM disk
  * Creates a RAM disk within the remote context (slurmstepd), when requested.
+ * In the allocator and local contexts (`sbatch`/`salloc`/`srun`), instead
+ * checks the RAM disk fits the requested memory, rejecting the job early.
  * RAM disk path is stored in the job environment variable `SLURM_JOB_RAMDISK`.
  * The filesystem is created as a `tmpfs` mount, owned by the job user/group.
  *
  * Returns failure if any steps error (which terminates the job).
  *
  * @param sp the spank instance
- * @param ac argument count passed in `plugstack.conf` (0 for this plugin)
- * @param av argument values passed in `plugstack.conf` (none)
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
  * @return int
  */
 int slurm_spank_init_post_opt(spank_t sp, int ac, char **av) {
-  if (spank_context() != S_CTX_REMOTE) {
+  spank_context_t context = spank_context();
+  if ((context == S_CTX_ALLOCATOR || context == S_CTX_LOCAL) &&
+      ramdisk_size > 0) {
+    // reject requests that can never fit before they're queued
+    return check_memory_request() == EXIT_SUCCESS ? ESPANK_SUCCESS
+                                                  : ESPANK_ERROR;
+  }
+
+  if (context != S_CTX_REMOTE) {
     // ensure we only perform mounts on the remote - i.e., on the compute node
     return ESPANK_SUCCESS;
   }
 
+  // every later hook in the step uses its partition's settings
+  char partition[PARTITION_NAME_LEN] = {0};
+  if (n_configs > 1 &&
+      spank_getenv(sp, "SLURM_JOB_PARTITION", partition, sizeof(partition)) !=
+          ESPANK_SUCCESS) {
+    partition[0] = '\0';
+  }
+  select_config(partition);
+
   if (ramdisk_size == 0) {
-    // we've been called without the `--ramdisk` argument
-    slurm_verbose("ramdisk.c: called without the ramdisk argument");
+    // steps of a job with a job scoped ramdisk share it
+    if (attach_job_ramdisk(sp) != EXIT_SUCCESS) {
+      // we've been called without the `--ramdisk` argument
+      slurm_verbose("ramdisk.c: called without the ramdisk argument");
+    } else {
+      start_usage_monitor(sp);
+    }
     return ESPANK_SUCCESS;
   }
 
-  // check memory allocation exceeds ramdisk size
+  if (ramdisk_job_scope && ramdisk_numa) {
+    slurm_error("ramdisk.c: --ramdisk-numa cannot be job scoped");
+    return ESPANK_ERROR;
+  }
+  const struct block_filesystem *filesystem = get_block_filesystem();
+  if (ramdisk_compress[0] != '\0' && filesystem == NULL) {
+    slurm_error("ramdisk.c: --ramdisk-compress needs --ramdisk-fs=ext4|xfs");
+    return ESPANK_ERROR;
+  }
+  if (filesystem != NULL && ramdisk_numa) {
+    slurm_error("ramdisk.c: --ramdisk-numa needs a tmpfs ramdisk");
+    return ESPANK_ERROR;
+  }
+  // a private ramdisk lives and dies with its step's namespace - it can't be
+  // shared with other steps, or own anything that outlives the namespace
+  if (ramdisk_namespace &&
+      (ramdisk_job_scope || filesystem != NULL || ramdisk_cache[0] != '\0')) {
+    slurm_error("ramdisk.c: --ramdisk-namespace needs a step scoped tmpfs "
+                "ramdisk, without --ramdisk-cache");
+    return ESPANK_ERROR;
+  }
+
+  if (config->max_size > 0 && ramdisk_size > config->max_size) {
+    slurm_error("ramdisk.c: cannot create ramdisk of size %" PRIu64
+                "M, as ramdisks may be at most %" PRIu64 "M%s%s",
+                ramdisk_size, config->max_size,
+                config->partition[0] != '\0' ? " in partition " : "",
+                config->partition);
+    return ESPANK_ERROR;
+  }
+  if (config->max_size > 0 && ramdisk_autogrow > config->max_size) {
+    slurm_info("ramdisk.c: growing the ramdisk up to %" PRIu64
+               "M at most, rather than --ramdisk-autogrow=%" PRIu64 "M",
+               config->max_size, ramdisk_autogrow);
+    ramdisk_autogrow = config->max_size;
+  }
+
+  uint64_t hook_start = timing_now();
+  int rc = ESPANK_SUCCESS;
+
+  // check memory allocation exceeds ramdisk size, plus the headroom
   // the ramdisk debits from the memory allocation, hence if greater or equal
   // there will be no memory for the job itself
+  uint64_t start = timing_now();
   uint64_t step_memory_allocation;
   if (spank_get_item(sp, S_STEP_ALLOC_MEM, &step_memory_allocation) !=
       ESPANK_SUCCESS) {
     slurm_error("ramdisk.c: failed to get step memory allocation");
     return ESPANK_ERROR;
   }
-  if (step_memory_allocation <= ramdisk_size) {
-    // perhaps require ramdisk to be at least 1G less than allocation?
+  timing_add(TIMING_GET_ITEM, start);
+  uint64_t headroom = get_headroom(step_memory_allocation);
+  if (step_memory_allocation <= ramdisk_size + headroom) {
     slurm_error("ramdisk.c: cannot create ramdisk of size %" PRIu64
-                "M when allocated %" PRIu64 "M",
-                ramdisk_size, step_memory_allocation);
+                "M when allocated %" PRIu64 "M, as %" PRIu64
+                "M must be left for the job (--ramdisk-headroom)",
+                ramdisk_size, step_memory_allocation, headroom);
+    return ESPANK_ERROR;
+  }
+
+  // the allocation is only a limit - the step's (and job's) cgroup may already
+  // hold other steps' RAM disks, or the memory of processes already running
+  if (check_cgroup_memory(sp, ramdisk_size, headroom) != EXIT_SUCCESS) {
     return ESPANK_ERROR;
   }
 
-  // get directory path
+  // don't admit a ramdisk against memory still being freed from earlier ones
+  if (wait_for_reclaim(ramdisk_size) != EXIT_SUCCESS) {
+    return ESPANK_ERROR;
+  }
+
+  // in NUMA mode, we create one ramdisk per memory node of the step, splitting
+  // the size between them
+  uint64_t size = ramdisk_size;
+  if (ramdisk_numa) {
+    unsigned char nodes[NUMA_MAX_NODES];
+    char online[MOUNT_OPTION_LEN];
+    if (get_step_nodes(sp, nodes) <= 0 &&
+        (read_file(NUMA_ONLINE, online, sizeof(online)) != EXIT_SUCCESS ||
+         parse_list(online, nodes, NUMA_MAX_NODES) <= 0)) {
+      slurm_error("ramdisk.c: unable to determine the step's NUMA nodes");
+      return ESPANK_ERROR;
+    }
+    n_ramdisk_numa_nodes = 0;
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+      if (nodes[node]) {
+        ramdisk_numa_nodes[n_ramdisk_numa_nodes++] = node;
+      }
+    }
+
+    size = ramdisk_size / n_ramdisk_numa_nodes;
+    if (size == 0) {
+      slurm_error("ramdisk.c: ramdisk too small to split across %d NUMA nodes",
+                  n_ramdisk_numa_nodes);
+      return ESPANK_ERROR;
+    }
+    if (ramdisk_mpol[0] != '\0') {
+      slurm_info("ramdisk.c: ignoring --ramdisk-mpol, each NUMA ramdisk is "
+                 "bound to its node");
+    }
+  }
+
+  // get directory path - in NUMA mode, the first node's ramdisk is the default
+  // until each task picks its local one
+  start = timing_now();
   char directory[DIRECTORY_PATH_LEN];
-  if (get_directory(sp, directory) != EXIT_SUCCESS) {
+  if (get_ramdisk_directory(sp, 0, directory) != EXIT_SUCCESS) {
     return ESPANK_ERROR;
   }
+  timing_add(TIMING_GET_DIRECTORY, start);
   slurm_verbose("ramdisk.c: using directory %s", directory);
 
   // set environment variable for access within the compute job
-  if (spank_setenv(sp, "SLURM_JOB_RAMDISK", directory, 1) != ESPANK_SUCCESS) {
-    slurm_error("ramdisk.c: unable to set SLURM_JOB_RAMDISK=%s", directory);
-  }
+  set_ramdisk_env(sp, directory);
 
   // get UID and GID for our mount (before we start doing actual filesystem
   // operations)
+  start = timing_now();
   uid_t uid;
   gid_t gid;
   if (spank_get_item(sp, S_JOB_UID, &uid) != ESPANK_SUCCESS) {
@@ -156,37 +1174,195 @@ int slurm_spank_init_post_opt(spank_t sp, int ac, char **av) {
     // defined for the mount, assumes no other users access the same share
     gid = -1;
   }
+  timing_add(TIMING_GET_ITEM, start);
 
-  // now we do the actual filesystem operations
-  slurm_info("ramdisk.c: creating a ramdisk - %" PRIu64 "M at %s", ramdisk_size,
-             directory);
+  // the partition's defaults cover what the job didn't ask for
+  if (filesystem == NULL && ramdisk_huge[0] == '\0') {
+    strcpy(ramdisk_huge, config->default_huge);
+  }
+  if (filesystem == NULL && !ramdisk_numa && ramdisk_mpol[0] == '\0') {
+    strcpy(ramdisk_mpol, config->default_mpol);
+    strcpy(ramdisk_mpol_nodes, config->default_mpol_nodes);
+  }
 
-  // check if the directory exists - if it does assume we're done
-  struct stat sb;
-  if (stat(directory, &sb) == 0) {
-    if (!S_ISDIR(sb.st_mode)) {
-      slurm_error("ramdisk.c: directory path exists but is not dir");
+  // fail before touching the filesystem if huge pages can't be honoured
+  if (filesystem != NULL) {
+    if (ramdisk_huge[0] != '\0' || ramdisk_mpol[0] != '\0' ||
+        ramdisk_prefault) {
+      slurm_info("ramdisk.c: ignoring --ramdisk-huge, --ramdisk-mpol and "
+                 "--ramdisk-prefault for a %s ramdisk",
+                 filesystem->type);
+    }
+  } else if (ramdisk_huge[0] != '\0' && strcmp(ramdisk_huge, "never") != 0 &&
+             check_shmem_thp() != EXIT_SUCCESS) {
+    return ESPANK_ERROR;
+  }
+
+  // place pages on the step's memory nodes, rather than wherever they're
+  // first touched
+  char mount_policy[MOUNT_OPTION_LEN] = {0};
+  if (!ramdisk_numa && filesystem == NULL &&
+      get_mount_policy(sp, mount_policy, sizeof(mount_policy)) !=
+          EXIT_SUCCESS) {
+    return ESPANK_ERROR;
+  }
+
+  // concurrent steps' RAM disks must fit in the job's allocation together -
+  // job scoped ones are reserved once, by the step creating them
+  if (!ramdisk_job_scope) {
+    int lock = lock_job(sp);
+    if (lock < 0) {
       return ESPANK_ERROR;
     }
-    slurm_verbose(
-        "ramdisk.c: directory path exists, assuming we've already mounted it");
+    int status = reserve_job_memory(sp, ramdisk_size);
+    close(lock);
+    if (status != EXIT_SUCCESS) {
+      return ESPANK_ERROR;
+    }
+  }
+
+  // job scoped ramdisks are only prefaulted by the step creating them
+  int created = !ramdisk_job_scope;
+  if (ramdisk_namespace) {
+    if (start_namespace(sp, size, uid, gid, mount_policy) != EXIT_SUCCESS) {
+      rc = ESPANK_ERROR;
+    }
+  } else if (!ramdisk_job_scope) {
+    if (create_ramdisks(sp, size, uid, gid, mount_policy) != EXIT_SUCCESS) {
+      rc = ESPANK_ERROR;
+    }
+  } else {
+    // job scoped - the first step (usually extern or batch) creates it, and
+    // every step holds it while running. we keep the job locked until the
+    // ramdisk is fully populated, so no step sees a partial stage-in.
+    int lock = lock_job(sp);
+    if (lock < 0) {
+      return ESPANK_ERROR;
+    }
+    char holders[PATH_MAX];
+    struct stat sb;
+    int status = get_state_path(sp, ".job.holders", holders);
+    if (status == EXIT_SUCCESS && stat(holders, &sb) != 0) {
+      status = reserve_job_memory(sp, ramdisk_size);
+      if (status == EXIT_SUCCESS) {
+        status = create_ramdisks(sp, size, uid, gid, mount_policy);
+      }
+      created = status == EXIT_SUCCESS;
+      if (status != EXIT_SUCCESS) {
+        release_node_memory(release_reservation());
+      }
+    } else {
+      slurm_verbose("ramdisk.c: job ramdisk already exists, sharing it");
+    }
+    if (status == EXIT_SUCCESS) {
+      status = hold_job_ramdisk(sp);
+    }
+    close(lock);
+    if (status != EXIT_SUCCESS) {
+      rc = ESPANK_ERROR;
+    }
+  }
+
+  // commit the memory once any stage-in's done - and with the job unlocked,
+  // as the holders outlive this hook
+  if (rc == ESPANK_SUCCESS && created && ramdisk_prefault &&
+      filesystem == NULL && prefault_ramdisks(sp) != EXIT_SUCCESS) {
+    rc = ESPANK_ERROR;
+  }
+
+  // a step scoped ramdisk that failed gives back its reservation here, rather
+  // than leaving it to the exit hook - to the node as well, even if the job's
+  // ledger can't be locked, as nothing else would
+  if (rc != ESPANK_SUCCESS && !ramdisk_job_scope) {
+    int lock = lock_job(sp);
+    release_reservation();
+    release_node_memory(ramdisk_size);
+    if (lock >= 0) {
+      close(lock);
+    }
+  }
+
+  if (rc == ESPANK_SUCCESS) {
+    start_usage_monitor(sp);
+  }
+
+  timing_add(TIMING_INIT_POST_OPT, hook_start);
+  return rc;
+}
+
+/**
+ * @brief SPANK privileged task init hook which moves tasks into the step's
+ * mount namespace
+ * With `--ramdisk-namespace`, the RAM disk is only mounted in the namespace of
+ * the step, which each task joins (as root) before it executes. The task's
+ * working directory is kept.
+ *
+ * Returns failure if the task can't join, as it would see no RAM disk.
+ *
+ * @param sp the spank instance
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
+ * @return int
+ */
+int slurm_spank_task_init_privileged(spank_t sp, int ac, char **av) {
+  if (namespace_holder <= 0) {
     return ESPANK_SUCCESS;
   }
 
-  // create the ramdisk directory
-  if (mkdir(directory, INITIAL_DIR_MODE_RWX) != 0) {
-    slurm_error("ramdisk.c: failed to create directory");
-    return ESPANK_ERROR;
+  // the task mustn't keep the namespace alive
+  close(namespace_pipe);
+  return enter_namespace() == EXIT_SUCCESS ? ESPANK_SUCCESS : ESPANK_ERROR;
+}
+
+/**
+ * @brief SPANK task init hook which points each task at its local RAM disk
+ * In `--ramdisk-numa` mode, sets `SLURM_JOB_RAMDISK` to the RAM disk of the
+ * NUMA node holding most of the CPUs the task is bound to. Called within the
+ * task after CPU binding.
+ *
+ * Returns success regardless, leaving the step default in place on failure.
+ *
+ * @param sp the spank instance
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
+ * @return int
+ */
+int slurm_spank_task_init(spank_t sp, int ac, char **av) {
+  if (ramdisk_size == 0 || !ramdisk_numa || n_ramdisk_numa_nodes < 2) {
+    return ESPANK_SUCCESS;
   }
 
-  // mount tmpfs
-  char mount_options[MOUNT_OPTION_LEN];
-  snprintf(mount_options, MOUNT_OPTION_LEN,
-           "size=%" PRIu64 "M,uid=%d,gid=%d,mode=700", ramdisk_size, uid, gid);
-  if (mount(MOUNT_SOURCE_VIRTUAL, directory, MOUNT_TYPE_TEMP, MOUNT_FLAGS_NONE,
-            mount_options) != 0) {
-    slurm_error("ramdisk.c: failed to mount tmpfs");
-    return ESPANK_ERROR;
+  cpu_set_t affinity;
+  if (sched_getaffinity(0, sizeof(affinity), &affinity) != 0) {
+    slurm_verbose("ramdisk.c: unable to get task affinity");
+    return ESPANK_SUCCESS;
+  }
+
+  int best = 0;
+  int best_count = 0;
+  for (int i = 0; i < n_ramdisk_numa_nodes; i++) {
+    char path[PATH_MAX];
+    char list[MOUNT_OPTION_LEN];
+    unsigned char cpus[NUMA_MAX_CPUS];
+    snprintf(path, sizeof(path), NUMA_NODE_CPULIST, ramdisk_numa_nodes[i]);
+    if (read_file(path, list, sizeof(list)) != EXIT_SUCCESS ||
+        parse_list(list, cpus, NUMA_MAX_CPUS) < 0) {
+      continue;
+    }
+
+    int count = 0;
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+      count += cpus[cpu] && CPU_ISSET(cpu, &affinity);
+    }
+    if (count > best_count) {
+      best = i;
+      best_count = count;
+    }
+  }
+
+  char directory[DIRECTORY_PATH_LEN];
+  if (get_ramdisk_directory(sp, best, directory) == EXIT_SUCCESS) {
+    set_ramdisk_env(sp, directory);
   }
 
   return ESPANK_SUCCESS;
@@ -199,8 +1375,8 @@ int slurm_spank_init_post_opt(spank_t sp, int ac, char **av) {
  * Returns failure if any steps error (which terminates the job).
  *
  * @param sp the spank instance
- * @param ac argument count passed in `plugstack.conf` (0 for this plugin)
- * @param av argument values passed in `plugstack.conf` (none)
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
  * @return int
  */
 int slurm_spank_exit(spank_t sp, int ac, char **av) {
@@ -209,44 +1385,60 @@ int slurm_spank_exit(spank_t sp, int ac, char **av) {
     return ESPANK_SUCCESS;
   }
 
-  if (ramdisk_size == 0) {
-    // we've been called without the `--ramdisk` argument
-    slurm_verbose("ramdisk.c: called without the ramdisk argument");
-    return ESPANK_SUCCESS;
-  }
+  uint64_t hook_start = timing_now();
 
-  // get directory path
-  char directory[DIRECTORY_PATH_LEN];
-  if (get_directory(sp, directory) != EXIT_SUCCESS) {
-    return ESPANK_ERROR;
+  // take a last sample before anything is staged out or torn down
+  if (usage.n_directories > 0) {
+    stop_usage_monitor();
+    report_usage(sp);
   }
-  slurm_verbose("ramdisk.c: using directory %s", directory);
+  stop_prefault();
 
-  slurm_info("ramdisk.c: deleting the ramdisk - %s", directory);
-
-  // check if the directory exists - if it doesn't assume we're done
-  struct stat sb;
-  if (stat(directory, &sb) == -1) {
-    slurm_verbose(
-        "ramdisk.c: directory path missing, assuming we've already deleted it");
+  // job scoped ramdisks are only torn down by the last step holding them,
+  // keeping the job locked so no step attaches mid-teardown
+  int lock = -1;
+  if (ramdisk_job_scope) {
+    lock = lock_job(sp);
+    if (lock < 0) {
+      return ESPANK_ERROR;
+    }
+    if (release_job_ramdisk(sp) != EXIT_SUCCESS) {
+      close(lock);
+      timing_add(TIMING_EXIT, hook_start);
+      report_timings(sp);
+      return ESPANK_SUCCESS;
+    }
+  } else if (ramdisk_size == 0) {
+    // we've been called without the `--ramdisk` argument
+    slurm_verbose("ramdisk.c: called without the ramdisk argument");
     return ESPANK_SUCCESS;
   }
 
-  // unmount tmpfs
-  if (umount(directory) != 0) {
-    slurm_error("ramdisk.c: failed to unmount tmpfs, attempting to drain node");
-    // ideally need a nicer way to drain the node...
-    system("scontrol update nodename=$(hostname -s) state=DRAIN reason='failed "
-           "to unmount ramdisk'");
-    return ESPANK_ERROR;
+  int rc = ESPANK_SUCCESS;
+  if ((namespace_holder > 0 ? stop_namespace(sp) : destroy_ramdisks(sp)) !=
+      EXIT_SUCCESS) {
+    rc = ESPANK_ERROR;
   }
 
-  // delete directory path
-  if (rmdir(directory) != 0) {
-    slurm_error("ramdisk.c: failed to delete tmpfs directory");
+  // the last holder of a job scoped ramdisk releases it for the job. the lock
+  // file stays, as a step blocked on it would otherwise lock an unlinked file
+  // while a newcomer locks a new one - slurmd removes it once the job's gone
+  if (lock >= 0) {
+    if (set_reservation(sp) == EXIT_SUCCESS) {
+      release_node_memory(release_reservation());
+    }
+    close(lock);
+  } else if (reservation.entry[0] != '\0') {
+    lock = lock_job(sp);
+    release_node_memory(release_reservation());
+    if (lock >= 0) {
+      close(lock);
+    }
   }
 
-  return ESPANK_SUCCESS;
+  timing_add(TIMING_EXIT, hook_start);
+  report_timings(sp);
+  return rc;
 }
 
 /**
@@ -291,50 +1483,6563 @@ static int parse_ramdisk_size(int val, const char *optarg, int remote) {
 }
 
 /**
- * @brief Generate our RAM disk path
- * Creates a path specific to the job and step (including magic step IDs),
- * stored into the `directory` parameter.
- *
- * Returns failure if we fail to get the job or step ID, or get an invalid
- * value.
+ * @brief Stores the `--ramdisk-stage-in` source path
+ * Callback for the `--ramdisk-stage-in` flag. The path must be absolute, as it
+ * is resolved on the compute node rather than the submission directory.
  *
- * @param sp the spank instance
- * @param directory the char array we write our directory path into
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-stage-in` flag value string
+ * @param remote flag indicating remote context
  * @return int
  */
-static int get_directory(spank_t sp, char directory[]) {
-  // get job ID and job step ID
+static int parse_stage_in(int val, const char *optarg, int remote) {
+  if (optarg == NULL || optarg[0] != '/') {
+    slurm_error("ramdisk.c: --ramdisk-stage-in requires an absolute path");
+    return ESPANK_ERROR;
+  }
+  if (strlen(optarg) >= sizeof(stage_in_source)) {
+    slurm_error("ramdisk.c: --ramdisk-stage-in path is too long");
+    return ESPANK_ERROR;
+  }
+
+  strcpy(stage_in_source, optarg);
+  slurm_verbose("ramdisk.c: staging in from %s", stage_in_source);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-image` image path
+ * Callback for the `--ramdisk-image` flag. The path must be absolute, as it is
+ * resolved on the compute node rather than the submission directory.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-image` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_image(int val, const char *optarg, int remote) {
+  if (optarg == NULL || optarg[0] != '/') {
+    slurm_error("ramdisk.c: --ramdisk-image requires an absolute path");
+    return ESPANK_ERROR;
+  }
+  if (strlen(optarg) >= sizeof(ramdisk_image)) {
+    slurm_error("ramdisk.c: --ramdisk-image path is too long");
+    return ESPANK_ERROR;
+  }
+
+  strcpy(ramdisk_image, optarg);
+  slurm_verbose("ramdisk.c: loading the image %s", ramdisk_image);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-overlay` lower directory
+ * Callback for the `--ramdisk-overlay` flag. The path must be absolute, as it
+ * is resolved on the compute node, and can't contain the `,` or `:` overlay
+ * option separators.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-overlay` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_overlay(int val, const char *optarg, int remote) {
+  if (optarg == NULL || optarg[0] != '/') {
+    slurm_error("ramdisk.c: --ramdisk-overlay requires an absolute path");
+    return ESPANK_ERROR;
+  }
+  if (strpbrk(optarg, ",:") != NULL) {
+    slurm_error("ramdisk.c: --ramdisk-overlay path can't contain ',' or ':'");
+    return ESPANK_ERROR;
+  }
+  if (strlen(optarg) >= sizeof(ramdisk_overlay)) {
+    slurm_error("ramdisk.c: --ramdisk-overlay path is too long");
+    return ESPANK_ERROR;
+  }
+
+  strcpy(ramdisk_overlay, optarg);
+  slurm_verbose("ramdisk.c: overlaying %s", ramdisk_overlay);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-cache` dataset path
+ * Callback for the `--ramdisk-cache` flag. The path must be absolute, as it is
+ * resolved on the compute node rather than the submission directory.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-cache` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_cache(int val, const char *optarg, int remote) {
+  if (optarg == NULL || optarg[0] != '/') {
+    slurm_error("ramdisk.c: --ramdisk-cache requires an absolute path");
+    return ESPANK_ERROR;
+  }
+  if (strlen(optarg) >= sizeof(ramdisk_cache)) {
+    slurm_error("ramdisk.c: --ramdisk-cache path is too long");
+    return ESPANK_ERROR;
+  }
+
+  strcpy(ramdisk_cache, optarg);
+  slurm_verbose("ramdisk.c: caching %s", ramdisk_cache);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-namespace` mode
+ * Callback for the `--ramdisk-namespace` flag, accepting `global`, `private`,
+ * or `tmp`.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-namespace` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_namespace(int val, const char *optarg, int remote) {
+  if (optarg != NULL && strcmp(optarg, "global") == 0) {
+    ramdisk_namespace = 0;
+    ramdisk_namespace_tmp = 0;
+  } else if (optarg != NULL && strcmp(optarg, "private") == 0) {
+    ramdisk_namespace = 1;
+    ramdisk_namespace_tmp = 0;
+  } else if (optarg != NULL && strcmp(optarg, "tmp") == 0) {
+    ramdisk_namespace = 1;
+    ramdisk_namespace_tmp = 1;
+  } else {
+    slurm_error("ramdisk.c: invalid --ramdisk-namespace '%s', expected "
+                "global|private|tmp",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  slurm_verbose("ramdisk.c: ramdisk namespace is %s", optarg);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Enables `--ramdisk-prefault`
+ * Callback for the `--ramdisk-prefault` flag (which takes no value).
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the flag value string (unused)
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_prefault(int val, const char *optarg, int remote) {
+  ramdisk_prefault = 1;
+  slurm_verbose("ramdisk.c: prefaulting the ramdisk");
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-autogrow` limit
+ * Callback for the `--ramdisk-autogrow` flag, taking a size as `--ramdisk`.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-autogrow` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_autogrow(int val, const char *optarg, int remote) {
+  if (optarg == NULL ||
+      parse_memory(optarg, &ramdisk_autogrow) != EXIT_SUCCESS ||
+      ramdisk_autogrow == 0) {
+    slurm_error("ramdisk.c: invalid --ramdisk-autogrow '%s'",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  slurm_verbose("ramdisk.c: growing the ramdisk up to %" PRIu64 "M",
+                ramdisk_autogrow);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-headroom` memory left for the application
+ * Callback for the `--ramdisk-headroom` flag, taking a size as `--ramdisk`, or
+ * a percentage of the allocation (e.g. `10%`).
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-headroom` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_headroom(int val, const char *optarg, int remote) {
+  if (optarg == NULL ||
+      parse_share(optarg, &ramdisk_headroom, &ramdisk_headroom_percent) !=
+          EXIT_SUCCESS ||
+      ramdisk_headroom_percent >= 100) {
+    slurm_error("ramdisk.c: invalid --ramdisk-headroom '%s', expected N[MG] "
+                "or P%% (below 100)",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  slurm_verbose("ramdisk.c: keeping %s of the allocation for the job", optarg);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Parses the plugin's `plugstack.conf` arguments into `configs`
+ * Arguments are `name=value` pairs following the plugin path. Those before any
+ * `partition=NAME` apply to every job, and each partition's settings start
+ * from them, changed by the arguments following its `partition=`. Only parsed
+ * the first time we're called, as the plugin loads.
+ *
+ * Returns failure (with the reason logged) on an invalid argument.
+ *
+ * @param ac argument count passed in `plugstack.conf`
+ * @param av argument values passed in `plugstack.conf`
+ * @return int
+ */
+static int parse_plugin_args(int ac, char **av) {
+  if (config_loaded) {
+    return EXIT_SUCCESS;
+  }
+
+  struct ramdisk_config *target = &configs[0];
+  for (int i = 0; i < ac; i++) {
+    const char *value = strchr(av[i], '=');
+    if (value == NULL) {
+      slurm_error("ramdisk.c: invalid plugstack.conf argument '%s', expected "
+                  "name=value",
+                  av[i]);
+      return EXIT_FAILURE;
+    }
+    value++;
+
+    if (strncmp(av[i], PLUGIN_ARG_PARTITION "=",
+                strlen(PLUGIN_ARG_PARTITION "=")) != 0) {
+      if (parse_plugin_arg(target, av[i], value) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+
+    int duplicate = 0;
+    for (int j = 1; j < n_configs && !duplicate; j++) {
+      duplicate = strcmp(configs[j].partition, value) == 0;
+    }
+    if (value[0] == '\0' || strlen(value) >= PARTITION_NAME_LEN ||
+        duplicate || n_configs > CONFIG_MAX_PARTITIONS) {
+      slurm_error("ramdisk.c: invalid plugstack.conf argument '%s' (at most "
+                  "%d distinct partitions)",
+                  av[i], CONFIG_MAX_PARTITIONS);
+      return EXIT_FAILURE;
+    }
+    target = &configs[n_configs++];
+    *target = configs[0];
+    strcpy(target->partition, value);
+  }
+
+  // node-wide state stays with the root outside any partition
+  const char *root = configs[0].root;
+  snprintf(node_paths.state, PATH_MAX, "%s/" STATE_DIR_NAME, root);
+  snprintf(node_paths.ledger, PATH_MAX, "%s/" NODE_LEDGER_NAME,
+           node_paths.state);
+  snprintf(node_paths.cache, PATH_MAX, "%s/" CACHE_DIR_NAME, root);
+  snprintf(node_paths.cache_state, PATH_MAX, "%s/" CACHE_STATE_NAME,
+           node_paths.state);
+  snprintf(node_paths.cache_lock, PATH_MAX, "%s/" CACHE_LOCK_NAME,
+           node_paths.state);
+  if (USAGE_LOG_PATH[0] != '\0') {
+    snprintf(node_paths.usage_log, PATH_MAX, "%s", USAGE_LOG_PATH);
+  } else {
+    snprintf(node_paths.usage_log, PATH_MAX, "%s/" USAGE_LOG_NAME,
+             node_paths.state);
+  }
+
+  config_loaded = 1;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Applies a single `plugstack.conf` argument to a partition's settings
+ * `node_max` and `cache_max` are the same for every partition, so may only be
+ * given before any `partition=`.
+ *
+ * Returns failure (with the reason logged) on an invalid argument.
+ *
+ * @param target the settings we update
+ * @param arg the whole argument, `name=value`
+ * @param value the value within `arg`
+ * @return int
+ */
+static int parse_plugin_arg(struct ramdisk_config *target, const char *arg,
+                            const char *value) {
+  size_t length = (size_t)(value - arg - 1);
+  const char *expected = NULL;
+  char *end;
+
+  if (length == strlen(PLUGIN_ARG_ROOT) &&
+      strncmp(arg, PLUGIN_ARG_ROOT, length) == 0) {
+    length = strlen(value);
+    if (value[0] != '/' || length < 2 || value[length - 1] == '/' ||
+        length >= ROOT_PATH_LEN) {
+      expected = "an absolute path, without a trailing '/'";
+    } else {
+      strcpy(target->root, value);
+    }
+  } else if (length == strlen(PLUGIN_ARG_MODE) &&
+             strncmp(arg, PLUGIN_ARG_MODE, length) == 0) {
+    errno = 0;
+    unsigned long mode = strtoul(value, &end, 8);
+    if (errno != 0 || end == value || *end != '\0' || mode > 07777) {
+      expected = "an octal mode";
+    } else {
+      target->mode = (mode_t)mode;
+    }
+  } else if (length == strlen(PLUGIN_ARG_MAX_SIZE) &&
+             strncmp(arg, PLUGIN_ARG_MAX_SIZE, length) == 0) {
+    if (parse_memory(value, &target->max_size) != EXIT_SUCCESS) {
+      expected = "N[MGT]";
+    }
+  } else if (length == strlen(PLUGIN_ARG_MIN_HEADROOM) &&
+             strncmp(arg, PLUGIN_ARG_MIN_HEADROOM, length) == 0) {
+    if (parse_share(value, &target->min_headroom,
+                    &target->min_headroom_percent) != EXIT_SUCCESS ||
+        target->min_headroom_percent >= 100) {
+      expected = "N[MG] or P% (below 100)";
+    }
+  } else if (length == strlen(PLUGIN_ARG_DEFAULT_HUGE) &&
+             strncmp(arg, PLUGIN_ARG_DEFAULT_HUGE, length) == 0) {
+    if (parse_huge_mode(value, target->default_huge) != EXIT_SUCCESS) {
+      expected = "never|always|within_size|advise";
+    }
+  } else if (length == strlen(PLUGIN_ARG_DEFAULT_MPOL) &&
+             strncmp(arg, PLUGIN_ARG_DEFAULT_MPOL, length) == 0) {
+    if (parse_mpol_mode(value, target->default_mpol,
+                        target->default_mpol_nodes) != EXIT_SUCCESS) {
+      expected = "bind|interleave|prefer|default[:NODES]";
+    }
+  } else if (length == strlen(PLUGIN_ARG_NOSWAP) &&
+             strncmp(arg, PLUGIN_ARG_NOSWAP, length) == 0) {
+    if (strcmp(value, "yes") == 0 || strcmp(value, "no") == 0) {
+      target->noswap = strcmp(value, "yes") == 0;
+    } else {
+      expected = "yes|no";
+    }
+  } else if (length == strlen(PLUGIN_ARG_NODE_MAX) &&
+             strncmp(arg, PLUGIN_ARG_NODE_MAX, length) == 0) {
+    if (target != &configs[0]) {
+      slurm_error("ramdisk.c: %s covers the whole node, so can't be given "
+                  "for a partition",
+                  arg);
+      return EXIT_FAILURE;
+    } else if (parse_share(value, &node_max, &node_max_percent) !=
+                   EXIT_SUCCESS ||
+               node_max_percent > 100 ||
+               (node_max == 0 && node_max_percent == 0)) {
+      expected = "N[MG] or P% (up to 100)";
+    }
+  } else if (length == strlen(PLUGIN_ARG_CACHE_MAX) &&
+             strncmp(arg, PLUGIN_ARG_CACHE_MAX, length) == 0) {
+    if (target != &configs[0]) {
+      slurm_error("ramdisk.c: %s covers the whole node, so can't be given "
+                  "for a partition",
+                  arg);
+      return EXIT_FAILURE;
+    } else if (parse_memory(value, &cache_max) != EXIT_SUCCESS) {
+      expected = "N[MGT]";
+    }
+  } else {
+    slurm_error("ramdisk.c: unknown plugstack.conf argument '%s'", arg);
+    return EXIT_FAILURE;
+  }
+
+  if (expected != NULL) {
+    slurm_error("ramdisk.c: invalid plugstack.conf argument '%s', expected %s",
+                arg, expected);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Points `config` at the settings for the job's partition
+ * Jobs in a partition without settings of its own, or submitted to several,
+ * use the settings given before any `partition=`.
+ *
+ * @param partition the job's partition (empty if unknown)
+ */
+static void select_config(const char *partition) {
+  config = &configs[0];
+  for (int i = 1; i < n_configs; i++) {
+    if (strcmp(configs[i].partition, partition) == 0) {
+      config = &configs[i];
+      slurm_verbose("ramdisk.c: using the settings for partition %s",
+                    partition);
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Parses a size (as `--ramdisk`), or a percentage (e.g. `10%`)
+ * Sets whichever of `megabytes` or `percent` was given, zeroing the other.
+ *
+ * @param value the string to parse
+ * @param megabytes where we store a size in megabytes
+ * @param percent where we store a percentage
+ * @return int
+ */
+static int parse_share(const char *value, uint64_t *megabytes, int *percent) {
+  if (value[0] < '0' || value[0] > '9') {
+    return EXIT_FAILURE;
+  }
+
+  char *end;
+  errno = 0;
+  unsigned long number = strtoul(value, &end, 10);
+  if (strcmp(end, "%") == 0) {
+    if (errno != 0 || number > INT_MAX) {
+      return EXIT_FAILURE;
+    }
+    *megabytes = 0;
+    *percent = (int)number;
+    return EXIT_SUCCESS;
+  }
+
+  if (parse_memory(value, megabytes) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  *percent = 0;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-stage-out` destination path
+ * Callback for the `--ramdisk-stage-out` flag. The path must be absolute, as
+ * it is resolved on the compute node rather than the submission directory.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-stage-out` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_stage_out(int val, const char *optarg, int remote) {
+  if (optarg == NULL || optarg[0] != '/') {
+    slurm_error("ramdisk.c: --ramdisk-stage-out requires an absolute path");
+    return ESPANK_ERROR;
+  }
+  if (strlen(optarg) >= sizeof(stage_out_destination)) {
+    slurm_error("ramdisk.c: --ramdisk-stage-out path is too long");
+    return ESPANK_ERROR;
+  }
+
+  strcpy(stage_out_destination, optarg);
+  slurm_verbose("ramdisk.c: staging out to %s", stage_out_destination);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-huge` transparent huge page policy
+ * Callback for the `--ramdisk-huge` flag, accepting the tmpfs `huge=` values.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-huge` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_huge(int val, const char *optarg, int remote) {
+  if (optarg == NULL || parse_huge_mode(optarg, ramdisk_huge) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: invalid --ramdisk-huge '%s', expected "
+                "never|always|within_size|advise",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  slurm_verbose("ramdisk.c: huge page policy is %s", ramdisk_huge);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Parses a transparent huge page policy, one of the tmpfs `huge=` values
+ *
+ * @param value the policy string
+ * @param mode the char array (of `THP_MODE_LEN`) we write the policy into
+ * @return int
+ */
+static int parse_huge_mode(const char *value, char mode[]) {
+  static const char *modes[] = {"never", "always", "within_size", "advise"};
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    if (strcmp(value, modes[i]) == 0) {
+      strcpy(mode, modes[i]);
+      return EXIT_SUCCESS;
+    }
+  }
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief Stores the `--ramdisk-mpol` NUMA policy (and optional node list)
+ * Callback for the `--ramdisk-mpol` flag, accepting `MODE[:NODES]` where MODE
+ * is a tmpfs `mpol=` mode and NODES a node list (e.g. `0-1,3`).
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-mpol` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_mpol(int val, const char *optarg, int remote) {
+  if (optarg == NULL ||
+      parse_mpol_mode(optarg, ramdisk_mpol, ramdisk_mpol_nodes) !=
+          EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: invalid --ramdisk-mpol '%s', expected "
+                "bind|interleave|prefer|default[:NODES]",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  slurm_verbose("ramdisk.c: memory policy is %s", optarg);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Parses a NUMA policy as `MODE[:NODES]`
+ * MODE is a tmpfs `mpol=` mode, and NODES a node list (e.g. `0-1,3`), which
+ * `default` and `local` don't take.
+ *
+ * @param value the policy string
+ * @param mode the char array (of `MPOL_MODE_LEN`) we write the mode into
+ * @param nodes the char array (of `MOUNT_OPTION_LEN`) we write the node list
+ * into (empty if none)
+ * @return int
+ */
+static int parse_mpol_mode(const char *value, char mode[], char nodes[]) {
+  static const char *modes[] = {"bind", "interleave", "prefer", "default",
+                                "local"};
+
+  const char *list = strchr(value, ':');
+  size_t mode_length = list != NULL ? (size_t)(list - value) : strlen(value);
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    if (mode_length != strlen(modes[i]) ||
+        strncmp(value, modes[i], mode_length) != 0) {
+      continue;
+    }
+
+    if (list != NULL) {
+      unsigned char set[NUMA_MAX_NODES];
+      if (strcmp(modes[i], "default") == 0 || strcmp(modes[i], "local") == 0 ||
+          parse_list(list + 1, set, NUMA_MAX_NODES) <= 0 ||
+          strlen(list + 1) >= MOUNT_OPTION_LEN) {
+        return EXIT_FAILURE;
+      }
+      strcpy(nodes, list + 1);
+    } else {
+      nodes[0] = '\0';
+    }
+
+    strcpy(mode, modes[i]);
+    return EXIT_SUCCESS;
+  }
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief Enables `--ramdisk-numa` mode
+ * Callback for the `--ramdisk-numa` flag (which takes no value).
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the flag value string (unused)
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_numa(int val, const char *optarg, int remote) {
+  ramdisk_numa = 1;
+  slurm_verbose("ramdisk.c: creating a ramdisk per NUMA node");
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-scope` lifetime
+ * Callback for the `--ramdisk-scope` flag, accepting `step` or `job`.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-scope` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_scope(int val, const char *optarg, int remote) {
+  if (optarg != NULL && strcmp(optarg, "step") == 0) {
+    ramdisk_job_scope = 0;
+  } else if (optarg != NULL && strcmp(optarg, "job") == 0) {
+    ramdisk_job_scope = 1;
+  } else {
+    slurm_error("ramdisk.c: invalid --ramdisk-scope '%s', expected step|job",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  slurm_verbose("ramdisk.c: ramdisk scope is %s", optarg);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-teardown` mode
+ * Callback for the `--ramdisk-teardown` flag, accepting `sync` or `async`.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-teardown` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_teardown(int val, const char *optarg, int remote) {
+  if (optarg != NULL && strcmp(optarg, "sync") == 0) {
+    ramdisk_async_teardown = 0;
+  } else if (optarg != NULL && strcmp(optarg, "async") == 0) {
+    ramdisk_async_teardown = 1;
+  } else {
+    slurm_error("ramdisk.c: invalid --ramdisk-teardown '%s', expected "
+                "sync|async",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  slurm_verbose("ramdisk.c: teardown is %s", optarg);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Stores the `--ramdisk-compress` zram compression algorithm
+ * Callback for the `--ramdisk-compress` flag, accepting `lz4` or `zstd`.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-compress` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_compress(int val, const char *optarg, int remote) {
+  static const char *algorithms[] = {"lz4", "zstd"};
+
+  for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+    if (optarg != NULL && strcmp(optarg, algorithms[i]) == 0) {
+      strcpy(ramdisk_compress, algorithms[i]);
+      slurm_verbose("ramdisk.c: compressing with %s", ramdisk_compress);
+      return ESPANK_SUCCESS;
+    }
+  }
+
+  slurm_error("ramdisk.c: invalid --ramdisk-compress '%s', expected lz4|zstd",
+              optarg != NULL ? optarg : "");
+  return ESPANK_ERROR;
+}
+
+/**
+ * @brief Stores the `--ramdisk-fs` filesystem
+ * Callback for the `--ramdisk-fs` flag, accepting `tmpfs` or one of the
+ * `block_filesystems`.
+ *
+ * @param val the initial value (unused for this plugin)
+ * @param optarg the `--ramdisk-fs` flag value string
+ * @param remote flag indicating remote context
+ * @return int
+ */
+static int parse_fs(int val, const char *optarg, int remote) {
+  int valid = optarg != NULL && strcmp(optarg, MOUNT_TYPE_TEMP) == 0;
+  size_t n_filesystems =
+      sizeof(block_filesystems) / sizeof(block_filesystems[0]);
+  for (size_t i = 0; optarg != NULL && i < n_filesystems; i++) {
+    valid |= strcmp(optarg, block_filesystems[i].type) == 0;
+  }
+
+  if (!valid) {
+    slurm_error("ramdisk.c: invalid --ramdisk-fs '%s', expected "
+                "tmpfs|ext4|xfs",
+                optarg != NULL ? optarg : "");
+    return ESPANK_ERROR;
+  }
+
+  strcpy(ramdisk_fs, optarg);
+  slurm_verbose("ramdisk.c: ramdisk filesystem is %s", ramdisk_fs);
+  return ESPANK_SUCCESS;
+}
+
+/**
+ * @brief Gets the filesystem to build on a block RAM disk
+ * Compressed RAM disks default to ext4.
+ *
+ * @return const struct block_filesystem* the filesystem, or NULL for tmpfs
+ */
+static const struct block_filesystem *get_block_filesystem(void) {
+  const char *type = ramdisk_fs;
+  if (type[0] == '\0') {
+    type = ramdisk_compress[0] != '\0' ? "ext4" : MOUNT_TYPE_TEMP;
+  }
+
+  size_t n_filesystems =
+      sizeof(block_filesystems) / sizeof(block_filesystems[0]);
+  for (size_t i = 0; i < n_filesystems; i++) {
+    if (strcmp(type, block_filesystems[i].type) == 0) {
+      return &block_filesystems[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Checks `--ramdisk` fits in the memory requested at submission
+ * Gathers the memory request as `sbatch`/`salloc`/`srun` would see it - batch
+ * script directives, then input environment variables, then the command line
+ * (each overriding the last). The compute node does the same check against the
+ * real allocation, so this only rejects requests that certainly can't fit,
+ * suggesting a corrected memory request - and nothing at all if any option
+ * wasn't recognised. The partition's settings apply when it's known (as a
+ * single partition).
+ *
+ * Returns failure if the RAM disk can't fit, or is larger than allowed.
+ *
+ * @return int
+ */
+static int check_memory_request(void) {
+  int fd = open(CMDLINE_SELF, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    slurm_verbose("ramdisk.c: unable to read the command line");
+    return EXIT_SUCCESS;
+  }
+  char *cmdline = malloc(CMDLINE_LEN);
+  ssize_t length = cmdline != NULL ? read(fd, cmdline, CMDLINE_LEN - 1) : -1;
+  close(fd);
+  if (length <= 0) {
+    free(cmdline);
+    return EXIT_SUCCESS;
+  }
+  cmdline[length] = '\0';
+
+  int argc = 0;
+  char *argv[CMDLINE_MAX_ARGS];
+  for (char *arg = cmdline; arg < cmdline + length && argc < CMDLINE_MAX_ARGS;
+       arg += strlen(arg) + 1) {
+    argv[argc++] = arg;
+  }
+
+  // the command line has the final say, but also tells us the batch script
+  struct memory_request request = {0};
+  const char *command = read_memory_arguments(&request, argc, argv);
+  int batch = strcmp(program_invocation_short_name, "sbatch") == 0;
+  memset(&request, 0, sizeof(request));
+  if (batch && command != NULL) {
+    read_memory_script(&request, command);
+  }
+  read_memory_environment(
+      &request,
+      batch ? "SBATCH_"
+            : strcmp(program_invocation_short_name, "salloc") == 0 ? "SALLOC_"
+                                                                   : "SLURM_");
+  read_memory_arguments(&request, argc, argv);
+  free(cmdline);
+  if (request.uncertain) {
+    slurm_verbose("ramdisk.c: unsure of the memory request, leaving the "
+                  "check to the compute node");
+    return EXIT_SUCCESS;
+  }
+
+  // `srun` within an allocation runs in the job's partition
+  const char *partition = getenv("SLURM_JOB_PARTITION");
+  if (request.partition[0] == '\0' && partition != NULL) {
+    snprintf(request.partition, sizeof(request.partition), "%s", partition);
+  }
+  select_config(request.partition);
+  if (config->max_size > 0 && ramdisk_size > config->max_size) {
+    slurm_error("ramdisk.c: --ramdisk=%" PRIu64 "M exceeds the %" PRIu64
+                "M limit on ramdisks%s%s",
+                ramdisk_size, config->max_size,
+                config->partition[0] != '\0' ? " in partition " : "",
+                config->partition);
+    return EXIT_FAILURE;
+  }
+
+  if (request.per_node > 0) {
+    uint64_t headroom = get_headroom(request.per_node);
+    if (ramdisk_size + headroom < request.per_node) {
+      return EXIT_SUCCESS;
+    }
+    uint64_t needed = ramdisk_size + request.per_node;
+    if (needed <= ramdisk_size + get_headroom(needed)) {
+      needed = get_allocation(ramdisk_size);
+    }
+    slurm_error("ramdisk.c: --ramdisk=%" PRIu64 "M leaves less than %" PRIu64
+                "M for the job from --mem=%" PRIu64 "M, as the RAM disk is "
+                "allocated from it - request at least --mem=%" PRIu64 "M",
+                ramdisk_size, headroom, request.per_node, needed);
+    return EXIT_FAILURE;
+  }
+
+  // per-CPU (or per-GPU) memory scales with what the node hands out, which
+  // can be more than asked for (e.g. whole cores), so only the node can tell
+  slurm_verbose("ramdisk.c: leaving the memory check to the compute node");
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads the memory request from a batch script's `#SBATCH` directives
+ * Directives are read until the first line that isn't a comment, as `sbatch`
+ * does.
+ *
+ * @param request the request we update
+ * @param script the batch script path
+ */
+static void read_memory_script(struct memory_request *request,
+                               const char *script) {
+  FILE *file = fopen(script, "r");
+  if (file == NULL) {
+    return;
+  }
+
+  char line[4096];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *start = line + strspn(line, " \t");
+    if (*start == '\n' || *start == '\0') {
+      continue;
+    }
+    if (*start != '#') {
+      break;
+    }
+    if (strncmp(start, SCRIPT_DIRECTIVE, strlen(SCRIPT_DIRECTIVE)) != 0) {
+      continue;
+    }
+
+    int argc = 0;
+    char *argv[CMDLINE_MAX_ARGS];
+    for (char *saveptr, *token = strtok_r(start, " \t\n", &saveptr);
+         token != NULL && argc < CMDLINE_MAX_ARGS;
+         token = strtok_r(NULL, " \t\n", &saveptr)) {
+      if (token[0] == '#' && argc > 0) {
+        // the rest of the line is a comment
+        break;
+      }
+      argv[argc++] = token;
+    }
+    read_memory_arguments(request, argc, argv);
+  }
+
+  fclose(file);
+}
+
+/**
+ * @brief Reads the memory request from input environment variables
+ *
+ * @param request the request we update
+ * @param prefix the command's input variable prefix (e.g. `SBATCH_`)
+ */
+static void read_memory_environment(struct memory_request *request,
+                                    const char *prefix) {
+  static const char *options[][2] = {{"MEM_PER_NODE", "mem"},
+                                     {"MEM_PER_CPU", "mem-per-cpu"},
+                                     {"MEM_PER_GPU", "mem-per-gpu"},
+                                     {"PARTITION", "partition"}};
+
+  for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", prefix, options[i][0]);
+    const char *value = getenv(name);
+    if (value != NULL) {
+      parse_memory_option(request, options[i][1], value);
+    }
+  }
+}
+
+/**
+ * @brief Reads the memory request from command line arguments
+ * Accepts `--opt=VALUE`, `--opt VALUE`, `-xVALUE` and `-x VALUE` forms. Stops
+ * at `--`, or the first argument naming a file or command - i.e. the batch
+ * script or the program being launched, whose own arguments aren't ours. The
+ * values of every option taking one are skipped, as e.g. `-o slurm.out` could
+ * otherwise pass for the script.
+ *
+ * Only options named in full are recognised - `getopt_long` also accepts any
+ * unambiguous abbreviation (e.g. `--part`), and other plugins add their own -
+ * with anything else marking the request uncertain.
+ *
+ * @param request the request we update
+ * @param argc argument count (including the program name)
+ * @param argv argument values
+ * @return const char* the batch script or command, or NULL if none
+ */
+static const char *read_memory_arguments(struct memory_request *request,
+                                         int argc, char *argv[]) {
+  static const char *short_options[][2] = {{"p", "partition"}};
+  // sbatch, salloc and srun options with a required value (optional values
+  // can only be attached) - `-W` is `--wait=SECONDS` in srun, a flag elsewhere
+  static const char short_values[] = "AaBbcDdeFGiJLMmNnopqrSTtwx";
+  // and those without one, or with an optional value (which must be attached)
+  static const char short_flags[] = "EHIKOQVWXZhklsuv";
+  static const char *long_flags[] = {
+      "bell", "contiguous", "disable-status", "exact", "exclusive",
+      "get-user-env", "help", "hold", "immediate", "kill-on-bad-exit", "label",
+      "multi-prog", "nice", "no-allocate", "no-bell", "no-kill", "no-requeue",
+      "no-shell", "overcommit", "overlap", "oversubscribe", "parsable",
+      "preserve-env", "propagate", "pty", "quiet", "quit-on-interrupt",
+      "reboot", "requeue", "send-libs", "spread-job", "test-only",
+      "unbuffered", "usage", "use-min-nodes", "verbose", "version", "wait",
+      "whole", "x11"};
+  static const char *long_values[] = {
+      "account", "acctg-freq", "array", "batch", "bb", "bbf", "begin",
+      "chdir", "cluster-constraint", "clusters", "comment", "constraint",
+      "container", "container-id", "core-spec", "cores-per-socket",
+      "cpu-bind", "cpu-freq", "cpus-per-gpu", "cpus-per-task", "deadline",
+      "delay-boot", "dependency", "distribution", "epilog", "error",
+      "exclude", "export", "export-file", "extra", "extra-node-info", "gid",
+      "gpu-bind", "gpu-freq", "gpus", "gpus-per-node", "gpus-per-socket",
+      "gpus-per-task", "gres", "gres-flags", "het-group", "hint", "input",
+      "job-name", "jobid", "kill-on-invalid-dep", "licenses", "mail-type",
+      "mail-user", "mcs-label",
+      "mem", "mem-bind", "mem-per-cpu", "mem-per-gpu", "mincpus", "mpi",
+      "network", "nodefile", "nodelist", "nodes", "ntasks", "ntasks-per-core",
+      "ntasks-per-gpu", "ntasks-per-node", "ntasks-per-socket", "open-mode",
+      "output", "partition", "power", "prefer", "priority", "profile",
+      "prolog", "qos", "relative", "reservation", "segment", "signal",
+      "slurmd-debug", "sockets-per-node", "switches", "task-epilog",
+      "task-prolog", "thread-spec", "threads", "threads-per-core", "time",
+      "time-min", "tmp", "tres-bind", "tres-per-task", "uid",
+      "wait-all-nodes", "wckey", "wrap"};
+  int srun = strcmp(program_invocation_short_name, "srun") == 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--") == 0) {
+      return i + 1 < argc ? argv[i + 1] : NULL;
+    }
+    if (arg[0] != '-' || arg[1] == '\0') {
+      if (is_command(arg)) {
+        return arg;
+      }
+      continue;
+    }
+
+    char name[64];
+    const char *attached = NULL;
+    int takes_value = 0;
+    if (arg[1] == '-') {
+      // long options, with the value attached or following
+      const char *equals = strchr(arg, '=');
+      size_t length = equals != NULL ? (size_t)(equals - arg - 2)
+                                     : strlen(arg + 2);
+      snprintf(name, sizeof(name), "%.*s", (int)length, arg + 2);
+      attached = equals != NULL ? equals + 1 : NULL;
+      int known = srun && strcmp(name, "wait") == 0;
+      takes_value = known;
+      for (size_t j = 0; j < sizeof(long_values) / sizeof(long_values[0]) &&
+                         !known;
+           j++) {
+        known = takes_value = strcmp(name, long_values[j]) == 0;
+      }
+      for (size_t j = 0;
+           j < sizeof(long_flags) / sizeof(long_flags[0]) && !known; j++) {
+        known = strcmp(name, long_flags[j]) == 0;
+      }
+      // ours too, as `--ramdisk 4G` is just as valid
+      for (struct spank_option *option = ramdisk_options;
+           option->name != NULL && !known; option++) {
+        known = strcmp(name, option->name) == 0;
+        takes_value = known && option->has_arg == 1;
+      }
+      if (!known) {
+        request->uncertain = 1;
+      }
+    } else {
+      // short flags may be grouped, up to the first one taking a value
+      name[0] = '\0';
+      for (const char *letter = arg + 1; *letter != '\0'; letter++) {
+        if (strchr(short_values, *letter) == NULL &&
+            !(srun && *letter == 'W')) {
+          if (strchr(short_flags, *letter) == NULL) {
+            request->uncertain = 1;
+          }
+          continue;
+        }
+        takes_value = 1;
+        attached = letter[1] != '\0' ? letter + 1 : NULL;
+        for (size_t j = 0;
+             j < sizeof(short_options) / sizeof(short_options[0]); j++) {
+          if (*letter == short_options[j][0][0]) {
+            snprintf(name, sizeof(name), "%s", short_options[j][1]);
+            break;
+          }
+        }
+        break;
+      }
+    }
+
+    if (attached != NULL) {
+      parse_memory_option(request, name, attached);
+    } else if (takes_value && i + 1 < argc) {
+      // skip the value, whether or not it's one we care about
+      parse_memory_option(request, name, argv[++i]);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Applies a single memory related option to the request
+ * `--mem`, `--mem-per-cpu` and `--mem-per-gpu` are mutually exclusive, so each
+ * clears the others.
+ *
+ * @param request the request we update
+ * @param name the long option name (without dashes)
+ * @param value the option value (may be NULL for flags)
+ * @return int non-zero if the option takes `value`
+ */
+static int parse_memory_option(struct memory_request *request,
+                               const char *name, const char *value) {
+  uint64_t number;
+  if (value == NULL) {
+    return 0;
+  }
+
+  if (strcmp(name, "mem") == 0) {
+    if (parse_memory(value, &number) == EXIT_SUCCESS) {
+      request->per_node = number;
+      request->per_cpu = 0;
+    }
+  } else if (strcmp(name, "mem-per-cpu") == 0 ||
+             strcmp(name, "mem-per-gpu") == 0) {
+    if (parse_memory(value, &number) == EXIT_SUCCESS) {
+      request->per_cpu = number;
+      request->per_node = 0;
+    }
+  } else if (strcmp(name, "partition") == 0) {
+    snprintf(request->partition, sizeof(request->partition), "%s", value);
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * @brief Parses a Slurm memory size (`N[KMGT]`, megabytes by default)
+ *
+ * @param value the size string
+ * @param megabytes where we store the size in megabytes
+ * @return int
+ */
+static int parse_memory(const char *value, uint64_t *megabytes) {
+  char *end;
+  errno = 0;
+  uint64_t size = strtoull(value, &end, 10);
+  if (errno != 0 || end == value) {
+    return EXIT_FAILURE;
+  }
+
+  switch (*end) {
+  case 'K':
+  case 'k':
+    size /= 1024;
+    break;
+  case '\0':
+  case 'M':
+  case 'm':
+    break;
+  case 'G':
+  case 'g':
+    size *= 1024;
+    break;
+  case 'T':
+  case 't':
+    size *= 1024 * 1024;
+    break;
+  default:
+    return EXIT_FAILURE;
+  }
+
+  *megabytes = size;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Checks whether an argument names a file, or a command on the `PATH`
+ *
+ * @param arg the argument
+ * @return int non-zero if it does
+ */
+static int is_command(const char *arg) {
+  if (access(arg, F_OK) == 0) {
+    return 1;
+  }
+  if (strchr(arg, '/') != NULL) {
+    return 0;
+  }
+
+  const char *path = getenv("PATH");
+  if (path == NULL) {
+    return 0;
+  }
+  char *paths = strdup(path);
+  if (paths == NULL) {
+    return 0;
+  }
+
+  int found = 0;
+  for (char *saveptr, *directory = strtok_r(paths, ":", &saveptr);
+       directory != NULL && !found;
+       directory = strtok_r(NULL, ":", &saveptr)) {
+    char candidate[PATH_MAX];
+    found = snprintf(candidate, sizeof(candidate), "%s/%s", directory, arg) <
+                (int)sizeof(candidate) &&
+            access(candidate, X_OK) == 0;
+  }
+
+  free(paths);
+  return found;
+}
+
+/**
+ * @brief Generate our RAM disk path
+ * Creates a path specific to the job and step (including magic step IDs),
+ * or to the job alone when job scoped, stored into the `directory` parameter.
+ *
+ * Returns failure if we fail to get the job or step ID, or get an invalid
+ * value.
+ *
+ * @param sp the spank instance
+ * @param directory the char array we write our directory path into
+ * @return int
+ */
+static int get_directory(spank_t sp, char directory[]) {
+  if (ramdisk_job_scope) {
+    uint32_t job_id;
+    if (spank_get_item(sp, S_JOB_ID, &job_id) != ESPANK_SUCCESS) {
+      slurm_error("ramdisk.c: failed to get job ID");
+      return EXIT_FAILURE;
+    }
+    snprintf(directory, DIRECTORY_PATH_LEN, "%s/%" PRIu32 ".job.ramdisk",
+             config->root, job_id);
+    return EXIT_SUCCESS;
+  }
+
+  char name[STEP_NAME_LEN];
+  if (get_step_name(sp, name) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  snprintf(directory, DIRECTORY_PATH_LEN, "%s/%s.ramdisk", config->root,
+           name);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Generate the path of one of the step's RAM disks
+ * In `--ramdisk-numa` mode, `index` selects the NUMA node (as ordered in
+ * `ramdisk_numa_nodes`), giving `<job>.<step>.numaN.ramdisk`. Otherwise this
+ * is `get_directory`.
+ *
+ * @param sp the spank instance
+ * @param index the RAM disk index (below `count_ramdisks()`)
+ * @param directory the char array we write our directory path into
+ * @return int
+ */
+static int get_ramdisk_directory(spank_t sp, int index, char directory[]) {
+  if (!ramdisk_numa) {
+    return get_directory(sp, directory);
+  }
+
+  char name[STEP_NAME_LEN];
+  if (get_step_name(sp, name) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  snprintf(directory, DIRECTORY_PATH_LEN, "%s/%s.numa%d.ramdisk",
+           config->root, name, ramdisk_numa_nodes[index]);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Number of RAM disks the step has (one, or one per NUMA node)
+ *
+ * @return int
+ */
+static int count_ramdisks(void) {
+  return ramdisk_numa ? n_ramdisk_numa_nodes : 1;
+}
+
+/**
+ * @brief Generate the job and step part of our RAM disk paths
+ * Creates `<job>.<step>` (including magic step IDs), stored into the `name`
+ * parameter.
+ *
+ * Returns failure if we fail to get the job or step ID, or get an invalid
+ * value.
+ *
+ * @param sp the spank instance
+ * @param name the char array we write the name into
+ * @return int
+ */
+static int get_step_name(spank_t sp, char name[]) {
+  // get job ID and job step ID
+  uint32_t job_id;
+  uint32_t job_stepid;
+  if (spank_get_item(sp, S_JOB_ID, &job_id) != ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: failed to get job ID");
+    return EXIT_FAILURE;
+  }
+  if (spank_get_item(sp, S_JOB_STEPID, &job_stepid) != ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: failed to get job step ID");
+    return EXIT_FAILURE;
+  }
+
+  if (job_stepid > SLURM_MAX_NORMAL_STEP_ID) {
+    if (job_stepid == SLURM_PENDING_STEP) {
+      slurm_error("ramdisk.c: cannot create ramdisk for pending step");
+      return EXIT_FAILURE;
+    } else if (job_stepid == SLURM_EXTERN_CONT) {
+      snprintf(name, STEP_NAME_LEN, "%" PRIu32 ".extern", job_id);
+    } else if (job_stepid == SLURM_BATCH_SCRIPT) {
+      snprintf(name, STEP_NAME_LEN, "%" PRIu32 ".batch", job_id);
+    } else if (job_stepid == SLURM_INTERACTIVE_STEP) {
+      snprintf(name, STEP_NAME_LEN, "%" PRIu32 ".interactive", job_id);
+    } else {
+      slurm_error("ramdisk.c: invalid job step id: %" PRIu32, job_stepid);
+      return EXIT_FAILURE;
+    }
+  } else {
+    snprintf(name, STEP_NAME_LEN, "%" PRIu32 ".%" PRIu32, job_id, job_stepid);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Creates, mounts and populates the step's RAM disks
+ * Skips everything if the (first) RAM disk directory already exists, assuming
+ * it has already been mounted.
+ *
+ * @param sp the spank instance
+ * @param size the size of each RAM disk in megabytes
+ * @param uid the owning user
+ * @param gid the owning group
+ * @param policy the tmpfs `mpol=` value (ignored in NUMA mode)
+ * @return int
+ */
+static int create_ramdisks(spank_t sp, uint64_t size, uid_t uid, gid_t gid,
+                           const char *policy) {
+  char directory[DIRECTORY_PATH_LEN];
+  if (get_ramdisk_directory(sp, 0, directory) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  // now we do the actual filesystem operations
+  slurm_info("ramdisk.c: creating a ramdisk - %" PRIu64 "M at %s", ramdisk_size,
+             directory);
+
+  // check if the directory exists - if it does assume we're done
+  uint64_t start = timing_now();
+  struct stat sb;
+  int exists = stat(directory, &sb) == 0;
+  timing_add(TIMING_STAT, start);
+  if (exists) {
+    if (!S_ISDIR(sb.st_mode)) {
+      slurm_error("ramdisk.c: directory path exists but is not dir");
+      return EXIT_FAILURE;
+    }
+    slurm_verbose(
+        "ramdisk.c: directory path exists, assuming we've already mounted it");
+    return EXIT_SUCCESS;
+  }
+
+  for (int i = 0; i < count_ramdisks(); i++) {
+    if (get_ramdisk_directory(sp, i, directory) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+
+    char mount_policy[MOUNT_OPTION_LEN];
+    if (ramdisk_numa) {
+      snprintf(mount_policy, sizeof(mount_policy), "bind:%d",
+               ramdisk_numa_nodes[i]);
+    } else {
+      snprintf(mount_policy, sizeof(mount_policy), "%s", policy);
+    }
+    // block ramdisks come out of the job's memory limit before they exist
+    const struct block_filesystem *filesystem = get_block_filesystem();
+    if (filesystem != NULL &&
+        charge_job_memory(sp, (int64_t)size) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    if (filesystem != NULL
+            ? mount_block(directory, size, uid, gid, filesystem) !=
+                  EXIT_SUCCESS
+            : mount_tmpfs(directory, size, uid, gid, mount_policy) !=
+                  EXIT_SUCCESS) {
+      if (filesystem != NULL && stat(directory, &sb) != 0) {
+        charge_job_memory(sp, -(int64_t)size);
+      }
+      return EXIT_FAILURE;
+    }
+
+    if (ramdisk_overlay[0] != '\0' &&
+        mount_overlay(sp, directory, uid, gid) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    if (ramdisk_image[0] != '\0' &&
+        mount_image(sp, directory, uid) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    if (ramdisk_cache[0] != '\0' &&
+        mount_cache(sp, directory, uid, gid) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+
+    // populate the ramdisk as the job user, so we never read anything they
+    // couldn't read themselves - NUMA mode gives each node its own copy
+    struct stage_paths paths = {.src = stage_in_source, .dst = directory};
+    start = timing_now();
+    if (stage_in_source[0] != '\0' &&
+        run_as_user(sp, stage_in, &paths, 0) != EXIT_SUCCESS) {
+      slurm_error("ramdisk.c: failed to stage %s into the ramdisk",
+                  stage_in_source);
+      return EXIT_FAILURE;
+    }
+    timing_add(TIMING_STAGE_IN, start);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Stages out, unmounts, and deletes each of the step's RAM disks
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int destroy_ramdisks(spank_t sp) {
+  int rc = EXIT_SUCCESS;
+  // every ramdisk's stage-out comes out of the same budget, so NUMA ramdisks
+  // still fit in KillWait together
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  time_t deadline = now.tv_sec + STAGE_OUT_TIMEOUT;
+  for (int i = 0; i < count_ramdisks(); i++) {
+    // get directory path
+    uint64_t start = timing_now();
+    char directory[DIRECTORY_PATH_LEN];
+    if (get_ramdisk_directory(sp, i, directory) != EXIT_SUCCESS) {
+      rc = EXIT_FAILURE;
+      break;
+    }
+    timing_add(TIMING_GET_DIRECTORY, start);
+    slurm_verbose("ramdisk.c: using directory %s", directory);
+
+    slurm_info("ramdisk.c: deleting the ramdisk - %s", directory);
+
+    // check if the directory exists - if it doesn't assume we're done
+    start = timing_now();
+    struct stat sb;
+    int missing = stat(directory, &sb) == -1;
+    timing_add(TIMING_STAT, start);
+    if (missing) {
+      slurm_verbose("ramdisk.c: directory path missing, assuming we've "
+                    "already deleted it");
+      continue;
+    }
+
+    // images and cached datasets are read-only input, so release them before
+    // staging out
+    char cache[PATH_MAX];
+    snprintf(cache, sizeof(cache), "%s/" CACHE_MOUNT_NAME, directory);
+    int cached = stat(cache, &sb) == 0;
+    unmount_submounts(directory);
+    if (cached) {
+      release_cache(directory);
+    }
+
+    // then any overlay, so only the job's changes (its upper layer) are staged
+    // out, and the RAM disk below is left to tear down
+    char source[PATH_MAX];
+    snprintf(source, sizeof(source), "%s", directory);
+    if (is_overlay(directory) &&
+        unmount_ramdisk(sp, directory) == EXIT_SUCCESS) {
+      snprintf(source, sizeof(source), "%s/" OVERLAY_UPPER, directory);
+    }
+
+    // copy results out as the job user - failures are reported, but we still
+    // tear down the ramdisk rather than hold the node. NUMA ramdisks each go
+    // into their own `numaN` subdirectory.
+    char destination[PATH_MAX];
+    if (ramdisk_numa) {
+      snprintf(destination, sizeof(destination), "%s/numa%d",
+               stage_out_destination, ramdisk_numa_nodes[i]);
+    } else {
+      snprintf(destination, sizeof(destination), "%s", stage_out_destination);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct stage_paths paths = {.src = source,
+                                .dst = destination,
+                                .timeout = (int)(deadline - now.tv_sec)};
+    start = timing_now();
+    if (stage_out_destination[0] != '\0' && paths.timeout <= 0) {
+      slurm_error("ramdisk.c: no time left to stage the ramdisk out to %s",
+                  destination);
+    } else if (stage_out_destination[0] != '\0' &&
+               run_as_user(sp, stage_out, &paths,
+                           paths.timeout + STAGE_OUT_GRACE) != EXIT_SUCCESS) {
+      slurm_error("ramdisk.c: failed to stage the ramdisk out to %s",
+                  destination);
+    }
+    timing_add(TIMING_STAGE_OUT, start);
+
+    // block ramdisks have a zram device to free once unmounted, giving its
+    // memory back to the job's limit
+    char device[DEVICE_NAME_LEN] = {0};
+    uint64_t charged = 0;
+    if (get_ramdisk_device(directory, device) != EXIT_SUCCESS) {
+      device[0] = '\0';
+    } else if (read_zram_stat(device, ZRAM_MEM_LIMIT, &charged) !=
+               EXIT_SUCCESS) {
+      charged = 0;
+    }
+
+    // hand the unmount to a background worker, so the node isn't held in
+    // COMPLETING while the kernel frees every page - falling back to a normal
+    // unmount if we can't
+    start = timing_now();
+    if (ramdisk_async_teardown &&
+        detach_ramdisk(directory, device) == EXIT_SUCCESS) {
+      if (charged > 0) {
+        charge_job_memory(sp, -(int64_t)(charged >> 20));
+      }
+      timing_add(TIMING_UMOUNT, start);
+      continue;
+    }
+
+    // unmount tmpfs
+    int unmounted = unmount_ramdisk(sp, directory) == EXIT_SUCCESS;
+    if (unmounted && device[0] != '\0' &&
+        release_zram(device) == EXIT_SUCCESS && charged > 0) {
+      charge_job_memory(sp, -(int64_t)(charged >> 20));
+    }
+    timing_add(TIMING_UMOUNT, start);
+    if (!unmounted) {
+      rc = EXIT_FAILURE;
+      continue;
+    }
+
+    // delete directory path
+    start = timing_now();
+    if (rmdir(directory) != 0) {
+      slurm_error("ramdisk.c: failed to delete tmpfs directory");
+    }
+    timing_add(TIMING_RMDIR, start);
+  }
+
+  return rc;
+}
+
+/**
+ * @brief Creates the step's RAM disks in a mount namespace of their own
+ * Forks a holder, which unshares its mount namespace (with private
+ * propagation, so nothing reaches the node's mount table), creates the RAM
+ * disks (and any `/tmp` binds) in it, then waits for our end of a pipe to
+ * close - at step exit, or when slurmstepd dies. Once the holder and the tasks
+ * are gone, the kernel tears the namespace down with every mount in it.
+ *
+ * slurmstepd is threaded, so can't enter the namespace itself - tasks join it
+ * in `slurm_spank_task_init_privileged`.
+ *
+ * @param sp the spank instance
+ * @param size the size of each ramdisk in megabytes
+ * @param uid the owning user
+ * @param gid the owning group
+ * @param policy the tmpfs `mpol=` value (empty for none)
+ * @return int
+ */
+static int start_namespace(spank_t sp, uint64_t size, uid_t uid, gid_t gid,
+                           const char *policy) {
+  int status_pipe[2];
+  int alive_pipe[2];
+  if (pipe2(status_pipe, O_CLOEXEC) != 0) {
+    slurm_error("ramdisk.c: failed to create pipe: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (pipe2(alive_pipe, O_CLOEXEC) != 0) {
+    slurm_error("ramdisk.c: failed to create pipe: %s", strerror(errno));
+    close(status_pipe[0]);
+    close(status_pipe[1]);
+    return EXIT_FAILURE;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(status_pipe[0]);
+    close(alive_pipe[1]);
+
+    struct namespace_status status = {.rc = EXIT_FAILURE};
+    char directory[DIRECTORY_PATH_LEN];
+    if (unshare(CLONE_NEWNS) != 0 ||
+        mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+      slurm_error("ramdisk.c: failed to create a mount namespace: %s",
+                  strerror(errno));
+    } else if (create_ramdisks(sp, size, uid, gid, policy) == EXIT_SUCCESS &&
+               get_ramdisk_directory(sp, 0, directory) == EXIT_SUCCESS) {
+      status.rc = EXIT_SUCCESS;
+      for (size_t i = 0; ramdisk_namespace_tmp &&
+                         i < sizeof(namespace_tmp_paths) /
+                                 sizeof(namespace_tmp_paths[0]);
+           i++) {
+        if (mount(directory, namespace_tmp_paths[i], NULL, MS_BIND, NULL) !=
+            0) {
+          slurm_error("ramdisk.c: failed to bind the ramdisk over %s: %s",
+                      namespace_tmp_paths[i], strerror(errno));
+          status.rc = EXIT_FAILURE;
+        }
+      }
+    }
+    memcpy(status.timings, timings, sizeof(timings));
+    if (write(status_pipe[1], &status, sizeof(status)) != sizeof(status) ||
+        status.rc != EXIT_SUCCESS) {
+      _exit(EXIT_FAILURE);
+    }
+    close(status_pipe[1]);
+
+    char byte;
+    while (read(alive_pipe[0], &byte, 1) < 0 && errno == EINTR) {
+    }
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(status_pipe[1]);
+  close(alive_pipe[0]);
+  if (pid < 0) {
+    slurm_error("ramdisk.c: failed to fork: %s", strerror(errno));
+    close(status_pipe[0]);
+    close(alive_pipe[1]);
+    return EXIT_FAILURE;
+  }
+  namespace_holder = pid;
+  namespace_pipe = alive_pipe[1];
+
+  if (read_namespace_status(status_pipe[0]) != EXIT_SUCCESS) {
+    // the namespace takes any mounts with it
+    release_namespace(sp);
+    return EXIT_FAILURE;
+  }
+
+  slurm_verbose("ramdisk.c: mount namespace held by %d", pid);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Tears down the RAM disks in the step's mount namespace, and releases
+ * it
+ * The RAM disks are staged out and unmounted from a child that joins the
+ * namespace, so their memory is freed before the step completes.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int stop_namespace(spank_t sp) {
+  int rc = EXIT_FAILURE;
+  int status_pipe[2];
+  if (pipe2(status_pipe, O_CLOEXEC) != 0) {
+    slurm_error("ramdisk.c: failed to create pipe: %s", strerror(errno));
+  } else {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(status_pipe[0]);
+      close(namespace_pipe);
+
+      struct namespace_status status = {.rc = EXIT_FAILURE};
+      if (enter_namespace() == EXIT_SUCCESS) {
+        for (size_t i = 0; ramdisk_namespace_tmp &&
+                           i < sizeof(namespace_tmp_paths) /
+                                   sizeof(namespace_tmp_paths[0]);
+             i++) {
+          umount2(namespace_tmp_paths[i], MNT_DETACH);
+        }
+        status.rc = destroy_ramdisks(sp);
+      }
+      memcpy(status.timings, timings, sizeof(timings));
+      _exit(write(status_pipe[1], &status, sizeof(status)) == sizeof(status)
+                ? EXIT_SUCCESS
+                : EXIT_FAILURE);
+    }
+
+    close(status_pipe[1]);
+    if (pid < 0) {
+      slurm_error("ramdisk.c: failed to fork: %s", strerror(errno));
+      close(status_pipe[0]);
+    } else {
+      rc = read_namespace_status(status_pipe[0]);
+      while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+      }
+    }
+  }
+
+  if (release_namespace(sp) != EXIT_SUCCESS) {
+    rc = EXIT_FAILURE;
+  }
+  return rc;
+}
+
+/**
+ * @brief Ends the holder of the step's mount namespace
+ * Removes the RAM disk directories left behind (empty, as they were only
+ * mounted within the namespace).
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int release_namespace(spank_t sp) {
+  close(namespace_pipe);
+  namespace_pipe = -1;
+  kill(namespace_holder, SIGKILL);
+  while (waitpid(namespace_holder, NULL, 0) < 0 && errno == EINTR) {
+  }
+  namespace_holder = 0;
+
+  int rc = EXIT_SUCCESS;
+  for (int i = 0; i < count_ramdisks(); i++) {
+    char directory[DIRECTORY_PATH_LEN];
+    if (get_ramdisk_directory(sp, i, directory) != EXIT_SUCCESS ||
+        (rmdir(directory) != 0 && errno != ENOENT)) {
+      slurm_error("ramdisk.c: failed to delete %s", directory);
+      rc = EXIT_FAILURE;
+    }
+  }
+  return rc;
+}
+
+/**
+ * @brief Moves the caller into the step's mount namespace
+ * The caller must be single threaded. Its working directory is kept, as far
+ * as it exists in the namespace.
+ *
+ * @return int
+ */
+static int enter_namespace(void) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), NAMESPACE_MOUNTS, namespace_holder);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    slurm_error("ramdisk.c: failed to open %s: %s", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  char cwd[PATH_MAX];
+  int has_cwd = getcwd(cwd, sizeof(cwd)) != NULL;
+  if (setns(fd, CLONE_NEWNS) != 0) {
+    slurm_error("ramdisk.c: failed to enter the step's mount namespace: %s",
+                strerror(errno));
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  // joining a mount namespace moves us to its root
+  if (has_cwd && chdir(cwd) != 0) {
+    slurm_verbose("ramdisk.c: unable to return to %s", cwd);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads the status of a child working in the step's mount namespace
+ * Takes on the child's timings, and closes the pipe.
+ *
+ * @param fd the read end of the child's status pipe
+ * @return int the child's result
+ */
+static int read_namespace_status(int fd) {
+  struct namespace_status status;
+  ssize_t length;
+  while ((length = read(fd, &status, sizeof(status))) < 0 && errno == EINTR) {
+  }
+  close(fd);
+  if (length != sizeof(status)) {
+    return EXIT_FAILURE;
+  }
+
+  memcpy(timings, status.timings, sizeof(timings));
+  return status.rc;
+}
+
+/**
+ * @brief Creates a directory and mounts a tmpfs on it for the job user
+ *
+ * @param directory the mount point to create
+ * @param size the tmpfs size in megabytes
+ * @param uid the owning user
+ * @param gid the owning group
+ * @param policy the tmpfs `mpol=` value (empty for none)
+ * @return int
+ */
+static int mount_tmpfs(const char *directory, uint64_t size, uid_t uid,
+                       gid_t gid, const char *policy) {
+  // create the ramdisk directory
+  uint64_t start = timing_now();
+  if (mkdir(directory, INITIAL_DIR_MODE_RWX) != 0) {
+    slurm_error("ramdisk.c: failed to create directory");
+    return EXIT_FAILURE;
+  }
+  timing_add(TIMING_MKDIR, start);
+
+  // mount tmpfs
+  char mount_options[MOUNT_OPTION_LEN];
+  int length = snprintf(mount_options, MOUNT_OPTION_LEN,
+                        "size=%" PRIu64 "M,uid=%d,gid=%d,mode=%o%s", size, uid,
+                        gid, (unsigned int)config->mode,
+                        config->noswap ? ",noswap" : "");
+  if (ramdisk_huge[0] != '\0') {
+    length += snprintf(mount_options + length, MOUNT_OPTION_LEN - length,
+                       ",huge=%s", ramdisk_huge);
+  }
+  // mpol last, as its node list may itself contain commas
+  if (policy[0] != '\0' && length < MOUNT_OPTION_LEN) {
+    length += snprintf(mount_options + length, MOUNT_OPTION_LEN - length,
+                       ",mpol=%s", policy);
+  }
+  if (length >= MOUNT_OPTION_LEN) {
+    slurm_error("ramdisk.c: mount options too long");
+    return EXIT_FAILURE;
+  }
+  start = timing_now();
+  if (mount(MOUNT_SOURCE_VIRTUAL, directory, MOUNT_TYPE_TEMP, MOUNT_FLAGS_NONE,
+            mount_options) != 0) {
+    slurm_error("ramdisk.c: failed to mount tmpfs");
+    return EXIT_FAILURE;
+  }
+  timing_add(TIMING_MOUNT, start);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Creates a directory and mounts a block (zram) RAM disk on it
+ * The zram device may use at most `size` megabytes of memory. Compressed, it
+ * holds up to `ZRAM_DISKSIZE_RATIO` times that, and otherwise exactly `size`.
+ * It's formatted with the given filesystem, and the root handed to the job
+ * user.
+ *
+ * @param directory the mount point to create
+ * @param size the memory limit in megabytes
+ * @param uid the owning user
+ * @param gid the owning group
+ * @param filesystem the filesystem to build
+ * @return int
+ */
+static int mount_block(const char *directory, uint64_t size, uid_t uid,
+                       gid_t gid, const struct block_filesystem *filesystem) {
+  // create the ramdisk directory
+  uint64_t start = timing_now();
+  if (mkdir(directory, INITIAL_DIR_MODE_RWX) != 0) {
+    slurm_error("ramdisk.c: failed to create directory");
+    return EXIT_FAILURE;
+  }
+  timing_add(TIMING_MKDIR, start);
+
+  start = timing_now();
+  char device[DEVICE_NAME_LEN];
+  uint64_t disksize =
+      ramdisk_compress[0] != '\0' ? size * ZRAM_DISKSIZE_RATIO : size;
+  if (create_zram(size, disksize, device) != EXIT_SUCCESS) {
+    rmdir(directory);
+    return EXIT_FAILURE;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/dev/%s", device);
+  char *mkfs[MKFS_MAX_ARGS + 3];
+  int n_args = 0;
+  mkfs[n_args++] = (char *)filesystem->mkfs;
+  for (int i = 0; filesystem->mkfs_options[i] != NULL; i++) {
+    mkfs[n_args++] = (char *)filesystem->mkfs_options[i];
+  }
+  mkfs[n_args++] = path;
+  mkfs[n_args] = NULL;
+  if (run_command(mkfs) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to format %s as %s", path,
+                filesystem->type);
+    release_zram(device);
+    rmdir(directory);
+    return EXIT_FAILURE;
+  }
+
+  if (mount(path, directory, filesystem->type, MOUNT_FLAGS_NONE,
+            filesystem->mount_options) != 0) {
+    slurm_error("ramdisk.c: failed to mount %s: %s", path, strerror(errno));
+    release_zram(device);
+    rmdir(directory);
+    return EXIT_FAILURE;
+  }
+  timing_add(TIMING_MOUNT, start);
+
+  // the mount hides our directory, so hand the filesystem root to the user
+  if (chown(directory, uid, gid) != 0 || chmod(directory, config->mode) != 0) {
+    slurm_error("ramdisk.c: failed to set the ramdisk owner");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Commits the free memory of each of the step's tmpfs RAM disks, and
+ * holds it until they need it
+ * tmpfs only allocates pages as they're first written, so an oversubscribed
+ * node finds out it's short part way through the job. Instead, we allocate
+ * every page now - failing the step before any task starts if they don't fit
+ * - and keep them, handing them back (see `release_prefault`) as the RAM disks
+ * fill.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int prefault_ramdisks(spank_t sp) {
+  int n_ramdisks = count_ramdisks();
+  prefault_holders = calloc(n_ramdisks, sizeof(*prefault_holders));
+  if (prefault_holders == NULL) {
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < n_ramdisks; i++) {
+    prefault_holders[i].socket = -1;
+  }
+  n_prefault_holders = n_ramdisks;
+
+  // from the memory nodes the ramdisk's pages come from (or anywhere, if we
+  // can't tell)
+  for (int i = 0; i < n_ramdisks; i++) {
+    char directory[DIRECTORY_PATH_LEN];
+    char path[PATH_MAX];
+    if (get_ramdisk_directory(sp, i, directory) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    get_visible_path(directory, path);
+
+    unsigned char nodes[NUMA_MAX_NODES] = {0};
+    char online[MOUNT_OPTION_LEN];
+    if (ramdisk_numa) {
+      nodes[ramdisk_numa_nodes[i]] = 1;
+    } else if (get_step_nodes(sp, nodes) <= 0 &&
+               (read_file(NUMA_ONLINE, online, sizeof(online)) !=
+                    EXIT_SUCCESS ||
+                parse_list(online, nodes, NUMA_MAX_NODES) <= 0)) {
+      memset(nodes, 0, sizeof(nodes));
+    }
+    if (prefault_ramdisk(path, nodes, &prefault_holders[i]) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Commits the free space of a tmpfs RAM disk to memory
+ * The placeholders are memfds outside the RAM disk, so they never take space
+ * the job could write to, held by a child first in line for the OOM killer -
+ * a RAM disk that doesn't fit doesn't take slurmstepd with it, and if the job
+ * outgrows its memory before we've handed them back, they go first.
+ *
+ * @param directory the RAM disk path
+ * @param nodes the `NUMA_MAX_NODES` flags of the nodes to allocate from
+ * @param holder where we keep the child holding them
+ * @return int
+ */
+static int prefault_ramdisk(const char *directory, const unsigned char nodes[],
+                            struct prefault_holder *holder) {
+  uint64_t start = timing_now();
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+    slurm_error("ramdisk.c: failed to create socket: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // nothing else may stay open for want of us
+    close(sockets[0]);
+    if (namespace_pipe >= 0) {
+      close(namespace_pipe);
+    }
+    for (int i = 0; i < n_prefault_holders; i++) {
+      if (prefault_holders[i].socket >= 0) {
+        close(prefault_holders[i].socket);
+      }
+    }
+    write_sysfs(OOM_SCORE_ADJ_SELF, OOM_SCORE_ADJ_FIRST);
+    _exit(hold_placeholders(directory, nodes, sockets[1]));
+  }
+  close(sockets[1]);
+
+  // the child tells us what it holds once it's committed it all
+  uint64_t held = 0;
+  ssize_t n = -1;
+  while (pid > 0 && (n = read(sockets[0], &held, sizeof(held))) < 0 &&
+         errno == EINTR) {
+  }
+  timing_add(TIMING_PREFAULT, start);
+
+  if (n != sizeof(held)) {
+    int status = 0;
+    close(sockets[0]);
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    slurm_error("ramdisk.c: unable to commit the memory of %s%s", directory,
+                pid > 0 && WIFSIGNALED(status) ? " (out of memory)" : "");
+    return EXIT_FAILURE;
+  }
+
+  holder->pid = pid;
+  holder->socket = sockets[0];
+  holder->held = held;
+  slurm_verbose("ramdisk.c: prefaulted %s, holding %" PRIu64 "M", directory,
+                held >> 20);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Commits a RAM disk's free space, then holds it until told to shrink
+ * Runs in the holder child. Each message on `socket` is the bytes to keep,
+ * given back from the last placeholder first; the socket closing ends it.
+ *
+ * @param directory the RAM disk path
+ * @param nodes the `NUMA_MAX_NODES` flags of the nodes to allocate from
+ * @param socket the child's end of the socket to slurmstepd
+ * @return int
+ */
+static int hold_placeholders(const char *directory,
+                             const unsigned char nodes[], int socket) {
+  static struct prefault_thread threads[PREFAULT_MAX_THREADS];
+  int n_threads = fill_placeholders(directory, nodes, threads);
+  if (n_threads < 0) {
+    return EXIT_FAILURE;
+  }
+
+  uint64_t held = 0;
+  for (int i = 0; i < n_threads; i++) {
+    held += threads[i].length;
+  }
+  if (write(socket, &held, sizeof(held)) != sizeof(held)) {
+    return EXIT_FAILURE;
+  }
+
+  uint64_t keep;
+  ssize_t n;
+  while ((n = read(socket, &keep, sizeof(keep))) == sizeof(keep) ||
+         (n < 0 && errno == EINTR)) {
+    for (int i = n_threads - 1; n > 0 && i >= 0 && held > keep; i--) {
+      off_t cut = held - keep < (uint64_t)threads[i].length
+                      ? (off_t)(held - keep)
+                      : threads[i].length;
+      threads[i].length -= cut;
+      held -= cut;
+      if (ftruncate(threads[i].fd, threads[i].length) != 0) {
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Fills memfds to the size of a RAM disk's free space, in parallel
+ * Splits the free space between `PREFAULT_THREADS_PER_NODE` threads pinned to
+ * each node's CPUs (as far as we may run on them), so a large RAM disk fills
+ * at memory bandwidth, and pages are first touched on the node they're for.
+ *
+ * Returns the number of placeholders (each thread's `fd` and `length`), or -1.
+ *
+ * @param directory the RAM disk path
+ * @param nodes the `NUMA_MAX_NODES` flags of the nodes to allocate from
+ * @param threads the `PREFAULT_MAX_THREADS` threads, with their placeholders
+ * @return int
+ */
+static int fill_placeholders(const char *directory,
+                             const unsigned char nodes[],
+                             struct prefault_thread threads[]) {
+  struct statfs sf;
+  if (statfs(directory, &sf) != 0) {
+    slurm_error("ramdisk.c: failed to stat %s: %s", directory,
+                strerror(errno));
+    return -1;
+  }
+  uint64_t available = (uint64_t)sf.f_bavail * sf.f_bsize;
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+  }
+
+  int n_threads = 0;
+  for (int node = 0; node < NUMA_MAX_NODES; node++) {
+    if (!nodes[node]) {
+      continue;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    char path[PATH_MAX];
+    char list[MOUNT_OPTION_LEN];
+    unsigned char node_cpus[NUMA_MAX_CPUS];
+    snprintf(path, sizeof(path), NUMA_NODE_CPULIST, node);
+    if (read_file(path, list, sizeof(list)) == EXIT_SUCCESS &&
+        parse_list(list, node_cpus, NUMA_MAX_CPUS) > 0) {
+      for (int cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (node_cpus[cpu] && CPU_ISSET(cpu, &allowed)) {
+          CPU_SET(cpu, &cpus);
+        }
+      }
+    }
+
+    // no more threads than CPUs, though a node without any CPUs of ours
+    // still gets one (unpinned)
+    int count = CPU_COUNT(&cpus);
+    for (int i = 0; i < PREFAULT_THREADS_PER_NODE && (i < count || i == 0) &&
+                    n_threads < PREFAULT_MAX_THREADS;
+         i++) {
+      threads[n_threads++].cpus = cpus;
+    }
+  }
+  if (n_threads == 0) {
+    // no nodes to go on
+    for (; n_threads < PREFAULT_THREADS_PER_NODE; n_threads++) {
+      CPU_ZERO(&threads[n_threads].cpus);
+    }
+  }
+
+  // split on huge page boundaries, the last thread taking any remainder
+  off_t share = available / n_threads / PREFAULT_ALIGN * PREFAULT_ALIGN;
+  int rc = EXIT_SUCCESS;
+  int started = 0;
+  for (; started < n_threads; started++) {
+    struct prefault_thread *thread = &threads[started];
+    thread->length = started == n_threads - 1
+                         ? (off_t)(available - share * (n_threads - 1))
+                         : share;
+    thread->fd = memfd_create(PREFAULT_FILE_NAME, MFD_CLOEXEC);
+    if (thread->fd < 0 ||
+        pthread_create(&thread->thread, NULL, prefault_worker, thread) != 0) {
+      slurm_error("ramdisk.c: failed to start prefaulting %s", directory);
+      rc = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  // the placeholders stay open, holding their memory
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i].thread, NULL);
+    if (threads[i].rc != EXIT_SUCCESS) {
+      rc = EXIT_FAILURE;
+    }
+  }
+  return rc == EXIT_SUCCESS ? n_threads : -1;
+}
+
+/**
+ * @brief Allocates one placeholder's share of a RAM disk
+ * Thread entry point for `fill_placeholders`.
+ *
+ * @param arg the `prefault_thread`
+ * @return void*
+ */
+static void *prefault_worker(void *arg) {
+  struct prefault_thread *thread = arg;
+  if (CPU_COUNT(&thread->cpus) > 0) {
+    pthread_setaffinity_np(pthread_self(), sizeof(thread->cpus),
+                           &thread->cpus);
+  }
+
+  thread->rc = EXIT_SUCCESS;
+  if (thread->length > 0 && fallocate(thread->fd, 0, 0, thread->length) != 0) {
+    slurm_error("ramdisk.c: failed to prefault the ramdisk: %s",
+                strerror(errno));
+    thread->rc = EXIT_FAILURE;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Hands prefaulted memory back as the RAM disks fill
+ * Called from the usage monitor. Each holder keeps only what its RAM disk
+ * doesn't use, so the two together stay at the RAM disk's size - holdings
+ * never grow back, whether files are deleted or the RAM disk grows.
+ */
+static void release_prefault(void) {
+  for (int i = 0; i < n_prefault_holders && i < usage.n_directories; i++) {
+    struct prefault_holder *holder = &prefault_holders[i];
+    char path[PATH_MAX];
+    struct statfs sf;
+    get_visible_path(usage.directories[i], path);
+    if (holder->socket < 0 || statfs(path, &sf) != 0) {
+      continue;
+    }
+
+    uint64_t size = (uint64_t)sf.f_blocks * sf.f_bsize;
+    uint64_t used = (uint64_t)(sf.f_blocks - sf.f_bfree) * sf.f_bsize;
+    uint64_t keep = size > used ? size - used : 0;
+    if (keep >= holder->held) {
+      continue;
+    }
+    if (send(holder->socket, &keep, sizeof(keep), MSG_NOSIGNAL) !=
+        sizeof(keep)) {
+      // most likely the OOM killer's
+      slurm_info("ramdisk.c: memory held for %s was freed early",
+                 usage.directories[i]);
+      close(holder->socket);
+      holder->socket = -1;
+      keep = 0;
+    }
+    holder->held = keep;
+  }
+}
+
+/**
+ * @brief Frees whatever prefaulted memory is still held
+ * Closing a holder's socket has it exit, and we wait for its memory to go.
+ */
+static void stop_prefault(void) {
+  for (int i = 0; i < n_prefault_holders; i++) {
+    if (prefault_holders[i].socket >= 0) {
+      close(prefault_holders[i].socket);
+    }
+    while (prefault_holders[i].pid > 0 &&
+           waitpid(prefault_holders[i].pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+  }
+  free(prefault_holders);
+  prefault_holders = NULL;
+  n_prefault_holders = 0;
+}
+
+/**
+ * @brief Creates a zram device, limited to `size` megabytes of memory
+ * Hot-adds a device, then sets the compression algorithm (if compressing,
+ * otherwise keeping the kernel's default), memory limit and (uncompressed)
+ * disk size, in the order zram requires. The kernel doesn't charge zram memory
+ * to the job's cgroup, so the memory limit is what keeps it within the RAM
+ * disk's share of the allocation - and the job's cgroup limit is lowered by it
+ * (see `charge_job_memory`), so the tasks can't use that share as well.
+ *
+ * @param size the memory limit in megabytes
+ * @param disksize the device size in megabytes
+ * @param device the char array (of `DEVICE_NAME_LEN`) we write the name into
+ * @return int
+ */
+static int create_zram(uint64_t size, uint64_t disksize, char device[]) {
+  char id[16];
+  if (read_file(ZRAM_CONTROL "/hot_add", id, sizeof(id)) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: unable to add a zram device - is the zram module "
+                "loaded?");
+    return EXIT_FAILURE;
+  }
+  snprintf(device, DEVICE_NAME_LEN, "zram%s", id);
+
+  char path[PATH_MAX];
+  char value[32];
+  snprintf(path, sizeof(path), ZRAM_BLOCK, device, "comp_algorithm");
+  if (ramdisk_compress[0] != '\0' &&
+      write_sysfs(path, ramdisk_compress) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: zram doesn't support %s compression",
+                ramdisk_compress);
+    release_zram(device);
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), ZRAM_BLOCK, device, "mem_limit");
+  snprintf(value, sizeof(value), "%" PRIu64 "M", size);
+  if (write_sysfs(path, value) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to limit %s to %s", device, value);
+    release_zram(device);
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), ZRAM_BLOCK, device, "disksize");
+  snprintf(value, sizeof(value), "%" PRIu64 "M", disksize);
+  if (write_sysfs(path, value) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to size %s to %s", device, value);
+    release_zram(device);
+    return EXIT_FAILURE;
+  }
+
+  // udev may still be creating the device node
+  struct stat sb;
+  snprintf(path, sizeof(path), "/dev/%s", device);
+  for (int waited = 0; stat(path, &sb) != 0; waited += 10) {
+    if (waited >= DEVICE_WAIT_MS) {
+      slurm_error("ramdisk.c: %s never appeared", path);
+      release_zram(device);
+      return EXIT_FAILURE;
+    }
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 10000000L};
+    nanosleep(&delay, NULL);
+  }
+
+  slurm_verbose("ramdisk.c: created %s (%" PRIu64 "M, %" PRIu64
+                "M of memory)",
+                device, disksize, size);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Frees a zram device's memory and removes it
+ * The device must no longer be mounted.
+ *
+ * @param device the device name (e.g. `zram0`)
+ * @return int
+ */
+static int release_zram(const char *device) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), ZRAM_BLOCK, device, "reset");
+  if (write_sysfs(path, "1") != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to reset %s", device);
+    return EXIT_FAILURE;
+  }
+
+  const char *id = device + strlen("zram");
+  if (write_sysfs(ZRAM_CONTROL "/hot_remove", id) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to remove %s", device);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads a field (in bytes) of a zram device's `mm_stat`
+ *
+ * @param device the device name (e.g. `zram0`)
+ * @param field the field index (e.g. `ZRAM_MEM_USED_TOTAL`)
+ * @param value where we store the value
+ * @return int
+ */
+static int read_zram_stat(const char *device, int field, uint64_t *value) {
+  char path[PATH_MAX];
+  char stat[256];
+  snprintf(path, sizeof(path), ZRAM_BLOCK, device, "mm_stat");
+  if (read_file(path, stat, sizeof(stat)) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  char *cursor = stat;
+  for (int i = 0; i <= field; i++) {
+    char *end;
+    errno = 0;
+    *value = strtoull(cursor, &end, 10);
+    if (errno != 0 || end == cursor) {
+      return EXIT_FAILURE;
+    }
+    cursor = end;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Finds the block device backing a RAM disk, if any
+ * tmpfs RAM disks have no device, and return failure.
+ *
+ * @param directory the RAM disk path
+ * @param device the char array (of `DEVICE_NAME_LEN`) we write the name into
+ * @return int
+ */
+static int get_ramdisk_device(const char *directory, char device[]) {
+  struct stat sb;
+  if (stat(directory, &sb) != 0 || major(sb.st_dev) == 0) {
+    return EXIT_FAILURE;
+  }
+
+  char path[PATH_MAX];
+  char target[PATH_MAX];
+  snprintf(path, sizeof(path), SYS_DEV_BLOCK, major(sb.st_dev),
+           minor(sb.st_dev));
+  ssize_t length = readlink(path, target, sizeof(target) - 1);
+  if (length < 0) {
+    return EXIT_FAILURE;
+  }
+  target[length] = '\0';
+
+  const char *name = strrchr(target, '/');
+  name = name != NULL ? name + 1 : target;
+  if (strncmp(name, "zram", strlen("zram")) != 0 ||
+      strlen(name) >= DEVICE_NAME_LEN) {
+    return EXIT_FAILURE;
+  }
+  strcpy(device, name);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Points the job's environment at a RAM disk
+ * Sets `SLURM_JOB_RAMDISK`, along with `SLURM_JOB_RAMDISK_IMAGE` and
+ * `SLURM_JOB_RAMDISK_CACHE` when it holds (or, per our options, will hold) an
+ * image or cached dataset, and `TMPDIR` for `--ramdisk-namespace=tmp`.
+ * `SLURM_JOB_RAMDISK_RESIZE` is the file the job writes a new size to.
+ *
+ * @param sp the spank instance
+ * @param directory the RAM disk path
+ */
+static void set_ramdisk_env(spank_t sp, const char *directory) {
+  static const char *extras[][2] = {
+      {"SLURM_JOB_RAMDISK_IMAGE", IMAGE_MOUNT_NAME},
+      {"SLURM_JOB_RAMDISK_CACHE", CACHE_MOUNT_NAME}};
+  const int requested[] = {ramdisk_image[0] != '\0', ramdisk_cache[0] != '\0'};
+
+  if (spank_setenv(sp, "SLURM_JOB_RAMDISK", directory, 1) != ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: unable to set SLURM_JOB_RAMDISK=%s", directory);
+  }
+  char resize[PATH_MAX];
+  snprintf(resize, sizeof(resize), "%s/" RESIZE_FILE_NAME, directory);
+  if (spank_setenv(sp, "SLURM_JOB_RAMDISK_RESIZE", resize, 1) !=
+      ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: unable to set SLURM_JOB_RAMDISK_RESIZE=%s", resize);
+  }
+  if (ramdisk_namespace_tmp &&
+      spank_setenv(sp, "TMPDIR", directory, 1) != ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: unable to set TMPDIR=%s", directory);
+  }
+
+  for (size_t i = 0; i < sizeof(extras) / sizeof(extras[0]); i++) {
+    char path[PATH_MAX];
+    struct stat sb;
+    snprintf(path, sizeof(path), "%s/%s", directory, extras[i][1]);
+    if ((requested[i] || stat(path, &sb) == 0) &&
+        spank_setenv(sp, extras[i][0], path, 1) != ESPANK_SUCCESS) {
+      slurm_error("ramdisk.c: unable to set %s=%s", extras[i][0], path);
+    }
+  }
+}
+
+/**
+ * @brief Loads `--ramdisk-image` into a RAM disk, and mounts it read-only
+ * The image is copied (as the job user) to `IMAGE_FILE_NAME` in the RAM disk
+ * in one streaming read, so it stays compressed in memory, then loop mounted
+ * at `IMAGE_MOUNT_NAME`. The loop device clears itself once unmounted.
+ *
+ * The RAM disk belongs to the job user, who could swap the copy for a link to
+ * any file while we work on it, so it's opened once (not following links) and
+ * only ever used through that descriptor.
+ *
+ * @param sp the spank instance
+ * @param directory the RAM disk path
+ * @param uid the job user, who must own the copy
+ * @return int
+ */
+static int mount_image(spank_t sp, const char *directory, uid_t uid) {
+  char image[PATH_MAX];
+  char target[PATH_MAX];
+  snprintf(image, sizeof(image), "%s/" IMAGE_FILE_NAME, directory);
+  snprintf(target, sizeof(target), "%s/" IMAGE_MOUNT_NAME, directory);
+
+  uint64_t start = timing_now();
+  struct stage_paths paths = {.src = ramdisk_image, .dst = image};
+  if (run_as_user(sp, stage_image, &paths, 0) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to load %s into the ramdisk",
+                ramdisk_image);
+    return EXIT_FAILURE;
+  }
+  timing_add(TIMING_STAGE_IN, start);
+
+  int fd = open(image, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_uid != uid) {
+    slurm_error("ramdisk.c: %s isn't the image we loaded", image);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EXIT_FAILURE;
+  }
+
+  // the job mustn't be able to change the image underneath the mount - nor
+  // still have it open, which a write lease only gets when no one else does
+  if (fchown(fd, 0, 0) != 0 || fchmod(fd, S_IRUSR | S_IRGRP | S_IROTH) != 0 ||
+      fcntl(fd, F_SETLEASE, F_WRLCK) != 0) {
+    slurm_error("ramdisk.c: failed to protect %s: %s", image, strerror(errno));
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  fcntl(fd, F_SETLEASE, F_UNLCK);
+
+  const char *type = get_image_type(fd);
+  if (type == NULL) {
+    slurm_error("ramdisk.c: %s is not a SquashFS or EROFS image",
+                ramdisk_image);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  start = timing_now();
+  if (mkdir(target, IMAGE_MOUNT_MODE) != 0) {
+    slurm_error("ramdisk.c: failed to create %s", target);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  char device[PATH_MAX];
+  int loop = attach_loop(fd, image, device);
+  close(fd);
+  if (loop < 0) {
+    return EXIT_FAILURE;
+  }
+  int rc = EXIT_SUCCESS;
+  if (mount(device, target, type, MS_RDONLY | MS_NODEV | MS_NOSUID, NULL) !=
+      0) {
+    slurm_error("ramdisk.c: failed to mount %s (%s): %s", ramdisk_image, type,
+                strerror(errno));
+    rc = EXIT_FAILURE;
+  }
+  // the mount holds the loop device now - or, if it failed, this clears it
+  close(loop);
+  timing_add(TIMING_MOUNT, start);
+
+  if (rc == EXIT_SUCCESS) {
+    slurm_info("ramdisk.c: mounted %s image %s at %s", type, ramdisk_image,
+               target);
+  }
+  return rc;
+}
+
+/**
+ * @brief Copies `--ramdisk-image` into the RAM disk
+ * Runs as the job user (see `run_as_user`). Space is reserved up front, so an
+ * image too large for the RAM disk fails before anything is read.
+ *
+ * @param paths the `stage_paths` (image, and its path in the RAM disk)
+ * @return int
+ */
+static int stage_image(void *paths) {
+  const struct stage_paths *stage = paths;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int in = open(stage->src, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    slurm_error("ramdisk.c: failed to open %s: %s", stage->src,
+                strerror(errno));
+    return EXIT_FAILURE;
+  }
+  struct stat st;
+  int out = -1;
+  if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (out = open(stage->dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  S_IRUSR)) < 0) {
+    slurm_error("ramdisk.c: failed to copy %s", stage->src);
+    close(in);
+    return EXIT_FAILURE;
+  }
+
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+  int rc = posix_fallocate(out, 0, st.st_size);
+  if (rc != 0) {
+    slurm_error("ramdisk.c: no room for %s (%" PRIu64 "M): %s", stage->src,
+                (uint64_t)st.st_size >> 20, strerror(rc));
+    rc = EXIT_FAILURE;
+  } else {
+    rc = copy_range(in, out, 0, st.st_size);
+  }
+  close(in);
+  close(out);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+  slurm_info("ramdisk.c: loaded %" PRIu64 "M image from %s in %.2fs",
+             (uint64_t)st.st_size >> 20, stage->src, elapsed);
+  return rc;
+}
+
+/**
+ * @brief Identifies an image's filesystem from its superblock magic
+ *
+ * @param fd the open image
+ * @return const char* the filesystem type, or NULL if unrecognised
+ */
+static const char *get_image_type(int fd) {
+  const char *type = NULL;
+  unsigned char magic[4];
+  if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      memcmp(magic, SQUASHFS_MAGIC, sizeof(magic)) == 0) {
+    type = "squashfs";
+  } else if (pread(fd, magic, sizeof(magic), EROFS_MAGIC_OFFSET) ==
+                 sizeof(magic) &&
+             (magic[0] | magic[1] << 8 | magic[2] << 16 |
+              (uint32_t)magic[3] << 24) == EROFS_MAGIC) {
+    type = "erofs";
+  }
+
+  return type;
+}
+
+/**
+ * @brief Attaches an image to a free, read-only, auto-clearing loop device
+ * Retries if another process claims the free device first.
+ *
+ * Returns the open loop device, which must stay open until mounted, or -1.
+ *
+ * @param file the open image, which the caller still closes
+ * @param image the image path (for the device's name only)
+ * @param device the char array (of `PATH_MAX`) we write the device path into
+ * @return int
+ */
+static int attach_loop(int file, const char *image, char device[]) {
+  int control = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+  if (control < 0) {
+    slurm_error("ramdisk.c: unable to set up a loop device: %s",
+                strerror(errno));
+    return -1;
+  }
+
+  int loop = -1;
+  for (int attempt = 0; attempt < LOOP_RETRIES && loop < 0; attempt++) {
+    int n = ioctl(control, LOOP_CTL_GET_FREE);
+    if (n < 0) {
+      break;
+    }
+    snprintf(device, PATH_MAX, LOOP_DEVICE, n);
+    loop = open(device, O_RDONLY | O_CLOEXEC);
+    if (loop < 0) {
+      continue;
+    }
+    if (ioctl(loop, LOOP_SET_FD, file) != 0) {
+      // someone else got it first
+      close(loop);
+      loop = -1;
+      continue;
+    }
+
+    struct loop_info64 info = {.lo_flags = LO_FLAGS_AUTOCLEAR};
+    snprintf((char *)info.lo_file_name, LO_NAME_SIZE, "%s", image);
+    if (ioctl(loop, LOOP_SET_STATUS64, &info) != 0) {
+      ioctl(loop, LOOP_CLR_FD, 0);
+      close(loop);
+      loop = -1;
+      break;
+    }
+  }
+
+  close(control);
+  if (loop < 0) {
+    slurm_error("ramdisk.c: unable to attach %s to a loop device", image);
+  }
+  return loop;
+}
+
+/**
+ * @brief Unmounts everything mounted within a RAM disk (but not the RAM disk)
+ * Deepest mounts go first, and busy mounts are lazily detached.
+ *
+ * @param directory the RAM disk path
+ */
+static void unmount_submounts(const char *directory) {
+  FILE *file = fopen(MOUNTINFO_SELF, "r");
+  if (file == NULL) {
+    return;
+  }
+
+  // fields are `ID PARENT MAJOR:MINOR ROOT MOUNTPOINT ...`
+  char line[PATH_MAX * 2];
+  char targets[SUBMOUNTS_MAX][PATH_MAX];
+  int n_targets = 0;
+  char target[PATH_MAX];
+  while (fgets(line, sizeof(line), file) != NULL &&
+         n_targets < SUBMOUNTS_MAX) {
+    if (sscanf(line, "%*s %*s %*s %*s %4095s", target) == 1 &&
+        strcmp(target, directory) != 0 && path_within(target, directory)) {
+      strcpy(targets[n_targets++], target);
+    }
+  }
+  fclose(file);
+
+  // later mounts stack on earlier ones, so unmount in reverse
+  for (int i = n_targets - 1; i >= 0; i--) {
+    if (umount(targets[i]) != 0 && umount2(targets[i], MNT_DETACH) != 0) {
+      slurm_error("ramdisk.c: failed to unmount %s: %s", targets[i],
+                  strerror(errno));
+    }
+  }
+}
+
+/**
+ * @brief Mounts an overlay of `--ramdisk-overlay` on a RAM disk
+ * Creates the `upper` and `work` layers in the RAM disk, then mounts the
+ * overlay over the RAM disk's own path, so `SLURM_JOB_RAMDISK` is the merged
+ * view. The RAM disk stays mounted underneath, holding the layers.
+ *
+ * @param sp the spank instance
+ * @param directory the RAM disk path
+ * @param uid the owning user
+ * @param gid the owning group
+ * @return int
+ */
+static int mount_overlay(spank_t sp, const char *directory, uid_t uid,
+                         gid_t gid) {
+  // we mount as root, so make sure the job could read the lower directory
+  // itself
+  if (run_as_user(sp, check_readable, ramdisk_overlay, 0) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: cannot overlay %s", ramdisk_overlay);
+    return EXIT_FAILURE;
+  }
+
+  char upper[PATH_MAX];
+  char work[PATH_MAX];
+  snprintf(upper, sizeof(upper), "%s/" OVERLAY_UPPER, directory);
+  snprintf(work, sizeof(work), "%s/" OVERLAY_WORK, directory);
+  // the upper layer's root becomes the merged root
+  if (mkdir(upper, INITIAL_DIR_MODE_RWX) != 0 || chown(upper, uid, gid) != 0 ||
+      mkdir(work, INITIAL_DIR_MODE_RWX) != 0) {
+    slurm_error("ramdisk.c: failed to create the overlay layers");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t start = timing_now();
+  char options[PATH_MAX * 3 + 64];
+  snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s",
+           ramdisk_overlay, upper, work);
+  if (mount(MOUNT_TYPE_OVERLAY, directory, MOUNT_TYPE_OVERLAY,
+            MS_NODEV | MS_NOSUID, options) != 0) {
+    slurm_error("ramdisk.c: failed to mount the overlay of %s: %s",
+                ramdisk_overlay, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  timing_add(TIMING_MOUNT, start);
+
+  slurm_info("ramdisk.c: overlaid %s at %s", ramdisk_overlay, directory);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Checks the caller can read a file or directory
+ * Runs as the job user (see `run_as_user`).
+ *
+ * @param path the file or directory
+ * @return int
+ */
+static int check_readable(void *path) {
+  struct stat sb;
+  if (stat(path, &sb) != 0 ||
+      access(path, S_ISDIR(sb.st_mode) ? R_OK | X_OK : R_OK) != 0) {
+    slurm_error("ramdisk.c: %s is not readable", (char *)path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Checks whether the top mount of a RAM disk is an overlay
+ *
+ * @param directory the RAM disk path
+ * @return int non-zero if it is
+ */
+static int is_overlay(const char *directory) {
+  struct statfs sf;
+  return statfs(directory, &sf) == 0 && sf.f_type == OVERLAYFS_SUPER_MAGIC;
+}
+
+/**
+ * @brief Binds a node-cached copy of `--ramdisk-cache` into a RAM disk
+ * Datasets are cached per user, keyed by path, size and modification time, so
+ * concurrent (and later) jobs of the user share one copy read from the source
+ * once. Each RAM disk bound to a dataset holds it until teardown. If it can't
+ * be cached, the dataset is copied into the RAM disk instead.
+ *
+ * @param sp the spank instance
+ * @param directory the RAM disk path
+ * @param uid the owning user
+ * @param gid the owning group
+ * @return int
+ */
+static int mount_cache(spank_t sp, const char *directory, uid_t uid,
+                       gid_t gid) {
+  char target[PATH_MAX];
+  snprintf(target, sizeof(target), "%s/" CACHE_MOUNT_NAME, directory);
+  if (mkdir(target, INITIAL_DIR_MODE_RWX) != 0 ||
+      chown(target, uid, gid) != 0) {
+    slurm_error("ramdisk.c: failed to create %s", target);
+    return EXIT_FAILURE;
+  }
+
+  // the cache is shared, so the job must be able to read the source itself
+  if (run_as_user(sp, check_readable, ramdisk_cache, 0) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if (hold_cache(sp, directory, target) == EXIT_SUCCESS) {
+    return EXIT_SUCCESS;
+  }
+
+  slurm_info("ramdisk.c: unable to cache %s, copying it into the ramdisk",
+             ramdisk_cache);
+  uint64_t start = timing_now();
+  struct stage_paths paths = {.src = ramdisk_cache, .dst = target};
+  if (run_as_user(sp, stage_in, &paths, 0) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to stage %s into the ramdisk",
+                ramdisk_cache);
+    return EXIT_FAILURE;
+  }
+  timing_add(TIMING_STAGE_IN, start);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Takes a hold on the cached dataset (filling it if needed), and binds
+ * it read-only at `target`
+ * Holders are files named for the RAM disk in `<key>.holders`, and the
+ * `<key>.size` file marks the dataset complete (its modification time being
+ * when it was last used).
+ *
+ * @param sp the spank instance
+ * @param directory the RAM disk path
+ * @param target the mount point in the RAM disk
+ * @return int
+ */
+static int hold_cache(spank_t sp, const char *directory, const char *target) {
+  uid_t uid;
+  gid_t gid;
+  struct stat st;
+  if (spank_get_item(sp, S_JOB_UID, &uid) != ESPANK_SUCCESS ||
+      spank_get_item(sp, S_JOB_GID, &gid) != ESPANK_SUCCESS ||
+      stat(ramdisk_cache, &st) != 0) {
+    return EXIT_FAILURE;
+  }
+  char key[CACHE_KEY_LEN];
+  get_cache_key(uid, &st, key);
+
+  int lock = lock_cache();
+  if (lock < 0) {
+    return EXIT_FAILURE;
+  }
+
+  char entry[PATH_MAX];
+  char size[PATH_MAX];
+  char holders[PATH_MAX];
+  snprintf(entry, sizeof(entry), "%s/%s", node_paths.cache, key);
+  snprintf(size, sizeof(size), "%s/%s.size", node_paths.cache_state, key);
+  snprintf(holders, sizeof(holders), "%s/%s.holders", node_paths.cache_state,
+           key);
+
+  int rc = EXIT_SUCCESS;
+  if (stat(size, &st) == 0) {
+    slurm_info("ramdisk.c: using the cached copy of %s", ramdisk_cache);
+  } else {
+    rc = fill_cache(sp, key, uid, gid);
+  }
+
+  const char *name = strrchr(directory, '/') + 1;
+  char *holder = join_path(holders, name);
+  if (rc == EXIT_SUCCESS &&
+      ((mkdir(holders, STATE_DIR_MODE) != 0 && errno != EEXIST) ||
+       holder == NULL ||
+       close(open(holder, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)) != 0)) {
+    slurm_error("ramdisk.c: failed to hold the cached %s", ramdisk_cache);
+    rc = EXIT_FAILURE;
+  }
+  if (rc == EXIT_SUCCESS) {
+    utimensat(AT_FDCWD, size, NULL, 0);
+  }
+  close(lock);
+
+  if (rc == EXIT_SUCCESS &&
+      (mount(entry, target, NULL, MS_BIND, NULL) != 0 ||
+       mount(NULL, target, NULL,
+             MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | MS_NODEV,
+             NULL) != 0)) {
+    slurm_error("ramdisk.c: failed to bind the cached %s: %s", ramdisk_cache,
+                strerror(errno));
+    umount2(target, MNT_DETACH);
+    release_cache(directory);
+    rc = EXIT_FAILURE;
+  }
+
+  free(holder);
+  return rc;
+}
+
+/**
+ * @brief Copies `--ramdisk-cache` into a new cache entry
+ * Measures the dataset, evicts unused datasets to make room for it, and
+ * reserves it from the node's RAM disk memory (released on eviction), then
+ * mounts a tmpfs of that size for the entry and populates it as the job user.
+ * The copy runs outside the job's cgroup, as the cache outlives the job.
+ *
+ * Must be called with the cache locked.
+ *
+ * @param sp the spank instance
+ * @param key the cache key
+ * @param uid the owning user
+ * @param gid the owning group
+ * @return int
+ */
+static int fill_cache(spank_t sp, const char *key, uid_t uid, gid_t gid) {
+  char entry[PATH_MAX];
+  char size[PATH_MAX];
+  snprintf(entry, sizeof(entry), "%s/%s", node_paths.cache, key);
+  snprintf(size, sizeof(size), "%s/%s.size", node_paths.cache_state, key);
+
+  // measured as the job user, who may see more than root (e.g. on NFS)
+  uint64_t *bytes = mmap(NULL, sizeof(*bytes), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (bytes == MAP_FAILED) {
+    slurm_error("ramdisk.c: failed to map memory: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  *bytes = 0;
+  int rc = run_as_user(sp, measure_dataset, bytes, 0);
+  uint64_t needed = (*bytes + (1 << 20) - 1) >> 20;
+  munmap(bytes, sizeof(*bytes));
+  if (rc != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to measure %s", ramdisk_cache);
+    return EXIT_FAILURE;
+  }
+  if (needed == 0) {
+    needed = 1;
+  }
+
+  uint64_t used = evict_cache(needed);
+  if (used + needed > cache_max) {
+    slurm_info("ramdisk.c: the node's ramdisk cache has no room for %s "
+               "(%" PRIu64 "M)",
+               ramdisk_cache, needed);
+    return EXIT_FAILURE;
+  }
+  uint64_t reserved;
+  uint64_t cap;
+  if (reserve_node_memory(needed, &reserved, &cap) != EXIT_SUCCESS) {
+    slurm_info("ramdisk.c: unable to cache %s (%" PRIu64 "M), as the node's "
+               "ramdisks already hold %" PRIu64 "M of %" PRIu64 "M",
+               ramdisk_cache, needed, reserved, cap);
+    return EXIT_FAILURE;
+  }
+
+  if (mount_tmpfs(entry, needed, uid, gid, "") != EXIT_SUCCESS) {
+    rmdir(entry);
+    release_node_memory(needed);
+    return EXIT_FAILURE;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    leave_job_cgroup();
+    struct stage_paths paths = {.src = ramdisk_cache, .dst = entry};
+    _exit(run_as_user(sp, stage_in, &paths, 0));
+  }
+  int status = 0;
+  while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+
+  char value[32];
+  snprintf(value, sizeof(value), "%" PRIu64, needed);
+  if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS ||
+      append_line(size, value, strlen(value)) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to cache %s", ramdisk_cache);
+    umount(entry);
+    rmdir(entry);
+    unlink(size);
+    release_node_memory(needed);
+    return EXIT_FAILURE;
+  }
+
+  slurm_info("ramdisk.c: cached %s (%sM)", ramdisk_cache, value);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Measures the memory `--ramdisk-cache` takes in a tmpfs
+ * Runs as the job user (see `run_as_user`). Symbolic links aren't followed,
+ * as the copy doesn't follow them either.
+ *
+ * @param bytes where we store the size, shared with the parent
+ * @return int
+ */
+static int measure_dataset(void *bytes) {
+  measured_bytes = 0;
+  if (nftw(ramdisk_cache, measure_entry, CACHE_MEASURE_FDS, FTW_PHYS) != 0) {
+    return EXIT_FAILURE;
+  }
+  *(uint64_t *)bytes = measured_bytes;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Adds a file's pages to `measured_bytes`
+ * Callback for `nftw`, from `measure_dataset`. Directories take no pages of a
+ * tmpfs, but files and (long) symbolic links are rounded up to whole pages.
+ *
+ * @param path the file's path
+ * @param sb the file's status
+ * @param type the `FTW_*` type
+ * @param ftw the depth, unused
+ * @return int non-zero to stop the walk
+ */
+static int measure_entry(const char *path, const struct stat *sb, int type,
+                         struct FTW *ftw) {
+  if (type == FTW_NS || type == FTW_DNR) {
+    slurm_error("ramdisk.c: %s is not readable", path);
+    return 1;
+  }
+  if (S_ISREG(sb->st_mode) || S_ISLNK(sb->st_mode)) {
+    measured_bytes += ((uint64_t)sb->st_size + CACHE_PAGE_SIZE - 1) /
+                      CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+  }
+  return 0;
+}
+
+/**
+ * @brief Evicts the least recently used, unheld, datasets from the cache
+ * Stops once `needed` megabytes are free, or nothing else can be evicted,
+ * releasing each evicted dataset's memory back to the node.
+ *
+ * Must be called with the cache locked.
+ *
+ * @param needed the megabytes to free
+ * @return uint64_t the megabytes still cached
+ */
+static uint64_t evict_cache(uint64_t needed) {
+  while (1) {
+    DIR *dir = opendir(node_paths.cache_state);
+    if (dir == NULL) {
+      return 0;
+    }
+
+    uint64_t used = 0;
+    uint64_t oldest_size = 0;
+    char oldest[CACHE_KEY_LEN] = {0};
+    struct timespec oldest_time = {0};
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+      char *suffix = strrchr(item->d_name, '.');
+      if (suffix == NULL || strcmp(suffix, ".size") != 0 ||
+          suffix - item->d_name != CACHE_KEY_LEN - 1) {
+        continue;
+      }
+
+      char path[PATH_MAX];
+      char value[32];
+      struct stat st;
+      snprintf(path, sizeof(path), "%s/%s", node_paths.cache_state,
+               item->d_name);
+      if (read_file(path, value, sizeof(value)) != EXIT_SUCCESS ||
+          stat(path, &st) != 0) {
+        continue;
+      }
+      uint64_t size = strtoull(value, NULL, 10);
+      used += size;
+
+      // removing the holders only succeeds once it's empty
+      snprintf(path, sizeof(path), "%s/%.*s.holders", node_paths.cache_state,
+               CACHE_KEY_LEN - 1, item->d_name);
+      if ((rmdir(path) == 0 || errno == ENOENT) &&
+          (oldest[0] == '\0' || st.st_mtim.tv_sec < oldest_time.tv_sec ||
+           (st.st_mtim.tv_sec == oldest_time.tv_sec &&
+            st.st_mtim.tv_nsec < oldest_time.tv_nsec))) {
+        snprintf(oldest, sizeof(oldest), "%.*s", CACHE_KEY_LEN - 1,
+                 item->d_name);
+        oldest_time = st.st_mtim;
+        oldest_size = size;
+      }
+    }
+    closedir(dir);
+
+    if (used + needed <= cache_max || oldest[0] == '\0') {
+      return used;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", node_paths.cache, oldest);
+    if (umount(path) != 0 && umount2(path, MNT_DETACH) != 0) {
+      slurm_error("ramdisk.c: failed to evict %s from the cache: %s", path,
+                  strerror(errno));
+      return used;
+    }
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/%s.size", node_paths.cache_state, oldest);
+    unlink(path);
+    release_node_memory(oldest_size);
+    slurm_verbose("ramdisk.c: evicted %s from the cache", oldest);
+  }
+}
+
+/**
+ * @brief Drops a RAM disk's holds on cached datasets
+ * The datasets stay cached until evicted.
+ *
+ * @param directory the RAM disk path
+ */
+static void release_cache(const char *directory) {
+  int lock = lock_cache();
+  if (lock < 0) {
+    return;
+  }
+
+  DIR *dir = opendir(node_paths.cache_state);
+  struct dirent *item;
+  while (dir != NULL && (item = readdir(dir)) != NULL) {
+    char *suffix = strrchr(item->d_name, '.');
+    if (suffix == NULL || strcmp(suffix, ".holders") != 0) {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/%s", node_paths.cache_state,
+             item->d_name, strrchr(directory, '/') + 1);
+    if (unlink(path) == 0) {
+      // last used now
+      snprintf(path, sizeof(path), "%s/%.*s.size", node_paths.cache_state,
+               (int)(suffix - item->d_name), item->d_name);
+      utimensat(AT_FDCWD, path, NULL, 0);
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+
+  close(lock);
+}
+
+/**
+ * @brief Takes the node's cache lock, creating the cache directories if needed
+ * The lock is released by closing the returned descriptor.
+ *
+ * @return int the locked descriptor, or -1 on failure
+ */
+static int lock_cache(void) {
+  if ((mkdir(node_paths.state, STATE_DIR_MODE) != 0 && errno != EEXIST) ||
+      (mkdir(node_paths.cache_state, STATE_DIR_MODE) != 0 &&
+       errno != EEXIST) ||
+      (mkdir(node_paths.cache, STATE_DIR_MODE) != 0 && errno != EEXIST)) {
+    slurm_error("ramdisk.c: failed to create the cache directories: %s",
+                strerror(errno));
+    return -1;
+  }
+
+  int fd = open(node_paths.cache_lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    slurm_error("ramdisk.c: failed to open %s: %s", node_paths.cache_lock,
+                strerror(errno));
+    return -1;
+  }
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      slurm_error("ramdisk.c: failed to lock %s: %s", node_paths.cache_lock,
+                  strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Generates the cache key for a dataset
+ * An FNV-1a hash of the user, and the dataset's path, size and modification
+ * time - so a changed dataset is cached afresh. Changes deep within a
+ * directory that leave its own modification time alone aren't noticed.
+ *
+ * @param uid the job user
+ * @param st the dataset's `stat`
+ * @param key the char array (of `CACHE_KEY_LEN`) we write the key into
+ */
+static void get_cache_key(uid_t uid, const struct stat *st, char key[]) {
+  char identity[PATH_MAX + 128];
+  int length = snprintf(identity, sizeof(identity),
+                        "%u:%s:%lld:%lld.%09ld", uid, ramdisk_cache,
+                        (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+                        st->st_mtim.tv_nsec);
+
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (int i = 0; i < length && i < (int)sizeof(identity); i++) {
+    hash ^= (unsigned char)identity[i];
+    hash *= FNV_PRIME;
+  }
+  snprintf(key, CACHE_KEY_LEN, "%016" PRIx64, hash);
+}
+
+/**
+ * @brief Writes a value to a sysfs (or other pseudo) file
+ *
+ * @param path the file to write
+ * @param value the value to write
+ * @return int
+ */
+static int write_sysfs(const char *path, const char *value) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return EXIT_FAILURE;
+  }
+
+  ssize_t length = strlen(value);
+  int rc = write(fd, value, length) == length ? EXIT_SUCCESS : EXIT_FAILURE;
+  close(fd);
+  return rc;
+}
+
+/**
+ * @brief Runs a helper program, waiting for it to finish
+ * Output is discarded.
+ *
+ * @param argv the program (an absolute path) and its arguments
+ * @return int
+ */
+static int run_command(char *const argv[]) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    return EXIT_FAILURE;
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_RDWR);
+    if (null >= 0) {
+      dup2(null, STDIN_FILENO);
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return EXIT_FAILURE;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? EXIT_SUCCESS
+                                                       : EXIT_FAILURE;
+}
+
+/**
+ * @brief Generate the path of a per-job state file
+ * State lives in the state directory as `<job><suffix>`, shared between every
+ * step of the job on this node.
+ *
+ * @param sp the spank instance
+ * @param suffix the state file suffix (e.g. `.lock`)
+ * @param path the char array (of `PATH_MAX`) we write the path into
+ * @return int
+ */
+static int get_state_path(spank_t sp, const char *suffix, char path[]) {
+  uint32_t job_id;
+  if (spank_get_item(sp, S_JOB_ID, &job_id) != ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: failed to get job ID");
+    return EXIT_FAILURE;
+  }
+
+  snprintf(path, PATH_MAX, "%s/%" PRIu32 "%s", node_paths.state, job_id,
+           suffix);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Takes the job's lock, serialising its steps' RAM disk changes
+ * The lock is released by closing the returned descriptor (including when
+ * slurmstepd dies).
+ *
+ * @param sp the spank instance
+ * @return int the locked descriptor, or -1 on failure
+ */
+static int lock_job(spank_t sp) {
+  char path[PATH_MAX];
+  if (get_state_path(sp, ".lock", path) != EXIT_SUCCESS) {
+    return -1;
+  }
+  return lock_file(path);
+}
+
+/**
+ * @brief Takes an exclusive lock on a state file, creating it if needed
+ *
+ * @param path the lock file's path
+ * @return int the locked descriptor, or -1 on failure
+ */
+static int lock_file(const char *path) {
+  if (mkdir(node_paths.state, STATE_DIR_MODE) != 0 && errno != EEXIST) {
+    slurm_error("ramdisk.c: failed to create %s: %s", node_paths.state,
+                strerror(errno));
+    return -1;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    slurm_error("ramdisk.c: failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      slurm_error("ramdisk.c: failed to lock %s: %s", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Resolves this step's entry in the job's ledger
+ * Job scoped RAM disks share the job's entry, whichever step reserved it.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int set_reservation(spank_t sp) {
+  char ledger[PATH_MAX];
+  char name[STEP_NAME_LEN];
+  if (get_state_path(sp, ".lock", reservation.lock) != EXIT_SUCCESS ||
+      get_state_path(sp, JOB_LEDGER_SUFFIX, ledger) != EXIT_SUCCESS ||
+      (!ramdisk_job_scope && get_step_name(sp, name) != EXIT_SUCCESS)) {
+    return EXIT_FAILURE;
+  }
+  if (spank_get_item(sp, S_JOB_ALLOC_MEM, &reservation.allocation) !=
+      ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: failed to get job memory allocation");
+    return EXIT_FAILURE;
+  }
+
+  if (snprintf(reservation.entry, sizeof(reservation.entry), "%s/%s", ledger,
+               ramdisk_job_scope ? JOB_LEDGER_JOB_ENTRY : name) >=
+      (int)sizeof(reservation.entry)) {
+    reservation.entry[0] = '\0';
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reserves the step's RAM disks from the job's allocation
+ * Concurrent steps of a job on the node are each checked against their own
+ * allocation, but together must also fit in the job's - less the headroom.
+ *
+ * Must be called with the job locked.
+ *
+ * Returns failure (with the reason logged) if the job has no room left.
+ *
+ * @param sp the spank instance
+ * @param size the RAM disks' total size in megabytes
+ * @return int
+ */
+static int reserve_job_memory(spank_t sp, uint64_t size) {
+  if (set_reservation(sp) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  uint64_t others = 0;
+  if (update_reservation(size, &others) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: cannot create ramdisk of size %" PRIu64
+                "M, as the job's other steps have reserved %" PRIu64
+                "M of the %" PRIu64 "M allocated to it, and %" PRIu64
+                "M must be left for the job (--ramdisk-headroom)",
+                size, others, reservation.allocation,
+                get_headroom(reservation.allocation));
+    reservation.entry[0] = '\0';
+    return EXIT_FAILURE;
+  }
+
+  // and with every other RAM disk on the node, within its cap
+  uint64_t reserved;
+  uint64_t cap;
+  if (reserve_node_memory(size, &reserved, &cap) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: cannot create ramdisk of size %" PRIu64
+                "M, as the node's ramdisks already hold %" PRIu64
+                "M of the %" PRIu64 "M they may use",
+                size, reserved, cap);
+    unlink(reservation.entry);
+    reservation.entry[0] = '\0';
+    return EXIT_FAILURE;
+  }
+  slurm_debug("ramdisk.c: reserved %" PRIu64 "M, with %" PRIu64
+              "M reserved by the job's other steps, and %" PRIu64
+              "M by the node's",
+              size, others, reserved);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Sets this step's reservation, if the job's allocation has room
+ * Sums every other live entry in the ledger - those left by a slurmstepd that
+ * died without releasing them are removed.
+ *
+ * Must be called with the job locked.
+ *
+ * Returns failure if the reservation doesn't fit, or can't be written.
+ *
+ * @param size the RAM disks' total size in megabytes
+ * @param others where we store the other entries' total in megabytes
+ * @return int
+ */
+static int update_reservation(uint64_t size, uint64_t *others) {
+  char ledger[PATH_MAX];
+  snprintf(ledger, sizeof(ledger), "%s", reservation.entry);
+  char *name = strrchr(ledger, '/');
+  *name++ = '\0';
+  if (mkdir(ledger, STATE_DIR_MODE) != 0 && errno != EEXIST) {
+    slurm_error("ramdisk.c: failed to create %s: %s", ledger, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  *others = 0;
+  DIR *dir = opendir(ledger);
+  struct dirent *entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.' || strcmp(entry->d_name, name) == 0) {
+      continue;
+    }
+    char path[PATH_MAX];
+    char line[JOB_LEDGER_LINE_LEN];
+    uint64_t reserved;
+    long pid;
+    snprintf(path, sizeof(path), "%s/%s", ledger, entry->d_name);
+    if (read_file(path, line, sizeof(line)) != EXIT_SUCCESS ||
+        sscanf(line, "%" SCNu64 " %ld", &reserved, &pid) != 2) {
+      continue;
+    }
+    // its RAM disk may well still be mounted, so the node keeps it reserved
+    // until slurmd reconciles the node ledger
+    if (pid > 0 && kill((pid_t)pid, 0) != 0 && errno == ESRCH) {
+      slurm_info("ramdisk.c: releasing %" PRIu64 "M reserved by step %s, "
+                 "which is gone",
+                 reserved, entry->d_name);
+      unlink(path);
+      continue;
+    }
+    *others += reserved;
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+
+  if (reservation.allocation > 0 &&
+      *others + size + get_headroom(reservation.allocation) >=
+          reservation.allocation) {
+    return EXIT_FAILURE;
+  }
+
+  // the job's entry outlives whichever step reserved it
+  char line[JOB_LEDGER_LINE_LEN];
+  int length = snprintf(line, sizeof(line), "%" PRIu64 " %ld\n", size,
+                        ramdisk_job_scope ? 0L : (long)getpid());
+  int fd = open(reservation.entry, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0600);
+  if (fd < 0 || write(fd, line, length) != length) {
+    slurm_error("ramdisk.c: failed to write %s", reservation.entry);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Drops this step's reservation from the job's ledger
+ * The caller gives it back to the node's ledger too.
+ *
+ * Must be called with the job locked.
+ *
+ * @return uint64_t the megabytes it held, zero if unknown
+ */
+static uint64_t release_reservation(void) {
+  uint64_t reserved = 0;
+  if (reservation.entry[0] == '\0') {
+    return reserved;
+  }
+
+  char line[JOB_LEDGER_LINE_LEN];
+  if (read_file(reservation.entry, line, sizeof(line)) != EXIT_SUCCESS ||
+      sscanf(line, "%" SCNu64, &reserved) != 1) {
+    reserved = 0;
+  }
+  unlink(reservation.entry);
+  char *name = strrchr(reservation.entry, '/');
+  *name = '\0';
+  // fails while other steps have reservations
+  rmdir(reservation.entry);
+  reservation.entry[0] = '\0';
+  return reserved;
+}
+
+/**
+ * @brief Changes this step's reservation as its RAM disks are resized
+ * Called from the usage monitor, taking the job's lock itself. Passes if
+ * nothing's reserved.
+ *
+ * Returns failure if a larger reservation doesn't fit.
+ *
+ * @param size the RAM disks' new total size in megabytes
+ * @param others where we store the other entries' total in megabytes
+ * @return int
+ */
+static int resize_reservation(uint64_t size, uint64_t *others) {
+  if (reservation.entry[0] == '\0') {
+    return EXIT_SUCCESS;
+  }
+
+  int lock = lock_file(reservation.lock);
+  if (lock < 0) {
+    return EXIT_FAILURE;
+  }
+  int rc = update_reservation(size, others);
+  close(lock);
+  return rc;
+}
+
+/**
+ * @brief Attaches a step launched without `--ramdisk` to the job's RAM disk
+ * If another step of the job holds a job scoped RAM disk on this node, takes a
+ * hold on it and points `SLURM_JOB_RAMDISK` at it.
+ *
+ * Returns failure if there's no job scoped RAM disk to attach to.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int attach_job_ramdisk(spank_t sp) {
+  char holders[PATH_MAX];
+  struct stat sb;
+  if (get_state_path(sp, ".job.holders", holders) != EXIT_SUCCESS ||
+      stat(holders, &sb) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  int lock = lock_job(sp);
+  if (lock < 0) {
+    return EXIT_FAILURE;
+  }
+
+  // check again, in case the last holder released it while we waited
+  int rc = EXIT_FAILURE;
+  if (stat(holders, &sb) == 0) {
+    ramdisk_job_scope = 1;
+    rc = hold_job_ramdisk(sp);
+    if (rc != EXIT_SUCCESS) {
+      ramdisk_job_scope = 0;
+    }
+  }
+  close(lock);
+
+  char directory[DIRECTORY_PATH_LEN];
+  if (rc == EXIT_SUCCESS && get_directory(sp, directory) == EXIT_SUCCESS) {
+    slurm_verbose("ramdisk.c: sharing the job ramdisk %s", directory);
+    set_ramdisk_env(sp, directory);
+  }
+  return rc;
+}
+
+/**
+ * @brief Records this step as a holder of the job's RAM disk
+ * Holders are files named for the step in `<job>.job.holders`, so holds by
+ * steps that die without reaching the exit hook are identifiable. The creating
+ * step also records its `--ramdisk-stage-out` destination, for whichever step
+ * releases the RAM disk last.
+ *
+ * Must be called with the job locked.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int hold_job_ramdisk(spank_t sp) {
+  char holders[PATH_MAX];
+  char name[STEP_NAME_LEN];
+  if (get_state_path(sp, ".job.holders", holders) != EXIT_SUCCESS ||
+      get_step_name(sp, name) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if (mkdir(holders, STATE_DIR_MODE) == 0) {
+    char path[PATH_MAX];
+    if (stage_out_destination[0] != '\0' &&
+        get_state_path(sp, ".job.stage_out", path) == EXIT_SUCCESS) {
+      FILE *file = fopen(path, "we");
+      if (file != NULL) {
+        fputs(stage_out_destination, file);
+        fclose(file);
+      }
+    }
+  } else if (errno != EEXIST) {
+    slurm_error("ramdisk.c: failed to create %s: %s", holders, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  char *holder = join_path(holders, name);
+  int fd = holder != NULL ? open(holder, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)
+                          : -1;
+  free(holder);
+  if (fd < 0) {
+    slurm_error("ramdisk.c: failed to hold the job ramdisk");
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Drops this step's hold on the job's RAM disk
+ * When this is the last holder, clears the job's holder state and loads the
+ * recorded stage-out destination, leaving the RAM disk for us to tear down.
+ *
+ * Must be called with the job locked.
+ *
+ * Returns failure if other steps still hold the RAM disk.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int release_job_ramdisk(spank_t sp) {
+  char holders[PATH_MAX];
+  char name[STEP_NAME_LEN];
+  if (get_state_path(sp, ".job.holders", holders) != EXIT_SUCCESS ||
+      get_step_name(sp, name) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  char *holder = join_path(holders, name);
+  if (holder != NULL) {
+    unlink(holder);
+    free(holder);
+  }
+
+  // other steps still running with it
+  if (rmdir(holders) != 0 && errno != ENOENT) {
+    slurm_verbose("ramdisk.c: job ramdisk still held by other steps");
+    return EXIT_FAILURE;
+  }
+
+  char path[PATH_MAX];
+  if (get_state_path(sp, ".job.stage_out", path) == EXIT_SUCCESS) {
+    if (stage_out_destination[0] == '\0' &&
+        read_file(path, stage_out_destination,
+                  sizeof(stage_out_destination)) != EXIT_SUCCESS) {
+      stage_out_destination[0] = '\0';
+    }
+    unlink(path);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Maps the node-wide ledger, creating it if needed
+ * The mapping is shared, so updates (with `__atomic` builtins) are seen by
+ * every slurmstepd, and by our detached teardown workers.
+ *
+ * @return struct node_ledger* (NULL on failure)
+ */
+static struct node_ledger *map_node_ledger(void) {
+  if (mkdir(node_paths.state, STATE_DIR_MODE) != 0 && errno != EEXIST) {
+    return NULL;
+  }
+
+  int fd = open(node_paths.ledger, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    slurm_error("ramdisk.c: failed to open %s: %s", node_paths.ledger,
+                strerror(errno));
+    return NULL;
+  }
+
+  // extending to the full size is idempotent, and zero fills a new ledger
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 ||
+      (sb.st_size < (off_t)sizeof(struct node_ledger) &&
+       ftruncate(fd, sizeof(struct node_ledger)) != 0)) {
+    close(fd);
+    return NULL;
+  }
+
+  struct node_ledger *ledger = mmap(NULL, sizeof(*ledger),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ledger == MAP_FAILED) {
+    slurm_error("ramdisk.c: failed to map %s: %s", node_paths.ledger,
+                strerror(errno));
+    return NULL;
+  }
+
+  uint64_t empty = 0;
+  __atomic_compare_exchange_n(&ledger->magic, &empty, NODE_LEDGER_MAGIC, 0,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return ledger;
+}
+
+/**
+ * @brief Waits for detached RAM disks to be freed if we'd otherwise not fit
+ * While the ledger shows memory still being reclaimed, requires the node to
+ * have `size` megabytes available, waiting up to `RECLAIM_WAIT_SECONDS`.
+ *
+ * Returns failure if the memory isn't freed in time.
+ *
+ * @param size the RAM disk size in megabytes
+ * @return int
+ */
+static int wait_for_reclaim(uint64_t size) {
+  struct node_ledger *ledger = map_node_ledger();
+  if (ledger == NULL) {
+    // nothing we can check against - don't block the job
+    return EXIT_SUCCESS;
+  }
+
+  int rc = EXIT_FAILURE;
+  uint64_t reclaiming = 0;
+  uint64_t available = 0;
+  for (int waited = 0; waited <= RECLAIM_WAIT_SECONDS; waited++) {
+    reclaiming = __atomic_load_n(&ledger->reclaiming, __ATOMIC_SEQ_CST);
+    if (reclaiming == 0 ||
+        (read_meminfo("MemAvailable", &available) == EXIT_SUCCESS &&
+         available / 1024 >= size)) {
+      rc = EXIT_SUCCESS;
+      break;
+    }
+    if (waited == 0) {
+      slurm_info("ramdisk.c: waiting for %" PRIu64 "M of earlier ramdisks to "
+                 "be freed",
+                 reclaiming);
+    }
+    sleep(1);
+  }
+  munmap(ledger, sizeof(*ledger));
+
+  if (rc != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: cannot create ramdisk of size %" PRIu64
+                "M, only %" PRIu64 "M available while %" PRIu64
+                "M is still being freed",
+                size, available / 1024, reclaiming);
+  }
+  return rc;
+}
+
+/**
+ * @brief Reserves RAM disk memory within the node's cap
+ * Memory still being reclaimed counts against the cap too, as it isn't
+ * charged to any live job. Reserves without a limit when `node_max` isn't
+ * set, keeping the count for when it is. Lock-free, as a compare and swap on
+ * the shared ledger.
+ *
+ * Returns failure if the reservation would exceed the cap.
+ *
+ * @param size the memory to reserve in megabytes
+ * @param reserved where we store what was reserved already, in megabytes
+ * @param cap where we store the cap in megabytes (`UINT64_MAX` if uncapped)
+ * @return int
+ */
+static int reserve_node_memory(uint64_t size, uint64_t *reserved,
+                               uint64_t *cap) {
+  *reserved = 0;
+  *cap = node_max > 0 ? node_max : UINT64_MAX;
+  uint64_t total;
+  if (node_max_percent > 0 &&
+      read_meminfo("MemTotal", &total) == EXIT_SUCCESS) {
+    *cap = total / 1024 * node_max_percent / 100;
+  }
+
+  struct node_ledger *ledger = map_node_ledger();
+  if (ledger == NULL) {
+    // nothing we can count against - don't block the job
+    return EXIT_SUCCESS;
+  }
+
+  int rc = EXIT_SUCCESS;
+  uint64_t current = __atomic_load_n(&ledger->reserved, __ATOMIC_SEQ_CST);
+  do {
+    *reserved =
+        current + __atomic_load_n(&ledger->reclaiming, __ATOMIC_SEQ_CST);
+    if (*cap != UINT64_MAX && *reserved + size > *cap) {
+      rc = EXIT_FAILURE;
+      break;
+    }
+  } while (!__atomic_compare_exchange_n(&ledger->reserved, &current,
+                                        current + size, 0, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST));
+  munmap(ledger, sizeof(*ledger));
+  return rc;
+}
+
+/**
+ * @brief Releases RAM disk memory reserved from the node
+ * Never drops the count below zero, which it could after slurmd has
+ * reconciled it under a running step.
+ *
+ * @param size the memory to release in megabytes
+ */
+static void release_node_memory(uint64_t size) {
+  struct node_ledger *ledger = map_node_ledger();
+  if (ledger == NULL) {
+    return;
+  }
+
+  uint64_t current = __atomic_load_n(&ledger->reserved, __ATOMIC_SEQ_CST);
+  while (!__atomic_compare_exchange_n(&ledger->reserved, &current,
+                                      current > size ? current - size : 0, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+  }
+  munmap(ledger, sizeof(*ledger));
+}
+
+/**
+ * @brief Recounts the node ledger's reserved memory from the mounted RAM disks
+ * Reads the mounts of every mount namespace on the node (so private RAM disks
+ * are found through their namespace's processes), counting each RAM disk mount
+ * directly under a root once - tmpfs by its size, and zram devices by
+ * their memory limit - along with each entry of the dataset cache.
+ *
+ * Returns failure if the ledger or processes can't be read.
+ *
+ * @return int
+ */
+static int reconcile_node_ledger(void) {
+  DIR *proc = opendir(PROC_ROOT);
+  ino_t *namespaces = calloc(RECONCILE_MAX_MOUNTS, sizeof(*namespaces));
+  dev_t *devices = calloc(RECONCILE_MAX_MOUNTS, sizeof(*devices));
+  struct node_ledger *ledger = map_node_ledger();
+  if (proc == NULL || namespaces == NULL || devices == NULL ||
+      ledger == NULL) {
+    slurm_error("ramdisk.c: unable to reconcile the node ledger");
+    if (proc != NULL) {
+      closedir(proc);
+    }
+    free(namespaces);
+    free(devices);
+    if (ledger != NULL) {
+      munmap(ledger, sizeof(*ledger));
+    }
+    return EXIT_FAILURE;
+  }
+
+  int n_namespaces = 0;
+  int n_devices = 0;
+  uint64_t total = 0;
+  struct dirent *entry;
+  while ((entry = readdir(proc)) != NULL &&
+         n_namespaces < RECONCILE_MAX_MOUNTS) {
+    char *end;
+    pid_t pid = (pid_t)strtol(entry->d_name, &end, 10);
+    char path[PATH_MAX];
+    struct stat sb;
+    snprintf(path, sizeof(path), NAMESPACE_MOUNTS, (int)pid);
+    if (*end != '\0' || pid <= 0 || stat(path, &sb) != 0) {
+      continue;
+    }
+    int seen = 0;
+    for (int i = 0; i < n_namespaces && !seen; i++) {
+      seen = namespaces[i] == sb.st_ino;
+    }
+    if (seen) {
+      continue;
+    }
+    namespaces[n_namespaces++] = sb.st_ino;
+
+    snprintf(path, sizeof(path), PROC_ROOT "/%d/mountinfo", (int)pid);
+    FILE *file = fopen(path, "r");
+    char line[PATH_MAX];
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+      // `ID PARENT MAJOR:MINOR ROOT MOUNTPOINT ... - TYPE SOURCE OPTIONS`
+      unsigned int major_id;
+      unsigned int minor_id;
+      char mountpoint[PATH_MAX];
+      char type[FS_TYPE_LEN];
+      char source[PATH_MAX];
+      char *separator = strstr(line, " - ");
+      if (separator == NULL ||
+          sscanf(line, "%*s %*s %u:%u %*s %4095s", &major_id, &minor_id,
+                 mountpoint) != 3 ||
+          sscanf(separator, " - %15s %4095s", type, source) != 2) {
+        continue;
+      }
+
+      const char *name = get_root_name(mountpoint);
+      size_t length = strlen(node_paths.cache);
+      int cached = strncmp(mountpoint, node_paths.cache, length) == 0 &&
+                   mountpoint[length] == '/' &&
+                   strchr(mountpoint + length + 1, '/') == NULL &&
+                   strcmp(type, MOUNT_TYPE_TEMP) == 0;
+      if (!cached &&
+          (name == NULL || name[0] == '.' ||
+           (strcmp(type, MOUNT_TYPE_TEMP) != 0 &&
+            strncmp(source, ZRAM_DEVICE, strlen(ZRAM_DEVICE)) != 0))) {
+        continue;
+      }
+      dev_t device = makedev(major_id, minor_id);
+      seen = 0;
+      for (int i = 0; i < n_devices && !seen; i++) {
+        seen = devices[i] == device;
+      }
+      if (seen || n_devices >= RECONCILE_MAX_MOUNTS) {
+        continue;
+      }
+      devices[n_devices++] = device;
+      total += get_mount_size(pid, mountpoint);
+    }
+    if (file != NULL) {
+      fclose(file);
+    }
+  }
+  closedir(proc);
+  free(namespaces);
+  free(devices);
+
+  uint64_t previous =
+      __atomic_exchange_n(&ledger->reserved, total, __ATOMIC_SEQ_CST);
+  munmap(ledger, sizeof(*ledger));
+  slurm_info("ramdisk.c: %d ramdisks and cached datasets on the node hold "
+             "%" PRIu64 "M (ledger had %" PRIu64 "M)",
+             n_devices, total, previous);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Gets the memory a mounted RAM disk may use
+ *
+ * @param pid a process in the mount namespace holding the RAM disk
+ * @param mountpoint the RAM disk's path within that namespace
+ * @return uint64_t the size in megabytes (0 if unknown)
+ */
+static uint64_t get_mount_size(pid_t pid, const char *mountpoint) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), NAMESPACE_ROOT, (int)pid, mountpoint);
+
+  char device[DEVICE_NAME_LEN];
+  uint64_t limit;
+  struct statfs sf;
+  if (get_ramdisk_device(path, device) == EXIT_SUCCESS &&
+      read_zram_stat(device, ZRAM_MEM_LIMIT, &limit) == EXIT_SUCCESS) {
+    return limit >> 20;
+  }
+  if (statfs(path, &sf) == 0) {
+    return (uint64_t)sf.f_blocks * sf.f_bsize >> 20;
+  }
+  return 0;
+}
+
+/**
+ * @brief Gets a mount's name, if it's directly under a root of RAM disks
+ * Partitions may mount RAM disks under their own roots (which may nest).
+ *
+ * @param mountpoint the mount's path
+ * @return const char* the name (within `mountpoint`), or NULL if it isn't
+ * directly under any root
+ */
+static const char *get_root_name(const char *mountpoint) {
+  for (int i = 0; i < n_configs; i++) {
+    size_t length = strlen(configs[i].root);
+    if (strncmp(mountpoint, configs[i].root, length) != 0 ||
+        mountpoint[length] != '/') {
+      continue;
+    }
+    const char *name = mountpoint + length + 1;
+    if (name[0] != '\0' && strchr(name, '/') == NULL) {
+      return name;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Starts the background sweep for orphaned RAM disks
+ *
+ * @return int
+ */
+static int start_reaper(void) {
+  reaper.running = 1;
+  if (pthread_create(&reaper.thread, NULL, reaper_loop, NULL) != 0) {
+    reaper.running = 0;
+    slurm_error("ramdisk.c: unable to start the orphaned ramdisk reaper");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Stops the background sweep, waiting for any sweep in progress
+ */
+static void stop_reaper(void) {
+  pthread_mutex_lock(&reaper.lock);
+  int running = reaper.running;
+  reaper.running = 0;
+  pthread_cond_signal(&reaper.wake);
+  pthread_mutex_unlock(&reaper.lock);
+
+  if (running) {
+    pthread_join(reaper.thread, NULL);
+  }
+}
+
+/**
+ * @brief Reaper thread, sweeping every `REAP_INTERVAL_SECONDS` until stopped
+ *
+ * @param arg unused
+ * @return void*
+ */
+static void *reaper_loop(void *arg) {
+  pthread_mutex_lock(&reaper.lock);
+  while (reaper.running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REAP_INTERVAL_SECONDS;
+    pthread_cond_timedwait(&reaper.wake, &reaper.lock, &deadline);
+    if (!reaper.running) {
+      break;
+    }
+
+    pthread_mutex_unlock(&reaper.lock);
+    reap_orphans();
+    pthread_mutex_lock(&reaper.lock);
+  }
+  pthread_mutex_unlock(&reaper.lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Tears down RAM disks whose step is no longer running on the node
+ * RAM disks are found in slurmd's mounts (private ones die with their
+ * namespace), named as `get_ramdisk_directory` does. A step scoped RAM disk is
+ * orphaned once its step's slurmstepd is gone, and a job scoped one once
+ * every slurmstepd of its job is. Orphans still in use by some process are
+ * left, as are all RAM disks if a slurmstepd can't be identified. With nothing
+ * left behind, the state of jobs that have left the node is removed too.
+ *
+ * @return int the number of RAM disks reaped
+ */
+static int reap_orphans(void) {
+  char(*steps)[STEP_NAME_LEN] = calloc(REAP_MAX_STEPS, sizeof(*steps));
+  char(*orphans)[DIRECTORY_PATH_LEN] =
+      calloc(REAP_MAX_STEPS, sizeof(*orphans));
+  int n_steps = steps != NULL ? get_live_steps(steps, REAP_MAX_STEPS) : -1;
+  FILE *file = fopen(MOUNTINFO_SELF, "r");
+  if (n_steps < 0 || orphans == NULL || file == NULL) {
+    slurm_verbose("ramdisk.c: unable to look for orphaned ramdisks");
+    if (file != NULL) {
+      fclose(file);
+    }
+    free(steps);
+    free(orphans);
+    return 0;
+  }
+
+  // gather first, as unmounting changes the mount table we're reading
+  int n_orphans = 0;
+  char line[PATH_MAX];
+  while (fgets(line, sizeof(line), file) != NULL &&
+         n_orphans < REAP_MAX_STEPS) {
+    char mountpoint[PATH_MAX];
+    const char *root_name;
+    if (sscanf(line, "%*s %*s %*s %*s %4095s", mountpoint) != 1 ||
+        (root_name = get_root_name(mountpoint)) == NULL) {
+      continue;
+    }
+
+    // `<job>.<step>[.numaN].ramdisk` or `<job>.job.ramdisk`
+    char name[DIRECTORY_PATH_LEN];
+    snprintf(name, sizeof(name), "%s", root_name);
+    size_t length = strlen(name);
+    size_t suffix = strlen(RAMDISK_SUFFIX);
+    if (name[0] < '0' || name[0] > '9' || length <= suffix ||
+        strcmp(name + length - suffix, RAMDISK_SUFFIX) != 0) {
+      continue;
+    }
+    name[length - suffix] = '\0';
+    char *numa = strstr(name, NUMA_INFIX);
+    if (numa != NULL) {
+      *numa = '\0';
+    }
+    if (is_live(name, steps, n_steps)) {
+      continue;
+    }
+
+    // overlays are stacked on the same mount point
+    int seen = 0;
+    for (int i = 0; i < n_orphans && !seen; i++) {
+      seen = strcmp(orphans[i], mountpoint) == 0;
+    }
+    if (!seen && strlen(mountpoint) < DIRECTORY_PATH_LEN) {
+      snprintf(orphans[n_orphans++], DIRECTORY_PATH_LEN, "%s", mountpoint);
+    }
+  }
+  fclose(file);
+
+  int reaped = 0;
+  int skipped = 0;
+  uint64_t freed = 0;
+  for (int i = 0; i < n_orphans; i++) {
+    if (reap_ramdisk(orphans[i], &freed) == EXIT_SUCCESS) {
+      reaped++;
+    } else {
+      skipped++;
+    }
+  }
+  if (reaped > 0) {
+    slurm_info("ramdisk.c: reaped %d orphaned ramdisks, freeing %" PRIu64 "M",
+               reaped, freed);
+  }
+
+  if (skipped == 0) {
+    reap_state(steps, n_steps);
+  }
+  free(steps);
+  free(orphans);
+  return reaped;
+}
+
+/**
+ * @brief Tears down an orphaned RAM disk, without staging anything out
+ * Releases any cached dataset and zram device, and the RAM disk's share of
+ * the node ledger.
+ *
+ * Returns failure if a process is still using the RAM disk, or it can't be
+ * unmounted.
+ *
+ * @param directory the RAM disk path
+ * @param freed the memory freed in megabytes, which we add to
+ * @return int
+ */
+static int reap_ramdisk(const char *directory, uint64_t *freed) {
+  // signal 0 only finds them
+  if (kill_holders(directory, 0) > 0) {
+    slurm_info("ramdisk.c: leaving orphaned ramdisk %s, as it's still in use",
+               directory);
+    return EXIT_FAILURE;
+  }
+
+  unmount_submounts(directory);
+  char cache[PATH_MAX];
+  struct stat sb;
+  snprintf(cache, sizeof(cache), "%s/" CACHE_MOUNT_NAME, directory);
+  if (stat(cache, &sb) == 0) {
+    release_cache(directory);
+  }
+  while (is_overlay(directory) && umount2(directory, MNT_DETACH) == 0) {
+  }
+
+  uint64_t size = get_mount_size(getpid(), directory);
+  uint64_t used = 0;
+  struct statfs sf;
+  char device[DEVICE_NAME_LEN] = {0};
+  if (get_ramdisk_device(directory, device) == EXIT_SUCCESS) {
+    read_zram_stat(device, ZRAM_MEM_USED_TOTAL, &used);
+  } else {
+    device[0] = '\0';
+    if (statfs(directory, &sf) == 0) {
+      used = (uint64_t)(sf.f_blocks - sf.f_bfree) * sf.f_bsize;
+    }
+  }
+
+  if (umount(directory) != 0 && umount2(directory, MNT_DETACH) != 0) {
+    slurm_error("ramdisk.c: failed to unmount orphaned ramdisk %s: %s",
+                directory, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (device[0] != '\0') {
+    release_zram(device);
+  }
+  if (rmdir(directory) != 0) {
+    slurm_verbose("ramdisk.c: failed to delete %s", directory);
+  }
+  release_node_memory(size);
+
+  slurm_info("ramdisk.c: reaped orphaned ramdisk %s, freeing %" PRIu64 "M",
+             directory, used >> 20);
+  *freed += used >> 20;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Removes the state of jobs no longer running on the node
+ * Clears the per-job lock, job scoped holders and stage-out, and ledger
+ * (`<job>.*` in the state directory), for jobs without a live slurmstepd.
+ *
+ * @param steps the live steps
+ * @param n_steps the number of live steps
+ */
+static void reap_state(char (*steps)[STEP_NAME_LEN], int n_steps) {
+  DIR *dir = opendir(node_paths.state);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char job[STEP_NAME_LEN];
+    char *end;
+    strtoul(entry->d_name, &end, 10);
+    if (end == entry->d_name || *end != '.' ||
+        snprintf(job, sizeof(job), "%.*s." JOB_SCOPE_STEP,
+                 (int)(end - entry->d_name),
+                 entry->d_name) >= (int)sizeof(job) ||
+        is_live(job, steps, n_steps)) {
+      continue;
+    }
+
+    // holders and ledgers are directories of plain files
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", node_paths.state, entry->d_name);
+    DIR *state = opendir(path);
+    struct dirent *item;
+    while (state != NULL && (item = readdir(state)) != NULL) {
+      char *file = item->d_name[0] != '.' ? join_path(path, item->d_name)
+                                          : NULL;
+      if (file != NULL) {
+        unlink(file);
+        free(file);
+      }
+    }
+    if (state != NULL) {
+      closedir(state);
+      rmdir(path);
+    } else {
+      unlink(path);
+    }
+    slurm_verbose("ramdisk.c: removed state %s of a finished job", path);
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Lists the steps with a slurmstepd on the node
+ * Reads each slurmstepd's process title, `slurmstepd: [<job>.<step>]`.
+ *
+ * Returns -1 if there's a slurmstepd we can't identify, so nothing is reaped
+ * from under it.
+ *
+ * @param steps the array we write the step names (as `get_step_name`) into
+ * @param max the size of `steps`
+ * @return int the number of steps, or -1
+ */
+static int get_live_steps(char (*steps)[STEP_NAME_LEN], int max) {
+  DIR *proc = opendir(PROC_ROOT);
+  if (proc == NULL) {
+    return -1;
+  }
+
+  int n_steps = 0;
+  struct dirent *entry;
+  while ((entry = readdir(proc)) != NULL) {
+    char *end;
+    long pid = strtol(entry->d_name, &end, 10);
+    char path[PATH_MAX];
+    char comm[64];
+    snprintf(path, sizeof(path), PROC_ROOT "/%ld/comm", pid);
+    if (*end != '\0' || pid <= 0 ||
+        read_file(path, comm, sizeof(comm)) != EXIT_SUCCESS ||
+        strcmp(comm, "slurmstepd") != 0) {
+      continue;
+    }
+
+    // the title overwrites the arguments, so read it as a single string
+    char title[STEP_NAME_LEN + sizeof(STEPD_TITLE)] = {0};
+    snprintf(path, sizeof(path), PROC_ROOT "/%ld/cmdline", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t length = fd >= 0 ? read(fd, title, sizeof(title) - 1) : -1;
+    if (fd >= 0) {
+      close(fd);
+    }
+    char *name = title + strlen(STEPD_TITLE);
+    char *close_bracket = strchr(title, ']');
+    if (length <= 0 || strncmp(title, STEPD_TITLE, strlen(STEPD_TITLE)) != 0 ||
+        close_bracket == NULL) {
+      // a stepd that's exited leaves its cmdline empty
+      if (length == 0) {
+        continue;
+      }
+      slurm_verbose("ramdisk.c: unable to identify slurmstepd %ld", pid);
+      closedir(proc);
+      return -1;
+    }
+    *close_bracket = '\0';
+    if (n_steps < max) {
+      snprintf(steps[n_steps++], STEP_NAME_LEN, "%s", name);
+    }
+  }
+  closedir(proc);
+  return n_steps;
+}
+
+/**
+ * @brief Checks whether a RAM disk's step (or job) is still running
+ *
+ * @param name the step (`<job>.<step>`), or job (`<job>.job`)
+ * @param steps the live steps
+ * @param n_steps the number of live steps
+ * @return int non-zero if it is
+ */
+static int is_live(const char *name, char (*steps)[STEP_NAME_LEN],
+                   int n_steps) {
+  const char *step = strchr(name, '.');
+  if (step == NULL) {
+    return 0;
+  }
+  size_t job_length = (size_t)(step - name) + 1;
+  int job_scope = strcmp(step + 1, JOB_SCOPE_STEP) == 0;
+  for (int i = 0; i < n_steps; i++) {
+    if (job_scope ? strncmp(steps[i], name, job_length) == 0
+                  : strcmp(steps[i], name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Detaches a RAM disk, leaving a background worker to free it
+ * Forks a detached worker (outside the job's cgroup) that holds the mount open
+ * while we lazily unmount and remove the directory. Freeing the pages happens
+ * when the worker drops the last reference (and frees any zram device), after
+ * which it releases the memory from the node ledger's `reclaiming` count.
+ *
+ * Returns failure (without having detached) if the worker can't be started.
+ *
+ * @param directory the RAM disk path
+ * @param device the backing zram device, or empty for tmpfs
+ * @return int
+ */
+static int detach_ramdisk(const char *directory, const char *device) {
+  struct statfs fs;
+  if (statfs(directory, &fs) != 0) {
+    return EXIT_FAILURE;
+  }
+  uint64_t used = ((fs.f_blocks - fs.f_bfree) * fs.f_bsize) >> 20;
+  uint64_t compressed;
+  if (device[0] != '\0' &&
+      read_zram_stat(device, ZRAM_MEM_USED_TOTAL, &compressed) ==
+          EXIT_SUCCESS) {
+    used = compressed >> 20;
+  }
+
+  struct node_ledger *ledger = map_node_ledger();
+  if (ledger == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  // `ready` tells us the worker holds the mount, closing `detached` tells the
+  // worker we've detached it
+  int ready[2];
+  int detached[2];
+  if (pipe2(ready, O_CLOEXEC) != 0) {
+    munmap(ledger, sizeof(*ledger));
+    return EXIT_FAILURE;
+  }
+  if (pipe2(detached, O_CLOEXEC) != 0) {
+    close(ready[0]);
+    close(ready[1]);
+    munmap(ledger, sizeof(*ledger));
+    return EXIT_FAILURE;
+  }
+
+  __atomic_add_fetch(&ledger->reclaiming, used, __ATOMIC_SEQ_CST);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // double fork, so slurmstepd doesn't need to reap the worker
+    setsid();
+    pid_t worker = fork();
+    if (worker != 0) {
+      if (worker < 0) {
+        __atomic_sub_fetch(&ledger->reclaiming, used, __ATOMIC_SEQ_CST);
+      }
+      _exit(EXIT_SUCCESS);
+    }
+    close(ready[0]);
+    close(detached[1]);
+    leave_job_cgroup();
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char byte = fd >= 0;
+    if (write(ready[1], &byte, 1) != 1 || fd < 0) {
+      __atomic_sub_fetch(&ledger->reclaiming, used, __ATOMIC_SEQ_CST);
+      _exit(EXIT_FAILURE);
+    }
+    close(ready[1]);
+
+    // wait for the detach, then drop the last reference - the kernel frees the
+    // tmpfs in our context rather than slurmstepd's
+    while (read(detached[0], &byte, 1) < 0 && errno == EINTR) {
+    }
+    close(fd);
+    if (device[0] != '\0') {
+      release_zram(device);
+    }
+    __atomic_sub_fetch(&ledger->reclaiming, used, __ATOMIC_SEQ_CST);
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(ready[1]);
+  close(detached[0]);
+  int rc = EXIT_FAILURE;
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+
+    struct pollfd poll_fd = {.fd = ready[0], .events = POLLIN};
+    char byte = 0;
+    if (poll(&poll_fd, 1, RECLAIM_READY_TIMEOUT_MS) == 1 &&
+        read(ready[0], &byte, 1) == 1 && byte == 1) {
+      if (umount2(directory, MNT_DETACH) == 0) {
+        rc = EXIT_SUCCESS;
+        if (rmdir(directory) != 0) {
+          slurm_error("ramdisk.c: failed to delete tmpfs directory");
+        }
+        slurm_info("ramdisk.c: detached %s, freeing %" PRIu64
+                   "M in the background",
+                   directory, used);
+      } else {
+        slurm_error("ramdisk.c: failed to detach %s: %s", directory,
+                    strerror(errno));
+      }
+    }
+  } else {
+    __atomic_sub_fetch(&ledger->reclaiming, used, __ATOMIC_SEQ_CST);
+  }
+
+  // releases the worker either way - if we failed to detach, its reference is
+  // simply dropped and we fall back to a normal unmount
+  close(ready[0]);
+  close(detached[1]);
+  munmap(ledger, sizeof(*ledger));
+  return rc;
+}
+
+/**
+ * @brief Moves the calling process into the root cgroup(s)
+ * Lets teardown workers outlive the job's cgroup, which Slurm removes once the
+ * step completes. Best effort - on failure we simply stay in the job.
+ */
+static void leave_job_cgroup(void) {
+  char path[PATH_MAX];
+  struct stat sb;
+
+  // unified hierarchy (v2)
+  if (stat(CGROUP_ROOT "/cgroup.procs", &sb) == 0) {
+    int fd = open(CGROUP_ROOT "/cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      if (write(fd, "0", 1) != 1) {
+        slurm_debug("ramdisk.c: unable to leave the job cgroup");
+      }
+      close(fd);
+    }
+    return;
+  }
+
+  // v1 - every controller hierarchy
+  DIR *dir = opendir(CGROUP_ROOT);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), CGROUP_ROOT "/%s/cgroup.procs",
+             entry->d_name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      if (write(fd, "0", 1) != 1) {
+        slurm_debug("ramdisk.c: unable to leave the %s cgroup", entry->d_name);
+      }
+      close(fd);
+    }
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Reads a value (in kilobytes) from `/proc/meminfo`
+ *
+ * @param key the field name (e.g. `MemAvailable`)
+ * @param value where we store the value
+ * @return int
+ */
+static int read_meminfo(const char *key, uint64_t *value) {
+  FILE *file = fopen(MEMINFO_PATH, "r");
+  if (file == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  int rc = EXIT_FAILURE;
+  char line[256];
+  size_t length = strlen(key);
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, key, length) == 0 && line[length] == ':') {
+      rc = sscanf(line + length + 1, "%" SCNu64, value) == 1 ? EXIT_SUCCESS
+                                                            : EXIT_FAILURE;
+      break;
+    }
+  }
+
+  fclose(file);
+  return rc;
+}
+
+/**
+ * @brief Unmounts a RAM disk, recovering from stragglers before draining
+ * If the mount is busy, kills the processes still using it (`SIGTERM`, then
+ * `SIGKILL`) and retries with exponential backoff. If it's still busy, lazily
+ * detaches it - the memory is freed once the last user goes. Only if even that
+ * fails is the node drained.
+ *
+ * Returns failure if the RAM disk is still mounted.
+ *
+ * @param sp the spank instance
+ * @param directory the RAM disk path
+ * @return int
+ */
+static int unmount_ramdisk(spank_t sp, const char *directory) {
+  if (umount(directory) == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  int backoff = UNMOUNT_BACKOFF_MS;
+  for (int attempt = 0; attempt < UNMOUNT_RETRIES && errno == EBUSY;
+       attempt++) {
+    int killed = kill_holders(directory, attempt == 0 ? SIGTERM : SIGKILL);
+    slurm_info("ramdisk.c: %s busy, signalled %d process(es), retrying in "
+               "%dms",
+               directory, killed, backoff);
+
+    struct timespec delay = {.tv_sec = backoff / 1000,
+                             .tv_nsec = (backoff % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+    backoff *= 2;
+
+    if (umount(directory) == 0) {
+      return EXIT_SUCCESS;
+    }
+  }
+
+  slurm_error("ramdisk.c: failed to unmount %s (%s), detaching it", directory,
+              strerror(errno));
+  if (umount2(directory, MNT_DETACH) == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  slurm_error("ramdisk.c: failed to detach %s (%s), draining node", directory,
+              strerror(errno));
+  drain_node(sp, "failed to unmount ramdisk");
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief Signals every process using a path within a directory
+ * Scans each process' working directory, root, open files, and mapped files.
+ * We never signal ourselves.
+ *
+ * @param directory the directory (mount point) being released
+ * @param signal the signal to send
+ * @return int the number of processes signalled
+ */
+static int kill_holders(const char *directory, int signal) {
+  DIR *proc = opendir(PROC_ROOT);
+  if (proc == NULL) {
+    return 0;
+  }
+
+  int killed = 0;
+  pid_t self = getpid();
+  struct dirent *entry;
+  while ((entry = readdir(proc)) != NULL) {
+    char *end;
+    long pid = strtol(entry->d_name, &end, 10);
+    if (*end != '\0' || pid <= 0 || pid == self) {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    int holds = 0;
+
+    // working directory and root
+    const char *links[] = {"cwd", "root"};
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]) && !holds; i++) {
+      snprintf(path, sizeof(path), PROC_ROOT "/%ld/%s", pid, links[i]);
+      ssize_t n = readlink(path, target, sizeof(target) - 1);
+      if (n > 0) {
+        target[n] = '\0';
+        holds = path_within(target, directory);
+      }
+    }
+
+    // open files
+    snprintf(path, sizeof(path), PROC_ROOT "/%ld/fd", pid);
+    DIR *fds = holds ? NULL : opendir(path);
+    if (fds != NULL) {
+      struct dirent *fd;
+      while (!holds && (fd = readdir(fds)) != NULL) {
+        snprintf(path, sizeof(path), PROC_ROOT "/%ld/fd/%s", pid, fd->d_name);
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        if (n > 0) {
+          target[n] = '\0';
+          holds = path_within(target, directory);
+        }
+      }
+      closedir(fds);
+    }
+
+    // mapped files - the path is the last field, if any
+    snprintf(path, sizeof(path), PROC_ROOT "/%ld/maps", pid);
+    FILE *maps = holds ? NULL : fopen(path, "r");
+    if (maps != NULL) {
+      char line[PATH_MAX + 128];
+      while (!holds && fgets(line, sizeof(line), maps) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *mapped = strchr(line, '/');
+        holds = mapped != NULL && path_within(mapped, directory);
+      }
+      fclose(maps);
+    }
+
+    if (holds) {
+      char comm[64] = "?";
+      snprintf(path, sizeof(path), PROC_ROOT "/%ld/comm", pid);
+      read_file(path, comm, sizeof(comm));
+      slurm_info("ramdisk.c: process %ld (%s) is using %s", pid, comm,
+                 directory);
+      if (kill(pid, signal) == 0) {
+        killed++;
+      }
+    }
+  }
+
+  closedir(proc);
+  return killed;
+}
+
+/**
+ * @brief Checks whether a path is a directory or within it
+ *
+ * @param path the path to check
+ * @param directory the directory
+ * @return int non-zero if `path` is `directory` or beneath it
+ */
+static int path_within(const char *path, const char *directory) {
+  size_t length = strlen(directory);
+  return strncmp(path, directory, length) == 0 &&
+         (path[length] == '\0' || path[length] == '/' ||
+          strcmp(path + length, " (deleted)") == 0);
+}
+
+/**
+ * @brief Drains this node through the Slurm API
+ * The node name comes from the job's `SLURMD_NODENAME`, falling back to the
+ * short hostname.
+ *
+ * @param sp the spank instance
+ * @param reason the drain reason
+ * @return int
+ */
+static int drain_node(spank_t sp, const char *reason) {
+  char node[NODE_NAME_LEN];
+  if (spank_getenv(sp, "SLURMD_NODENAME", node, sizeof(node)) !=
+      ESPANK_SUCCESS) {
+    if (gethostname(node, sizeof(node)) != 0) {
+      slurm_error("ramdisk.c: unable to determine node name to drain");
+      return EXIT_FAILURE;
+    }
+    node[sizeof(node) - 1] = '\0';
+    node[strcspn(node, ".")] = '\0';
+  }
+
+  update_node_msg_t update;
+  slurm_init_update_node_msg(&update);
+  update.node_names = node;
+  update.node_state = NODE_STATE_DRAIN;
+  update.reason = (char *)reason;
+  update.reason_uid = getuid();
+
+  if (slurm_update_node(&update) != SLURM_SUCCESS) {
+    slurm_error("ramdisk.c: failed to drain %s: %s", node,
+                slurm_strerror(slurm_get_errno()));
+    return EXIT_FAILURE;
+  }
+
+  slurm_error("ramdisk.c: drained %s - %s", node, reason);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Current monotonic time in nanoseconds
+ *
+ * @return uint64_t
+ */
+static uint64_t timing_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Adds the time since `start` to a phase
+ *
+ * @param phase the phase
+ * @param start the `timing_now()` the phase started at
+ */
+static void timing_add(enum timing_phase phase, uint64_t start) {
+  timings[phase] += timing_now() - start;
+}
+
+/**
+ * @brief Logs the step's hook timings, optionally appending them as JSON
+ * Emits a single `key=value` line (in microseconds) for the step, and, if
+ * built with `TIMING_LOG_PATH`, a JSON object on its own line in that file.
+ *
+ * @param sp the spank instance
+ */
+static void report_timings(spank_t sp) {
+  char name[STEP_NAME_LEN];
+  if (get_step_name(sp, name) != EXIT_SUCCESS) {
+    return;
+  }
+
+  char text[TIMING_LINE_LEN];
+  char json[TIMING_LINE_LEN];
+  int text_length = snprintf(text, sizeof(text), "step=%s", name);
+  int json_length = snprintf(json, sizeof(json),
+                             "{\"time\":%lld,\"step\":\"%s\",\"size_mb\":%" PRIu64,
+                             (long long)time(NULL), name, ramdisk_size);
+  for (int i = 0; i < TIMING_PHASES; i++) {
+    uint64_t us = timings[i] / 1000;
+    if (text_length < TIMING_LINE_LEN) {
+      text_length += snprintf(text + text_length, TIMING_LINE_LEN - text_length,
+                              " %s_us=%" PRIu64, timing_names[i], us);
+    }
+    if (json_length < TIMING_LINE_LEN) {
+      json_length += snprintf(json + json_length, TIMING_LINE_LEN - json_length,
+                              ",\"%s_us\":%" PRIu64, timing_names[i], us);
+    }
+  }
+  slurm_info("ramdisk.c: timings %s", text);
+
+  if (TIMING_LOG_PATH[0] == '\0' || json_length + 2 >= TIMING_LINE_LEN) {
+    return;
+  }
+  strcpy(json + json_length, "}\n");
+  if (append_line(TIMING_LOG_PATH, json, json_length + 2) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to append timings to %s", TIMING_LOG_PATH);
+  }
+}
+
+/**
+ * @brief Appends a line to a node-local log
+ * Lines are written with a single append, which keeps lines from concurrent
+ * steps whole.
+ *
+ * @param path the file to append to (created if missing)
+ * @param line the line, including its newline
+ * @param length the length of `line`
+ * @return int
+ */
+static int append_line(const char *path, const char *line, int length) {
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return EXIT_FAILURE;
+  }
+
+  int rc = write(fd, line, length) == length ? EXIT_SUCCESS : EXIT_FAILURE;
+  close(fd);
+  return rc;
+}
+
+/**
+ * @brief Starts sampling the step's RAM disk usage in the background
+ * Samples every `USAGE_SAMPLE_SECONDS` until `stop_usage_monitor`. Usage isn't
+ * essential, so failures are only logged.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int start_usage_monitor(spank_t sp) {
+  int n_directories = count_ramdisks();
+  usage.directories = calloc(n_directories, sizeof(*usage.directories));
+  if (usage.directories == NULL) {
+    slurm_verbose("ramdisk.c: unable to monitor ramdisk usage");
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < n_directories; i++) {
+    char directory[DIRECTORY_PATH_LEN];
+    if (get_ramdisk_directory(sp, i, directory) != EXIT_SUCCESS) {
+      free(usage.directories);
+      usage.directories = NULL;
+      return EXIT_FAILURE;
+    }
+    snprintf(usage.directories[i], DIRECTORY_PATH_LEN, "%s", directory);
+  }
+  usage.n_directories = n_directories;
+
+  // shmem is optional - without a memory cgroup we only report the mount
+  if (get_cgroup_path(sp, "memory", usage.cgroup) != EXIT_SUCCESS ||
+      snprintf(usage.memory_stat, sizeof(usage.memory_stat), "%s/%s",
+               usage.cgroup,
+               CGROUP_MEMORY_STAT) >= (int)sizeof(usage.memory_stat)) {
+    usage.cgroup[0] = '\0';
+    usage.memory_stat[0] = '\0';
+  }
+
+  // resizes are checked from the monitor, where the spank handle's gone
+  if (spank_get_item(sp, ramdisk_job_scope ? S_JOB_ALLOC_MEM : S_STEP_ALLOC_MEM,
+                     &usage.allocation) != ESPANK_SUCCESS) {
+    usage.allocation = 0;
+  }
+  // any step may find the job's memory limit reset under its block ramdisks
+  if (get_block_filesystem() != NULL && set_charge(sp) != EXIT_SUCCESS) {
+    charge.state[0] = '\0';
+  }
+  // steps attached to a job scoped ramdisk resize the job's reservation
+  if (ramdisk_job_scope && reservation.entry[0] == '\0' &&
+      set_reservation(sp) != EXIT_SUCCESS) {
+    reservation.entry[0] = '\0';
+  }
+
+  sample_usage();
+
+  usage.running = 1;
+  if (pthread_create(&usage.thread, NULL, usage_monitor, NULL) != 0) {
+    slurm_verbose("ramdisk.c: unable to start the ramdisk usage monitor");
+    usage.running = 0;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Stops the usage monitor, and takes a final sample
+ */
+static void stop_usage_monitor(void) {
+  pthread_mutex_lock(&usage.lock);
+  int running = usage.running;
+  usage.running = 0;
+  pthread_cond_signal(&usage.wake);
+  pthread_mutex_unlock(&usage.lock);
+
+  if (running) {
+    pthread_join(usage.thread, NULL);
+  }
+  sample_usage();
+}
+
+/**
+ * @brief Usage monitor thread, sampling until stopped
+ *
+ * @param arg unused
+ * @return void*
+ */
+static void *usage_monitor(void *arg) {
+  pthread_mutex_lock(&usage.lock);
+  for (int tick = 1; usage.running; tick++) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RESIZE_POLL_SECONDS;
+    pthread_cond_timedwait(&usage.wake, &usage.lock, &deadline);
+    if (!usage.running) {
+      break;
+    }
+
+    pthread_mutex_unlock(&usage.lock);
+    check_resize();
+    release_prefault();
+    check_charge();
+    if (tick % (USAGE_SAMPLE_SECONDS / RESIZE_POLL_SECONDS) == 0) {
+      sample_usage();
+    }
+    pthread_mutex_lock(&usage.lock);
+  }
+  pthread_mutex_unlock(&usage.lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Samples the step's RAM disks, updating the peaks
+ * Bytes and inodes are summed across every RAM disk of the step (i.e. all the
+ * NUMA nodes), and shmem is the cgroup's total (which includes any other
+ * tmpfs or shared memory the step uses). Memory is the same as bytes, other
+ * than for compressed RAM disks, where it's the zram device's memory.
+ */
+static void sample_usage(void) {
+  uint64_t bytes = 0;
+  uint64_t memory = 0;
+  uint64_t inodes = 0;
+  for (int i = 0; i < usage.n_directories; i++) {
+    char path[PATH_MAX];
+    struct statfs sf;
+    get_visible_path(usage.directories[i], path);
+    if (statfs(path, &sf) != 0) {
+      continue;
+    }
+    uint64_t used = (uint64_t)(sf.f_blocks - sf.f_bfree) * sf.f_bsize;
+    bytes += used;
+    inodes += sf.f_files - sf.f_ffree;
+
+    char device[DEVICE_NAME_LEN];
+    uint64_t compressed;
+    if (get_ramdisk_device(path, device) == EXIT_SUCCESS &&
+        read_zram_stat(device, ZRAM_MEM_USED_TOTAL, &compressed) ==
+            EXIT_SUCCESS) {
+      used = compressed;
+    }
+    memory += used;
+  }
+
+  uint64_t shmem = 0;
+  if (usage.memory_stat[0] != '\0' &&
+      read_memory_stat(usage.memory_stat, "shmem", &shmem) != EXIT_SUCCESS) {
+    shmem = 0;
+  }
+
+  if (bytes > usage.peak_bytes) {
+    usage.peak_bytes = bytes;
+  }
+  if (memory > usage.peak_memory) {
+    usage.peak_memory = memory;
+  }
+  if (inodes > usage.peak_inodes) {
+    usage.peak_inodes = inodes;
+  }
+  if (shmem > usage.peak_shmem) {
+    usage.peak_shmem = shmem;
+  }
+}
+
+/**
+ * @brief Reports the step's peak RAM disk usage
+ * Tells the user (on the job's stderr) how much of the RAM disk they used, and
+ * appends a JSON record to the node-local usage log for accounting.
+ *
+ * @param sp the spank instance
+ */
+static void report_usage(spank_t sp) {
+  char name[STEP_NAME_LEN];
+  if (get_step_name(sp, name) != EXIT_SUCCESS) {
+    return;
+  }
+
+  // job scoped steps that attached don't know the size they were given, and
+  // ramdisks may have been resized
+  uint64_t size = ramdisk_size;
+  char path[PATH_MAX];
+  char device[DEVICE_NAME_LEN];
+  get_visible_path(usage.directories[0], path);
+  int compressed = get_ramdisk_device(path, device) == EXIT_SUCCESS;
+  if (usage.peak_size > size) {
+    size = usage.peak_size;
+  } else if (size == 0) {
+    struct statfs sf;
+    uint64_t limit;
+    if (compressed &&
+        read_zram_stat(device, ZRAM_MEM_LIMIT, &limit) == EXIT_SUCCESS) {
+      size = limit / (1024 * 1024);
+    } else if (statfs(path, &sf) == 0) {
+      size = (uint64_t)sf.f_blocks * sf.f_bsize / (1024 * 1024) *
+             usage.n_directories;
+    }
+  }
+
+  uint64_t peak_mb = (usage.peak_memory + 1024 * 1024 - 1) / (1024 * 1024);
+  char uncompressed[64] = {0};
+  if (compressed) {
+    snprintf(uncompressed, sizeof(uncompressed), " (%" PRIu64
+             "M uncompressed)",
+             (usage.peak_bytes + 1024 * 1024 - 1) / (1024 * 1024));
+  }
+  slurm_spank_log("ramdisk.c: step %s peak ramdisk usage %" PRIu64
+                  "M%s of %" PRIu64 "M (%" PRIu64 "%%), %" PRIu64 " inodes",
+                  name, peak_mb, uncompressed, size,
+                  size > 0 ? peak_mb * 100 / size : 0, usage.peak_inodes);
+
+  uint32_t uid = 0;
+  if (spank_get_item(sp, S_JOB_UID, &uid) != ESPANK_SUCCESS) {
+    slurm_verbose("ramdisk.c: failed to get job UID");
+  }
+
+  char record[USAGE_LINE_LEN];
+  int length = snprintf(
+      record, sizeof(record),
+      "{\"time\":%lld,\"step\":\"%s\",\"uid\":%" PRIu32
+      ",\"size_mb\":%" PRIu64 ",\"ramdisks\":%d,\"peak_bytes\":%" PRIu64
+      ",\"peak_memory_bytes\":%" PRIu64 ",\"peak_inodes\":%" PRIu64
+      ",\"peak_shmem_bytes\":%" PRIu64 "}\n",
+      (long long)time(NULL), name, uid, size, usage.n_directories,
+      usage.peak_bytes, usage.peak_memory, usage.peak_inodes,
+      usage.peak_shmem);
+  if (length >= (int)sizeof(record) ||
+      (mkdir(node_paths.state, STATE_DIR_MODE) != 0 && errno != EEXIST) ||
+      append_line(node_paths.usage_log, record, length) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to record ramdisk usage in %s",
+                node_paths.usage_log);
+  }
+}
+
+/**
+ * @brief Gets the path we (slurmstepd) can reach a RAM disk through
+ * Private RAM disks are only mounted in the step's namespace, so are reached
+ * through its holder.
+ *
+ * @param directory the RAM disk path
+ * @param path the char array (of `PATH_MAX`) we write the path into
+ */
+static void get_visible_path(const char *directory, char path[]) {
+  if (namespace_holder > 0) {
+    snprintf(path, PATH_MAX, NAMESPACE_ROOT, namespace_holder, directory);
+  } else {
+    snprintf(path, PATH_MAX, "%s", directory);
+  }
+}
+
+/**
+ * @brief Resizes the step's RAM disks as requested by the job, or for
+ * `--ramdisk-autogrow`
+ * The job writes a size (e.g. `8G`) to `RESIZE_FILE_NAME` in a RAM disk. The
+ * RAM disks' total must stay within the step's (or job's, for job scoped RAM
+ * disks) allocation and the partition's `max_size`, and any growth within
+ * what's left of its memory cgroup's limit. Only plain tmpfs RAM disks can be
+ * resized.
+ */
+static void check_resize(void) {
+  uint64_t sizes[NUMA_MAX_NODES];
+  uint64_t total = 0;
+  for (int i = 0; i < usage.n_directories; i++) {
+    char path[PATH_MAX];
+    struct statfs sf;
+    get_visible_path(usage.directories[i], path);
+    sizes[i] = statfs(path, &sf) == 0 && sf.f_type == TMPFS_MAGIC
+                   ? (uint64_t)sf.f_blocks * sf.f_bsize >> 20
+                   : 0;
+    total += sizes[i];
+  }
+
+  for (int i = 0; i < usage.n_directories; i++) {
+    char path[PATH_MAX];
+    char control[PATH_MAX];
+    get_visible_path(usage.directories[i], path);
+    snprintf(control, sizeof(control), "%s/" RESIZE_FILE_NAME, path);
+
+    uint64_t size = 0;
+    int fd = read_resize_request(control, &size);
+    if (fd < 0 && ramdisk_autogrow > 0 && sizes[i] > 0) {
+      // grow once nearly full, up to an equal share of the limit, by at least
+      // a quarter of the requested size
+      struct statfs sf;
+      uint64_t limit = ramdisk_autogrow / usage.n_directories;
+      uint64_t base = ramdisk_size / usage.n_directories;
+      uint64_t step =
+          (sizes[i] > base ? sizes[i] : base) * AUTOGROW_STEP_PERCENT / 100 + 1;
+      if (statfs(path, &sf) == 0 &&
+          ((uint64_t)sf.f_bavail * sf.f_bsize >> 20) * 100 <
+              sizes[i] * AUTOGROW_FREE_PERCENT &&
+          sizes[i] < limit) {
+        size = sizes[i] + step < limit ? sizes[i] + step : limit;
+      }
+    }
+    if (size == 0 || (size == sizes[i] && fd < 0)) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      continue;
+    }
+
+    uint64_t headroom = UINT64_MAX;
+    uint64_t others = 0;
+    uint64_t reserved;
+    uint64_t cap;
+    char outcome[RESIZE_LINE_LEN];
+    if (sizes[i] == 0) {
+      snprintf(outcome, sizeof(outcome),
+               "# error: only tmpfs ramdisks can be resized\n");
+    } else if (size == sizes[i]) {
+      snprintf(outcome, sizeof(outcome), "# %" PRIu64 "M\n", size);
+    } else if (size > sizes[i] && config->max_size > 0 &&
+               total - sizes[i] + size > config->max_size) {
+      snprintf(outcome, sizeof(outcome),
+               "# error: ramdisks may be at most %" PRIu64 "M in total - "
+               "still %" PRIu64 "M\n",
+               config->max_size, sizes[i]);
+    } else if (usage.allocation > 0 &&
+               total - sizes[i] + size + get_headroom(usage.allocation) >=
+                   usage.allocation) {
+      snprintf(outcome, sizeof(outcome),
+               "# error: %" PRIu64 "M of ramdisks would leave less than "
+               "%" PRIu64 "M of the %" PRIu64 "M allocated - still %" PRIu64
+               "M\n",
+               total - sizes[i] + size, get_headroom(usage.allocation),
+               usage.allocation, sizes[i]);
+    } else if (size > sizes[i] &&
+               get_memory_headroom(&headroom) == EXIT_SUCCESS &&
+               size - sizes[i] > headroom) {
+      snprintf(outcome, sizeof(outcome),
+               "# error: only %" PRIu64 "M of memory is free to grow into - "
+               "still %" PRIu64 "M\n",
+               headroom, sizes[i]);
+    } else if (resize_reservation(total - sizes[i] + size, &others) !=
+               EXIT_SUCCESS) {
+      snprintf(outcome, sizeof(outcome),
+               "# error: the job's other steps have reserved %" PRIu64
+               "M of the %" PRIu64 "M allocated to it - still %" PRIu64
+               "M\n",
+               others, reservation.allocation, sizes[i]);
+    } else if (size > sizes[i] &&
+               reserve_node_memory(size - sizes[i], &reserved, &cap) !=
+                   EXIT_SUCCESS) {
+      resize_reservation(total, &others);
+      snprintf(outcome, sizeof(outcome),
+               "# error: the node's ramdisks already hold %" PRIu64
+               "M of the %" PRIu64 "M they may use - still %" PRIu64 "M\n",
+               reserved, cap, sizes[i]);
+    } else if (remount_ramdisk(usage.directories[i], size) != EXIT_SUCCESS) {
+      // shrinking below what's in use fails with EINVAL
+      int error = errno;
+      resize_reservation(total, &others);
+      if (size > sizes[i]) {
+        release_node_memory(size - sizes[i]);
+      }
+      snprintf(outcome, sizeof(outcome),
+               "# error: %s - still %" PRIu64 "M\n",
+               error == EINVAL ? "more than that is in use" : strerror(error),
+               sizes[i]);
+    } else {
+      slurm_info("ramdisk.c: resized %s from %" PRIu64 "M to %" PRIu64 "M",
+                 usage.directories[i], sizes[i], size);
+      snprintf(outcome, sizeof(outcome), "# %" PRIu64 "M\n", size);
+      if (size < sizes[i]) {
+        release_node_memory(sizes[i] - size);
+      }
+      total = total - sizes[i] + size;
+      sizes[i] = size;
+      if (total > usage.peak_size) {
+        usage.peak_size = total;
+      }
+    }
+
+    if (fd >= 0) {
+      if (ftruncate(fd, 0) != 0 ||
+          pwrite(fd, outcome, strlen(outcome), 0) < 0) {
+        slurm_verbose("ramdisk.c: unable to answer %s", control);
+      }
+      close(fd);
+    } else if (strncmp(outcome, "# error", 7) == 0) {
+      slurm_verbose("ramdisk.c: not growing %s: %s", usage.directories[i],
+                    outcome + 2);
+    }
+  }
+}
+
+/**
+ * @brief Reads the size a job's asked its RAM disk to be
+ * The file is the job's, so we never follow links, and only take a size (as
+ * for `--ramdisk`) at its start - our own answers start with `#`.
+ *
+ * @param path the resize file
+ * @param size where we store the requested size in megabytes
+ * @return int the open file (to answer through) if a size was requested, or -1
+ */
+static int read_resize_request(const char *path, uint64_t *size) {
+  int fd = open(path, O_RDWR | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  char request[RESIZE_LINE_LEN];
+  ssize_t length = -1;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    length = pread(fd, request, sizeof(request) - 1, 0);
+  }
+  if (length <= 0 || request[0] < '0' || request[0] > '9') {
+    close(fd);
+    return -1;
+  }
+  request[length] = '\0';
+  request[strcspn(request, " \t\r\n")] = '\0';
+
+  if (parse_memory(request, size) != EXIT_SUCCESS || *size == 0) {
+    const char *outcome = "# error: expected a size, e.g. 4096M or 8G\n";
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, outcome, strlen(outcome), 0) < 0) {
+      slurm_verbose("ramdisk.c: unable to answer %s", path);
+    }
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Changes the size of a tmpfs RAM disk
+ * Private RAM disks can only be remounted from within their namespace, so
+ * that's done by a child that joins it.
+ *
+ * @param directory the RAM disk path
+ * @param size the new size in megabytes
+ * @return int (with `errno` set on failure)
+ */
+static int remount_ramdisk(const char *directory, uint64_t size) {
+  char options[MOUNT_OPTION_LEN];
+  snprintf(options, sizeof(options), "size=%" PRIu64 "M", size);
+  if (namespace_holder <= 0) {
+    return mount(NULL, directory, NULL, MS_REMOUNT | MOUNT_FLAGS_NONE,
+                 options) == 0
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(namespace_pipe);
+    if (enter_namespace() != EXIT_SUCCESS) {
+      _exit(EPERM);
+    }
+    _exit(mount(NULL, directory, NULL, MS_REMOUNT | MOUNT_FLAGS_NONE,
+                options) == 0
+              ? 0
+              : errno);
+  }
+
+  int status = 0;
+  while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (pid < 0) {
+    return EXIT_FAILURE;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    errno = WIFEXITED(status) ? WEXITSTATUS(status) : EIO;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads how much more memory the step's cgroup may use
+ *
+ * @param headroom where we store the headroom in megabytes (`UINT64_MAX` if
+ * unlimited)
+ * @return int failure if the cgroup can't be read
+ */
+static int get_memory_headroom(uint64_t *headroom) {
+  uint64_t limit;
+  uint64_t used;
+  if (usage.cgroup[0] == '\0' ||
+      read_memory_limit(usage.cgroup, &limit, &used) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if (limit == UINT64_MAX) {
+    *headroom = UINT64_MAX;
+  } else {
+    *headroom = limit > used ? limit - used : 0;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Gets the memory `--ramdisk-headroom` keeps for the application
+ * No less than the partition's `min_headroom`.
+ *
+ * @param allocation the step's (or job's) memory allocation in megabytes
+ * @return uint64_t the headroom in megabytes
+ */
+static uint64_t get_headroom(uint64_t allocation) {
+  uint64_t headroom = ramdisk_headroom_percent > 0
+                          ? allocation * ramdisk_headroom_percent / 100
+                          : ramdisk_headroom;
+  uint64_t least = config->min_headroom_percent > 0
+                       ? allocation * config->min_headroom_percent / 100
+                       : config->min_headroom;
+  return headroom > least ? headroom : least;
+}
+
+/**
+ * @brief Gets the smallest allocation fitting a RAM disk and its headroom
+ *
+ * @param size the RAM disk's size in megabytes
+ * @return uint64_t the allocation in megabytes
+ */
+static uint64_t get_allocation(uint64_t size) {
+  uint64_t allocation =
+      ramdisk_headroom_percent > 0
+          ? size * 100 / (100 - ramdisk_headroom_percent) + 1
+          : size + ramdisk_headroom + 1;
+  uint64_t least =
+      config->min_headroom_percent > 0
+          ? size * 100 / (100 - config->min_headroom_percent) + 1
+          : size + config->min_headroom + 1;
+  return allocation > least ? allocation : least;
+}
+
+/**
+ * @brief Checks the step's memory cgroup has room for the RAM disk
+ * The allocation check alone misses memory already charged to the cgroup -
+ * processes already running in the step, or the RAM disks of the job's other
+ * steps. Checks the step's cgroup, and then the job's (which every step
+ * shares), so an oversized RAM disk fails now rather than the job being OOM
+ * killed once it fills it. Reclaimable page cache isn't counted as in use.
+ *
+ * Returns failure (with the reason logged) if the RAM disk and headroom don't
+ * fit. A missing cgroup, or one without a limit, passes.
+ *
+ * @param sp the spank instance
+ * @param size the RAM disk's size in megabytes
+ * @param headroom the memory to leave for the job in megabytes
+ * @return int
+ */
+static int check_cgroup_memory(spank_t sp, uint64_t size, uint64_t headroom) {
+  char cgroup[PATH_MAX];
+  if (get_cgroup_path(sp, "memory", cgroup) != EXIT_SUCCESS) {
+    slurm_verbose("ramdisk.c: no memory cgroup to check the ramdisk against");
+    return EXIT_SUCCESS;
+  }
+
+  int rc = EXIT_SUCCESS;
+  while (rc == EXIT_SUCCESS) {
+    uint64_t limit;
+    uint64_t used;
+    if (read_memory_limit(cgroup, &limit, &used) == EXIT_SUCCESS &&
+        limit != UINT64_MAX) {
+      uint64_t available = limit > used ? limit - used : 0;
+      slurm_debug("ramdisk.c: %s has %" PRIu64 "M of %" PRIu64 "M free",
+                  cgroup, available, limit);
+      if (size + headroom > available) {
+        slurm_error("ramdisk.c: cannot create ramdisk of size %" PRIu64
+                    "M, as %s has only %" PRIu64 "M of its %" PRIu64
+                    "M limit free (%" PRIu64 "M in use), and %" PRIu64
+                    "M must be left for the job (--ramdisk-headroom)",
+                    size, cgroup, available, limit, used, headroom);
+        rc = EXIT_FAILURE;
+      }
+    }
+
+    // move up from the step to the job
+    char *last = strrchr(cgroup, '/');
+    if (last == NULL || strncmp(last + 1, "step_", 5) != 0) {
+      break;
+    }
+    *last = '\0';
+  }
+  return rc;
+}
+
+/**
+ * @brief Reads a memory cgroup's limit, and what it has in use
+ * Reads cgroup v2's `memory.max` and `memory.current`, or v1's equivalents,
+ * discounting inactive page cache (which the kernel reclaims before it would
+ * OOM kill anything) from the usage.
+ *
+ * @param cgroup the memory cgroup's directory
+ * @param limit where we store the limit in megabytes (`UINT64_MAX` if
+ * unlimited)
+ * @param used where we store the usage in megabytes
+ * @return int failure if the cgroup can't be read
+ */
+static int read_memory_limit(const char *cgroup, uint64_t *limit,
+                             uint64_t *used) {
+  char path[PATH_MAX];
+  char maximum[64];
+  char current[64];
+  snprintf(path, sizeof(path), "%s/" CGROUP_MEMORY_MAX, cgroup);
+  if (read_file(path, maximum, sizeof(maximum)) == EXIT_SUCCESS) {
+    snprintf(path, sizeof(path), "%s/" CGROUP_MEMORY_CURRENT, cgroup);
+  } else {
+    snprintf(path, sizeof(path), "%s/" CGROUP_MEMORY_LIMIT, cgroup);
+    if (read_file(path, maximum, sizeof(maximum)) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    snprintf(path, sizeof(path), "%s/" CGROUP_MEMORY_USAGE, cgroup);
+  }
+  if (read_file(path, current, sizeof(current)) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  uint64_t bytes = strtoull(current, NULL, 10);
+  uint64_t inactive;
+  snprintf(path, sizeof(path), "%s/" CGROUP_MEMORY_STAT, cgroup);
+  if (read_memory_stat(path, "inactive_file", &inactive) == EXIT_SUCCESS &&
+      inactive < bytes) {
+    bytes -= inactive;
+  }
+  *used = bytes >> 20;
+
+  // v1 reports no limit as a huge page-aligned value, rather than `max`
+  bytes = strtoull(maximum, NULL, 10);
+  *limit = strncmp(maximum, "max", 3) == 0 || bytes >= (UINT64_MAX >> 2)
+               ? UINT64_MAX
+               : bytes >> 20;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Resolves the job's memory cgroup limit, and the job's charge state
+ * The limit is the job's (not the step's) `memory.max`, or v1's
+ * `memory.limit_in_bytes`, as a job scoped RAM disk outlives the step.
+ *
+ * Returns failure if the job has no memory cgroup.
+ *
+ * @param sp the spank instance
+ * @return int
+ */
+static int set_charge(spank_t sp) {
+  char cgroup[PATH_MAX];
+  if (get_cgroup_path(sp, "memory", cgroup) != EXIT_SUCCESS ||
+      get_state_path(sp, ".lock", charge.lock) != EXIT_SUCCESS ||
+      get_state_path(sp, JOB_CHARGE_SUFFIX, charge.state) != EXIT_SUCCESS) {
+    charge.state[0] = '\0';
+    return EXIT_FAILURE;
+  }
+  char *last = strrchr(cgroup, '/');
+  if (last != NULL && strncmp(last + 1, "step_", 5) == 0) {
+    *last = '\0';
+  }
+
+  struct stat sb;
+  snprintf(charge.limit, sizeof(charge.limit), "%s/" CGROUP_MEMORY_MAX,
+           cgroup);
+  if (stat(charge.limit, &sb) != 0) {
+    snprintf(charge.limit, sizeof(charge.limit), "%s/" CGROUP_MEMORY_LIMIT,
+             cgroup);
+  }
+  if (stat(charge.limit, &sb) != 0) {
+    charge.state[0] = '\0';
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Lowers the job's memory limit for a block RAM disk, or raises it back
+ * Job scoped RAM disks are created and destroyed with the job already locked,
+ * otherwise we lock it here.
+ *
+ * Returns failure (with the reason logged) if the job's limit can't be
+ * changed - a block RAM disk must then not be created, as nothing would hold
+ * its memory to the allocation.
+ *
+ * @param sp the spank instance
+ * @param size megabytes to lower the limit by (negative to raise it)
+ * @return int
+ */
+static int charge_job_memory(spank_t sp, int64_t size) {
+  if (set_charge(sp) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: unable to find the job's memory cgroup, which "
+                "block ramdisks need - zram memory isn't charged to it");
+    return EXIT_FAILURE;
+  }
+
+  int lock = -1;
+  if (!ramdisk_job_scope && (lock = lock_file(charge.lock)) < 0) {
+    return EXIT_FAILURE;
+  }
+  int rc = adjust_charge(size);
+  if (lock >= 0) {
+    close(lock);
+  }
+  return rc;
+}
+
+/**
+ * @brief Changes the job's charge, and brings its memory limit into line
+ * The limit before any charge is what we last wrote plus the charge - unless
+ * it's no longer what we wrote, having been reset since. A job without a
+ * limit is left without one, but keeps its charge in case one is set.
+ *
+ * Must be called with the job locked.
+ *
+ * @param size megabytes to add to the charge (negative to remove them, or
+ * zero to only reapply it)
+ * @return int
+ */
+static int adjust_charge(int64_t size) {
+  uint64_t charged = 0;
+  uint64_t written = 0;
+  uint64_t limit;
+  char value[JOB_LEDGER_LINE_LEN];
+  if (read_file(charge.state, value, sizeof(value)) != EXIT_SUCCESS ||
+      sscanf(value, "%" SCNu64 " %" SCNu64, &charged, &written) != 2) {
+    charged = 0;
+    written = 0;
+  }
+  if (read_charge_limit(&limit) != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to read %s", charge.limit);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t base = limit == written ? written + (charged << 20) : limit;
+  if (size < 0 && (uint64_t)-size > charged) {
+    size = -(int64_t)charged;
+  }
+  charged += size;
+  if (limit != UINT64_MAX && (size != 0 || limit != written)) {
+    if ((charged << 20) >= base) {
+      slurm_error("ramdisk.c: the job's memory limit (%" PRIu64
+                  "M) can't hold %" PRIu64 "M of block ramdisks",
+                  base >> 20, charged);
+      return EXIT_FAILURE;
+    }
+    snprintf(value, sizeof(value), "%" PRIu64, base - (charged << 20));
+    if (write_sysfs(charge.limit, value) != EXIT_SUCCESS ||
+        read_charge_limit(&written) != EXIT_SUCCESS) {
+      slurm_error("ramdisk.c: failed to set %s to %s", charge.limit, value);
+      return EXIT_FAILURE;
+    }
+    slurm_verbose("ramdisk.c: job memory limit set to %" PRIu64
+                  "M, less %" PRIu64 "M of block ramdisks",
+                  written >> 20, charged);
+  }
+
+  int length = snprintf(value, sizeof(value), "%" PRIu64 " %" PRIu64,
+                        charged, written);
+  int fd = open(charge.state, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0 || write(fd, value, length) != length) {
+    slurm_error("ramdisk.c: failed to write %s", charge.state);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Lowers the job's memory limit again if it's been reset
+ * Called from the usage monitor, only taking the job's lock when the limit
+ * differs from what we last wrote.
+ */
+static void check_charge(void) {
+  uint64_t charged;
+  uint64_t written;
+  uint64_t limit;
+  char value[JOB_LEDGER_LINE_LEN];
+  if (charge.state[0] == '\0' ||
+      read_file(charge.state, value, sizeof(value)) != EXIT_SUCCESS ||
+      sscanf(value, "%" SCNu64 " %" SCNu64, &charged, &written) != 2 ||
+      charged == 0 || read_charge_limit(&limit) != EXIT_SUCCESS ||
+      limit == written || limit == UINT64_MAX) {
+    return;
+  }
+
+  int lock = lock_file(charge.lock);
+  if (lock < 0) {
+    return;
+  }
+  slurm_info("ramdisk.c: job memory limit was reset, lowering it again");
+  adjust_charge(0);
+  close(lock);
+}
+
+/**
+ * @brief Reads the job's memory limit, in bytes
+ *
+ * @param limit where we store the limit (`UINT64_MAX` if unlimited)
+ * @return int
+ */
+static int read_charge_limit(uint64_t *limit) {
+  char value[64];
+  if (read_file(charge.limit, value, sizeof(value)) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  // v1 reports no limit as a huge page-aligned value, rather than `max`
+  uint64_t bytes = strtoull(value, NULL, 10);
+  *limit = strncmp(value, "max", 3) == 0 || bytes >= (UINT64_MAX >> 2)
+               ? UINT64_MAX
+               : bytes;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads a counter (in bytes) from a cgroup `memory.stat`
+ * Prefers the hierarchical `total_` counter on cgroup v1, which covers any
+ * child cgroups, falling back to the plain (v2) counter.
+ *
+ * @param path the `memory.stat` path
+ * @param key the counter name (e.g. `shmem`)
+ * @param value where we store the value
+ * @return int
+ */
+static int read_memory_stat(const char *path, const char *key,
+                            uint64_t *value) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  int rc = EXIT_FAILURE;
+  char line[256];
+  char name[64];
+  uint64_t count;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "%63s %" SCNu64, name, &count) != 2) {
+      continue;
+    }
+    if (strncmp(name, "total_", 6) == 0 && strcmp(name + 6, key) == 0) {
+      *value = count;
+      rc = EXIT_SUCCESS;
+      break;
+    }
+    if (strcmp(name, key) == 0) {
+      *value = count;
+      rc = EXIT_SUCCESS;
+    }
+  }
+
+  fclose(file);
+  return rc;
+}
+
+/**
+ * @brief Checks the kernel will honour tmpfs `huge=` mount options
+ * Reads the shmem THP setting, where the active value is bracketed (e.g.
+ * `always within_size advise [never] deny force`). A missing file means the
+ * kernel lacks THP entirely, and `deny` disables huge pages for every mount.
+ *
+ * Returns failure (with the reason logged) if huge pages are unavailable.
+ *
+ * @return int
+ */
+static int check_shmem_thp(void) {
+  FILE *file = fopen(THP_SHMEM_ENABLED, "r");
+  if (file == NULL) {
+    slurm_error("ramdisk.c: --ramdisk-huge requested but the kernel has no "
+                "transparent huge page support (%s missing)",
+                THP_SHMEM_ENABLED);
+    return EXIT_FAILURE;
+  }
+
+  char line[128] = {0};
+  char active[THP_MODE_LEN] = {0};
+  if (fgets(line, sizeof(line), file) != NULL) {
+    char *start = strchr(line, '[');
+    char *end = start != NULL ? strchr(start, ']') : NULL;
+    if (end != NULL && end - start - 1 < THP_MODE_LEN) {
+      memcpy(active, start + 1, end - start - 1);
+    }
+  }
+  fclose(file);
+
+  if (active[0] == '\0') {
+    slurm_error("ramdisk.c: unable to parse %s", THP_SHMEM_ENABLED);
+    return EXIT_FAILURE;
+  }
+  if (strcmp(active, "deny") == 0) {
+    slurm_error("ramdisk.c: --ramdisk-huge=%s requested but shmem huge pages "
+                "are disabled on this node (%s is 'deny')",
+                ramdisk_huge, THP_SHMEM_ENABLED);
+    return EXIT_FAILURE;
+  }
+
+  slurm_verbose("ramdisk.c: shmem huge pages are '%s'", active);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Builds the tmpfs `mpol=` value for the RAM disk
+ * Uses the `--ramdisk-mpol` mode if given, otherwise binds to the step's
+ * memory nodes. Nodes come from the `--ramdisk-mpol` node list if given,
+ * otherwise the step's cgroup cpuset. `policy` is left empty (no `mpol=`)
+ * when the user didn't ask for a policy and the step may use every node.
+ *
+ * Returns failure only if the user asked for a policy we can't build.
+ *
+ * @param sp the spank instance
+ * @param policy the char array we write the policy into
+ * @param length the size of `policy`
+ * @return int
+ */
+static int get_mount_policy(spank_t sp, char policy[], size_t length) {
+  policy[0] = '\0';
+
+  if (strcmp(ramdisk_mpol, "default") == 0 ||
+      strcmp(ramdisk_mpol, "local") == 0) {
+    snprintf(policy, length, "%s", ramdisk_mpol);
+    return EXIT_SUCCESS;
+  }
+
+  unsigned char nodes[NUMA_MAX_NODES];
+  int n_nodes = 0;
+  if (ramdisk_mpol_nodes[0] != '\0') {
+    n_nodes = parse_list(ramdisk_mpol_nodes, nodes, NUMA_MAX_NODES);
+  } else {
+    n_nodes = get_step_nodes(sp, nodes);
+
+    if (ramdisk_mpol[0] == '\0') {
+      // only apply a default policy if the step is confined to some nodes
+      unsigned char online[NUMA_MAX_NODES];
+      char buffer[MOUNT_OPTION_LEN];
+      if (n_nodes <= 0 ||
+          read_file(NUMA_ONLINE, buffer, sizeof(buffer)) != EXIT_SUCCESS ||
+          parse_list(buffer, online, NUMA_MAX_NODES) <= n_nodes) {
+        slurm_verbose("ramdisk.c: step spans every NUMA node, no mpol");
+        return EXIT_SUCCESS;
+      }
+    }
+  }
+
+  if (n_nodes <= 0) {
+    slurm_error("ramdisk.c: unable to determine NUMA nodes for "
+                "--ramdisk-mpol=%s",
+                ramdisk_mpol);
+    return EXIT_FAILURE;
+  }
+
+  const char *mode = ramdisk_mpol[0] != '\0' ? ramdisk_mpol : "bind";
+  if (strcmp(mode, "prefer") == 0) {
+    // prefer takes a single node - use the first
+    for (int i = 0, seen = 0; i < NUMA_MAX_NODES; i++) {
+      nodes[i] = nodes[i] && !seen;
+      seen |= nodes[i];
+    }
+  }
+
+  char list[MOUNT_OPTION_LEN];
+  format_list(nodes, NUMA_MAX_NODES, list, sizeof(list));
+  snprintf(policy, length, "%s:%s", mode, list);
+  slurm_verbose("ramdisk.c: using memory policy %s", policy);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads the memory nodes of the step's cgroup cpuset
+ *
+ * @param sp the spank instance
+ * @param nodes the array of `NUMA_MAX_NODES` flags we mark nodes in
+ * @return int the number of nodes, or -1 if the cpuset can't be read
+ */
+static int get_step_nodes(spank_t sp, unsigned char nodes[]) {
+  char path[PATH_MAX];
+  char mems[MOUNT_OPTION_LEN];
+  if (get_cgroup_path(sp, "cpuset", path) != EXIT_SUCCESS ||
+      strlen(path) + sizeof("/cpuset.mems.effective") > PATH_MAX) {
+    return -1;
+  }
+
+  // v2 and v1 names respectively
+  size_t end = strlen(path);
+  strcat(path, "/cpuset.mems.effective");
+  if (read_file(path, mems, sizeof(mems)) != EXIT_SUCCESS) {
+    strcpy(path + end, "/cpuset.effective_mems");
+    if (read_file(path, mems, sizeof(mems)) != EXIT_SUCCESS) {
+      return -1;
+    }
+  }
+
+  return parse_list(mems, nodes, NUMA_MAX_NODES);
+}
+
+/**
+ * @brief Finds the step's cgroup directory for a controller
+ * Locates the job's cgroup from our own (slurmstepd's) entry in
+ * `/proc/self/cgroup`, handling both cgroup v1 (per-controller hierarchies)
+ * and v2 (unified). Prefers the step's cgroup, falling back to the job's if
+ * the step's hasn't been created yet.
+ *
+ * Returns failure if neither the step nor job cgroup can be found.
+ *
+ * @param sp the spank instance
+ * @param controller the v1 controller name (e.g. `memory`, `cpuset`)
+ * @param path the char array (of `PATH_MAX`) we write the cgroup path into
+ * @return int
+ */
+static int get_cgroup_path(spank_t sp, const char *controller, char path[]) {
   uint32_t job_id;
   uint32_t job_stepid;
-  if (spank_get_item(sp, S_JOB_ID, &job_id) != ESPANK_SUCCESS) {
-    slurm_error("ramdisk.c: failed to get job ID");
+  uid_t uid;
+  if (spank_get_item(sp, S_JOB_ID, &job_id) != ESPANK_SUCCESS ||
+      spank_get_item(sp, S_JOB_STEPID, &job_stepid) != ESPANK_SUCCESS ||
+      spank_get_item(sp, S_JOB_UID, &uid) != ESPANK_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  FILE *file = fopen(CGROUP_SELF, "r");
+  if (file == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  // lines are `ID:CONTROLLERS:PATH`, where v2 is `0::PATH`
+  char line[PATH_MAX];
+  char self[PATH_MAX] = {0};
+  char base[PATH_MAX] = {0};
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    char *controllers = strchr(line, ':');
+    char *cgroup = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+    if (cgroup == NULL) {
+      continue;
+    }
+    *cgroup++ = '\0';
+    controllers++;
+
+    if (controllers[0] == '\0' && base[0] == '\0') {
+      snprintf(base, sizeof(base), "%s", CGROUP_ROOT);
+      snprintf(self, sizeof(self), "%s", cgroup);
+    }
+    for (char *saveptr, *token = strtok_r(controllers, ",", &saveptr);
+         token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+      if (strcmp(token, controller) == 0) {
+        snprintf(base, sizeof(base), "%s/%s", CGROUP_ROOT, controller);
+        snprintf(self, sizeof(self), "%s", cgroup);
+      }
+    }
+  }
+  fclose(file);
+
+  if (base[0] == '\0') {
+    return EXIT_FAILURE;
+  }
+
+  char job[PATH_MAX];
+  char component[32];
+  snprintf(component, sizeof(component), "/job_%" PRIu32, job_id);
+  char *found = strstr(self, component);
+  size_t component_length = strlen(component);
+  if (found != NULL &&
+      (found[component_length] == '/' || found[component_length] == '\0')) {
+    found[component_length] = '\0';
+    snprintf(job, sizeof(job), "%s%s", base, self);
+  } else if (strcmp(base, CGROUP_ROOT) == 0) {
+    // v2, but we've not been moved into the job yet
+    snprintf(job, sizeof(job), "%s%s%s", base,
+             strcmp(self, "/") == 0 ? "" : self, component);
+  } else {
+    snprintf(job, sizeof(job), "%s/slurm/uid_%u%s", base, uid, component);
+  }
+
+  char step[32];
+  if (job_stepid == SLURM_BATCH_SCRIPT) {
+    strcpy(step, "step_batch");
+  } else if (job_stepid == SLURM_EXTERN_CONT) {
+    strcpy(step, "step_extern");
+  } else if (job_stepid == SLURM_INTERACTIVE_STEP) {
+    strcpy(step, "step_interactive");
+  } else {
+    snprintf(step, sizeof(step), "step_%" PRIu32, job_stepid);
+  }
+
+  struct stat sb;
+  if (snprintf(path, PATH_MAX, "%s/%s", job, step) < PATH_MAX &&
+      stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+    return EXIT_SUCCESS;
+  }
+  if (stat(job, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+    snprintf(path, PATH_MAX, "%s", job);
+    return EXIT_SUCCESS;
+  }
+
+  slurm_verbose("ramdisk.c: unable to find %s cgroup for job %" PRIu32,
+                controller, job_id);
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief Reads a small (single line) file, stripping the trailing newline
+ *
+ * @param path the file to read
+ * @param buffer the char array we read into
+ * @param length the size of `buffer`
+ * @return int
+ */
+static int read_file(const char *path, char buffer[], size_t length) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return EXIT_FAILURE;
+  }
+
+  ssize_t n = read(fd, buffer, length - 1);
+  close(fd);
+  if (n < 0) {
     return EXIT_FAILURE;
   }
-  if (spank_get_item(sp, S_JOB_STEPID, &job_stepid) != ESPANK_SUCCESS) {
-    slurm_error("ramdisk.c: failed to get job step ID");
+
+  buffer[n] = '\0';
+  buffer[strcspn(buffer, "\n")] = '\0';
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parses a kernel list (e.g. `0-3,8,10-11`) into a set
+ *
+ * @param list the list string
+ * @param set the array of `max` flags we mark members in
+ * @param max the number of entries in `set`
+ * @return int the number of members, or -1 if the list is invalid
+ */
+static int parse_list(const char *list, unsigned char set[], int max) {
+  memset(set, 0, max);
+
+  int count = 0;
+  const char *p = list;
+  while (*p != '\0') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p) {
+      return -1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+    }
+    if (first < 0 || last < first || last >= max) {
+      return -1;
+    }
+    for (long i = first; i <= last; i++) {
+      count += !set[i];
+      set[i] = 1;
+    }
+
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    p = end;
+  }
+
+  return count;
+}
+
+/**
+ * @brief Formats a set as a compact kernel list (e.g. `0-3,8`)
+ *
+ * @param set the array of `max` membership flags
+ * @param max the number of entries in `set`
+ * @param buffer the char array we write the list into
+ * @param length the size of `buffer`
+ */
+static void format_list(const unsigned char set[], int max, char buffer[],
+                        size_t length) {
+  size_t used = 0;
+  buffer[0] = '\0';
+
+  for (int i = 0; i < max && used < length; i++) {
+    if (!set[i]) {
+      continue;
+    }
+    int last = i;
+    while (last + 1 < max && set[last + 1]) {
+      last++;
+    }
+    if (last == i) {
+      used += snprintf(buffer + used, length - used, "%s%d", used ? "," : "", i);
+    } else {
+      used += snprintf(buffer + used, length - used, "%s%d-%d", used ? "," : "",
+                       i, last);
+    }
+    i = last;
+  }
+}
+
+/**
+ * @brief Runs a function in a child process with the job user's credentials
+ * Forks, drops to the job UID/GID (and supplementary groups), then calls `fn`.
+ * The parent waits for the child, killing it if `timeout_seconds` (when
+ * non-zero) elapses first.
+ *
+ * Returns failure if we fail to fork, the child fails, or it times out.
+ *
+ * @param sp the spank instance
+ * @param fn the function to call in the child, returning an exit status
+ * @param arg the argument passed to `fn`
+ * @param timeout_seconds seconds to wait before killing the child (0 waits)
+ * @return int
+ */
+static int run_as_user(spank_t sp, int (*fn)(void *), void *arg,
+                       int timeout_seconds) {
+  uid_t uid;
+  gid_t gid;
+  gid_t *gids = NULL;
+  int n_gids = 0;
+  if (spank_get_item(sp, S_JOB_UID, &uid) != ESPANK_SUCCESS ||
+      spank_get_item(sp, S_JOB_GID, &gid) != ESPANK_SUCCESS) {
+    slurm_error("ramdisk.c: failed to get job UID/GID");
     return EXIT_FAILURE;
   }
+  if (spank_get_item(sp, S_JOB_SUPPLEMENTARY_GIDS, &gids, &n_gids) !=
+      ESPANK_SUCCESS) {
+    // carry on with only the primary group
+    gids = NULL;
+    n_gids = 0;
+  }
 
-  if (job_stepid > SLURM_MAX_NORMAL_STEP_ID) {
-    if (job_stepid == SLURM_PENDING_STEP) {
-      slurm_error("ramdisk.c: cannot create ramdisk for pending step");
+  pid_t pid = fork();
+  if (pid < 0) {
+    slurm_error("ramdisk.c: failed to fork: %s", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (pid == 0) {
+    if (setgroups(n_gids, gids) != 0 || setgid(gid) != 0 || setuid(uid) != 0) {
+      slurm_error("ramdisk.c: failed to drop privileges: %s", strerror(errno));
+      _exit(EXIT_FAILURE);
+    }
+    // modes are copied from the source, so don't let a umask mask them
+    umask(0);
+    _exit(fn(arg));
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int status;
+  while (1) {
+    pid_t rc = waitpid(pid, &status, timeout_seconds > 0 ? WNOHANG : 0);
+    if (rc == pid) {
+      break;
+    }
+    if (rc < 0 && errno != EINTR) {
+      slurm_error("ramdisk.c: failed to wait for child: %s", strerror(errno));
       return EXIT_FAILURE;
-    } else if (job_stepid == SLURM_EXTERN_CONT) {
-      snprintf(directory, DIRECTORY_PATH_LEN,
-               "/ramdisks/%" PRIu32 ".extern.ramdisk", job_id);
-    } else if (job_stepid == SLURM_BATCH_SCRIPT) {
-      snprintf(directory, DIRECTORY_PATH_LEN,
-               "/ramdisks/%" PRIu32 ".batch.ramdisk", job_id);
-    } else if (job_stepid == SLURM_INTERACTIVE_STEP) {
-      snprintf(directory, DIRECTORY_PATH_LEN,
-               "/ramdisks/%" PRIu32 ".interactive.ramdisk", job_id);
-    } else {
-      slurm_error("ramdisk.c: invalid job step id: %" PRIu32, job_stepid);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timeout_seconds > 0 && now.tv_sec - start.tv_sec >= timeout_seconds) {
+      slurm_error("ramdisk.c: child exceeded %ds, killing it", timeout_seconds);
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
       return EXIT_FAILURE;
     }
+
+    struct timespec poll = {.tv_sec = 0, .tv_nsec = STAGE_POLL_NSEC};
+    nanosleep(&poll, NULL);
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Copies `--ramdisk-stage-in` into the RAM disk
+ * Runs as the job user (see `run_as_user`).
+ *
+ * @param paths the `stage_paths` (source, and RAM disk path)
+ * @return int
+ */
+static int stage_in(void *paths) {
+  const struct stage_paths *stage = paths;
+  struct copy_engine engine = {.n_workers = STAGE_THREADS};
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int rc = copy_tree(&engine, stage->src, stage->dst);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+  slurm_info("ramdisk.c: staged in %" PRIu64 " files (%" PRIu64
+             "M) from %s in %.2fs",
+             engine.files, engine.bytes >> 20, stage->src, elapsed);
+  return rc;
+}
+
+/**
+ * @brief Copies the RAM disk contents out to `--ramdisk-stage-out`
+ * Runs as the job user (see `run_as_user`). Files whose size and modification
+ * time already match the destination are skipped, and the copy is abandoned
+ * once its `timeout` (what's left of `STAGE_OUT_TIMEOUT`) elapses. Any
+ * `--ramdisk-image` or `--ramdisk-cache` dataset is left behind.
+ *
+ * @param paths the `stage_paths` (RAM disk path, and destination)
+ * @return int
+ */
+static int stage_out(void *paths) {
+  static const char *const exclude[] = {IMAGE_FILE_NAME, IMAGE_MOUNT_NAME,
+                                        CACHE_MOUNT_NAME, RESIZE_FILE_NAME,
+                                        NULL};
+  const struct stage_paths *stage = paths;
+  struct copy_engine engine = {.n_workers = STAGE_THREADS,
+                               .skip_unchanged = 1,
+                               .exclude = exclude};
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  engine.deadline = start;
+  engine.deadline.tv_sec += stage->timeout;
+
+  int rc = copy_tree(&engine, stage->src, stage->dst);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+  slurm_info("ramdisk.c: staged out %" PRIu64 " files (%" PRIu64
+             "M, %" PRIu64 " unchanged) to %s in %.2fs",
+             engine.files, engine.bytes >> 20, engine.skipped,
+             stage->dst, elapsed);
+  if (rc != EXIT_SUCCESS && end.tv_sec >= engine.deadline.tv_sec) {
+    slurm_error("ramdisk.c: stage-out exceeded %ds, output is incomplete",
+                stage->timeout);
+  }
+  return rc;
+}
+
+/**
+ * @brief Joins a directory path and an entry name into a new allocation
+ *
+ * @param directory the parent path
+ * @param name the entry name
+ * @return char* (NULL on allocation failure)
+ */
+static char *join_path(const char *directory, const char *name) {
+  size_t length = strlen(directory) + strlen(name) + 2;
+  char *path = malloc(length);
+  if (path != NULL) {
+    snprintf(path, length, "%s/%s", directory, name);
+  }
+  return path;
+}
+
+/**
+ * @brief Pushes a task onto the tail of a worker's deque
+ *
+ * @param engine the copy engine
+ * @param index the worker whose deque receives the task
+ * @param task the task
+ */
+static void copy_push(struct copy_engine *engine, int index,
+                      struct copy_task *task) {
+  struct copy_deque *deque = &engine->deques[index];
+
+  __atomic_add_fetch(&engine->pending, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&deque->lock);
+  task->next = NULL;
+  task->prev = deque->tail;
+  if (deque->tail != NULL) {
+    deque->tail->next = task;
   } else {
-    snprintf(directory, DIRECTORY_PATH_LEN,
-             "/ramdisks/%" PRIu32 ".%" PRIu32 ".ramdisk", job_id, job_stepid);
+    deque->head = task;
+  }
+  deque->tail = task;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * @brief Takes a task for a worker - its own newest task, else the oldest task
+ * of another worker
+ *
+ * @param engine the copy engine
+ * @param index the worker looking for work
+ * @return struct copy_task* (NULL when no work is queued)
+ */
+static struct copy_task *copy_take(struct copy_engine *engine, int index) {
+  struct copy_task *task = NULL;
+
+  for (int i = 0; i < engine->n_workers && task == NULL; i++) {
+    struct copy_deque *deque =
+        &engine->deques[(index + i) % engine->n_workers];
+
+    pthread_mutex_lock(&deque->lock);
+    if (i == 0) {
+      task = deque->tail;
+      if (task != NULL) {
+        deque->tail = task->prev;
+        if (deque->tail != NULL) {
+          deque->tail->next = NULL;
+        } else {
+          deque->head = NULL;
+        }
+      }
+    } else {
+      task = deque->head;
+      if (task != NULL) {
+        deque->head = task->next;
+        if (deque->head != NULL) {
+          deque->head->prev = NULL;
+        } else {
+          deque->tail = NULL;
+        }
+      }
+    }
+    pthread_mutex_unlock(&deque->lock);
+  }
+
+  return task;
+}
+
+/**
+ * @brief Copies a byte range between two files
+ * Prefers `copy_file_range` (in-kernel, and offloaded on filesystems that
+ * support it), falling back to a buffered `pread`/`pwrite` loop when the
+ * kernel or filesystem pair doesn't support it.
+ *
+ * @param in the source file descriptor
+ * @param out the destination file descriptor
+ * @param offset the offset to copy from (in both files)
+ * @param length the number of bytes to copy
+ * @return int
+ */
+static int copy_range(int in, int out, off_t offset, off_t length) {
+  static int copy_file_range_unsupported;
+
+  loff_t in_offset = offset;
+  loff_t out_offset = offset;
+  while (length > 0 &&
+         !__atomic_load_n(&copy_file_range_unsupported, __ATOMIC_RELAXED)) {
+    ssize_t n = copy_file_range(in, &in_offset, out, &out_offset, length, 0);
+    if (n > 0) {
+      length -= n;
+    } else if (n == 0) {
+      // source shrank underneath us
+      return EXIT_SUCCESS;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == ENOSYS) {
+      __atomic_store_n(&copy_file_range_unsupported, 1, __ATOMIC_RELAXED);
+    } else if (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) {
+      break;
+    } else {
+      return EXIT_FAILURE;
+    }
+  }
+  if (length == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  char *buffer = malloc(STAGE_BUFFER_SIZE);
+  if (buffer == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  offset = in_offset;
+  while (length > 0) {
+    ssize_t n = pread(in, buffer,
+                      length < STAGE_BUFFER_SIZE ? length : STAGE_BUFFER_SIZE,
+                      offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    for (ssize_t written = 0; written < n;) {
+      ssize_t w = pwrite(out, buffer + written, n - written, offset + written);
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w < 0) {
+        free(buffer);
+        return EXIT_FAILURE;
+      }
+      written += w;
+    }
+    offset += n;
+    length -= n;
+  }
+
+  free(buffer);
+  return length == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Applies the source mode, group and timestamps to a copied file
+ *
+ * @param file the copied file (still under its temporary name)
+ * @return int
+ */
+static int copy_finish_file(struct copy_file *file) {
+  int fd = open(file->tmp, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return EXIT_FAILURE;
+  }
+
+  // best effort - only possible if we're a member of the group
+  if (fchown(fd, -1, file->st.st_gid) != 0) {
+    slurm_debug("ramdisk.c: unable to preserve group of %s", file->dst);
+  }
+
+  struct timespec times[2] = {file->st.st_atim, file->st.st_mtim};
+  int rc = fchmod(fd, file->st.st_mode & 07777) == 0 &&
+                   futimens(fd, times) == 0
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  close(fd);
+  return rc;
+}
+
+/**
+ * @brief Finishes a file once its last chunk is done, and frees it
+ * A complete copy replaces the destination; anything less is discarded, so
+ * neither a truncated file nor the source's timestamps (which would have the
+ * next stage-out skip it) are left behind.
+ *
+ * @param engine the copy engine
+ * @param file the file, whose chunks have all been run or dropped
+ * @return int
+ */
+static int copy_release_file(struct copy_engine *engine,
+                             struct copy_file *file) {
+  int rc = EXIT_FAILURE;
+  if (!__atomic_load_n(&file->failed, __ATOMIC_SEQ_CST) &&
+      copy_finish_file(file) == EXIT_SUCCESS) {
+    if (rename(file->tmp, file->dst) == 0) {
+      __atomic_add_fetch(&engine->files, 1, __ATOMIC_RELAXED);
+      rc = EXIT_SUCCESS;
+    } else {
+      slurm_error("ramdisk.c: failed to replace %s: %s", file->dst,
+                  strerror(errno));
+    }
+  }
+  if (rc != EXIT_SUCCESS) {
+    unlink(file->tmp);
+  }
+
+  free(file->src);
+  free(file->dst);
+  free(file->tmp);
+  free(file);
+  return rc;
+}
+
+/**
+ * @brief Queues a regular file for copying, split into chunks so huge files
+ * are spread across workers
+ * Skips the file if `skip_unchanged` is set and the destination size and
+ * modification time already match.
+ *
+ * @param engine the copy engine
+ * @param index the worker queueing the file
+ * @param src the source path (ownership passes to the engine)
+ * @param dst the destination path (ownership passes to the engine)
+ * @param st the source file status
+ * @return int
+ */
+static int copy_queue_file(struct copy_engine *engine, int index, char *src,
+                           char *dst, const struct stat *st) {
+  struct stat dst_st;
+  if (engine->skip_unchanged && stat(dst, &dst_st) == 0 &&
+      S_ISREG(dst_st.st_mode) && dst_st.st_size == st->st_size &&
+      dst_st.st_mtim.tv_sec == st->st_mtim.tv_sec) {
+    __atomic_add_fetch(&engine->skipped, 1, __ATOMIC_RELAXED);
+    free(src);
+    free(dst);
+    return EXIT_SUCCESS;
+  }
+
+  char *tmp = malloc(strlen(dst) + sizeof(STAGE_TEMP_SUFFIX));
+  int fd = -1;
+  if (tmp != NULL) {
+    strcpy(tmp, dst);
+    strcat(tmp, STAGE_TEMP_SUFFIX);
+    fd = mkostemp(tmp, O_CLOEXEC);
+  }
+  if (fd < 0 || ftruncate(fd, st->st_size) != 0) {
+    slurm_error("ramdisk.c: failed to create %s: %s", dst, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    free(src);
+    free(dst);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  struct copy_file *file = calloc(1, sizeof(*file));
+  if (file == NULL) {
+    unlink(tmp);
+    free(tmp);
+    free(src);
+    free(dst);
+    return EXIT_FAILURE;
+  }
+  file->src = src;
+  file->dst = dst;
+  file->tmp = tmp;
+  file->st = *st;
+  file->remaining =
+      st->st_size == 0 ? 1 : (st->st_size + STAGE_CHUNK_SIZE - 1) / STAGE_CHUNK_SIZE;
+
+  long n_chunks = file->remaining;
+  for (long i = 0; i < n_chunks; i++) {
+    struct copy_task *task = calloc(1, sizeof(*task));
+    if (task == NULL) {
+      // account for the chunks we'll never queue, so the file is still freed
+      __atomic_store_n(&file->failed, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_sub_fetch(&file->remaining, n_chunks - i,
+                             __ATOMIC_SEQ_CST) == 0) {
+        copy_release_file(engine, file);
+      }
+      return EXIT_FAILURE;
+    }
+    task->file = file;
+    task->offset = i * STAGE_CHUNK_SIZE;
+    task->length = st->st_size - task->offset < STAGE_CHUNK_SIZE
+                       ? st->st_size - task->offset
+                       : STAGE_CHUNK_SIZE;
+    copy_push(engine, index, task);
   }
+
   return EXIT_SUCCESS;
 }
+
+/**
+ * @brief Scans a source directory, creating the destination directory and
+ * queueing its entries
+ *
+ * @param engine the copy engine
+ * @param index the worker running the task
+ * @param src the source directory
+ * @param dst the destination directory
+ * @return int
+ */
+static int copy_directory(struct copy_engine *engine, int index,
+                          const char *src, const char *dst) {
+  DIR *dir = opendir(src);
+  if (dir == NULL) {
+    slurm_error("ramdisk.c: failed to open %s: %s", src, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  struct stat st;
+  if (fstat(dirfd(dir), &st) != 0 ||
+      (mkdir(dst, (st.st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST)) {
+    slurm_error("ramdisk.c: failed to create %s: %s", dst, strerror(errno));
+    closedir(dir);
+    return EXIT_FAILURE;
+  }
+
+  int rc = EXIT_SUCCESS;
+  int top = engine->exclude != NULL && strcmp(src, engine->root) == 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    int excluded = 0;
+    for (int i = 0; top && engine->exclude[i] != NULL; i++) {
+      excluded |= strcmp(entry->d_name, engine->exclude[i]) == 0;
+    }
+    if (excluded) {
+      continue;
+    }
+
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      rc = EXIT_FAILURE;
+      continue;
+    }
+
+    char *entry_src = join_path(src, entry->d_name);
+    char *entry_dst = join_path(dst, entry->d_name);
+    if (entry_src == NULL || entry_dst == NULL) {
+      free(entry_src);
+      free(entry_dst);
+      rc = EXIT_FAILURE;
+      break;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      struct copy_task *task = calloc(1, sizeof(*task));
+      if (task == NULL) {
+        free(entry_src);
+        free(entry_dst);
+        rc = EXIT_FAILURE;
+        break;
+      }
+      task->src = entry_src;
+      task->dst = entry_dst;
+      copy_push(engine, index, task);
+    } else if (S_ISREG(st.st_mode)) {
+      if (copy_queue_file(engine, index, entry_src, entry_dst, &st) !=
+          EXIT_SUCCESS) {
+        rc = EXIT_FAILURE;
+      }
+    } else {
+      if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(entry_src, target, sizeof(target) - 1);
+        if (n >= 0) {
+          target[n] = '\0';
+          unlink(entry_dst);
+          if (symlink(target, entry_dst) != 0) {
+            rc = EXIT_FAILURE;
+          }
+        }
+      } else {
+        slurm_verbose("ramdisk.c: skipping special file %s", entry_src);
+      }
+      free(entry_src);
+      free(entry_dst);
+    }
+  }
+
+  closedir(dir);
+  return rc;
+}
+
+/**
+ * @brief Copies one chunk of a file, finishing the file if it's the last
+ *
+ * @param engine the copy engine
+ * @param task the chunk task
+ * @return int
+ */
+static int copy_chunk(struct copy_engine *engine, struct copy_task *task) {
+  struct copy_file *file = task->file;
+  int rc = EXIT_FAILURE;
+
+  int in = open(file->src, O_RDONLY | O_CLOEXEC);
+  int out = open(file->tmp, O_WRONLY | O_CLOEXEC);
+  if (in >= 0 && out >= 0) {
+    rc = copy_range(in, out, task->offset, task->length);
+  }
+  if (rc != EXIT_SUCCESS) {
+    slurm_error("ramdisk.c: failed to copy %s: %s", file->src, strerror(errno));
+    __atomic_store_n(&file->failed, 1, __ATOMIC_SEQ_CST);
+  } else {
+    __atomic_add_fetch(&engine->bytes, task->length, __ATOMIC_RELAXED);
+  }
+  if (in >= 0) {
+    close(in);
+  }
+  if (out >= 0) {
+    close(out);
+  }
+
+  if (__atomic_sub_fetch(&file->remaining, 1, __ATOMIC_SEQ_CST) == 0 &&
+      copy_release_file(engine, file) != EXIT_SUCCESS) {
+    rc = EXIT_FAILURE;
+  }
+
+  return rc;
+}
+
+/**
+ * @brief Copy engine worker loop
+ * Runs tasks until every queue is empty and no task is in flight, or the
+ * engine deadline passes (after which remaining tasks are discarded).
+ *
+ * @param arg the `copy_worker`
+ * @return void*
+ */
+static void *copy_worker(void *arg) {
+  struct copy_worker *worker = arg;
+  struct copy_engine *engine = worker->engine;
+
+  while (1) {
+    struct copy_task *task = copy_take(engine, worker->index);
+    if (task == NULL) {
+      if (__atomic_load_n(&engine->pending, __ATOMIC_SEQ_CST) == 0) {
+        break;
+      }
+      struct timespec idle = {.tv_sec = 0, .tv_nsec = STAGE_IDLE_NSEC};
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    int expired = 0;
+    if (engine->deadline.tv_sec != 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      expired = now.tv_sec > engine->deadline.tv_sec ||
+                (now.tv_sec == engine->deadline.tv_sec &&
+                 now.tv_nsec >= engine->deadline.tv_nsec);
+    }
+
+    int rc = EXIT_FAILURE;
+    if (task->file != NULL) {
+      if (expired) {
+        // still account for the chunk so the file is freed, but not kept
+        __atomic_store_n(&task->file->failed, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_sub_fetch(&task->file->remaining, 1, __ATOMIC_SEQ_CST) ==
+            0) {
+          copy_release_file(engine, task->file);
+        }
+      } else {
+        rc = copy_chunk(engine, task);
+      }
+    } else {
+      if (!expired) {
+        rc = copy_directory(engine, worker->index, task->src, task->dst);
+      }
+      free(task->src);
+      free(task->dst);
+    }
+    if (rc != EXIT_SUCCESS) {
+      __atomic_store_n(&engine->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    free(task);
+    __atomic_sub_fetch(&engine->pending, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Copies a file, or the contents of a directory, into a directory
+ * Multi-threaded work-stealing copy - directories are scanned in parallel, and
+ * regular files are split into `STAGE_CHUNK_SIZE` chunks, so both trees of
+ * many tiny files and a handful of huge files keep every worker busy.
+ *
+ * Returns failure if any entry fails to copy, or the deadline passes.
+ *
+ * @param engine the copy engine, with `n_workers` (and optionally `deadline`
+ * and `skip_unchanged`) set
+ * @param src the source file or directory
+ * @param dst the destination directory
+ * @return int
+ */
+static int copy_tree(struct copy_engine *engine, const char *src,
+                     const char *dst) {
+  struct stat st;
+  if (stat(src, &st) != 0) {
+    slurm_error("ramdisk.c: cannot access %s: %s", src, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  engine->deques = calloc(engine->n_workers, sizeof(*engine->deques));
+  struct copy_worker *workers =
+      calloc(engine->n_workers, sizeof(struct copy_worker));
+  pthread_t *threads = calloc(engine->n_workers, sizeof(pthread_t));
+  if (engine->deques == NULL || workers == NULL || threads == NULL) {
+    free(engine->deques);
+    free(workers);
+    free(threads);
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < engine->n_workers; i++) {
+    pthread_mutex_init(&engine->deques[i].lock, NULL);
+  }
+
+  int rc = EXIT_SUCCESS;
+  engine->root = src;
+  if (S_ISDIR(st.st_mode)) {
+    struct copy_task *task = calloc(1, sizeof(*task));
+    if (task == NULL || (task->src = strdup(src)) == NULL ||
+        (task->dst = strdup(dst)) == NULL) {
+      rc = EXIT_FAILURE;
+    } else {
+      copy_push(engine, 0, task);
+    }
+  } else if (S_ISREG(st.st_mode)) {
+    char *file_src = strdup(src);
+    char *file_dst = join_path(dst, basename(src));
+    if (file_src == NULL || file_dst == NULL) {
+      free(file_src);
+      free(file_dst);
+      rc = EXIT_FAILURE;
+    } else {
+      rc = copy_queue_file(engine, 0, file_src, file_dst, &st);
+    }
+  } else {
+    slurm_error("ramdisk.c: %s is not a file or directory", src);
+    rc = EXIT_FAILURE;
+  }
+
+  int n_started = 0;
+  for (; n_started < engine->n_workers; n_started++) {
+    workers[n_started].engine = engine;
+    workers[n_started].index = n_started;
+    if (pthread_create(&threads[n_started], NULL, copy_worker,
+                       &workers[n_started]) != 0) {
+      break;
+    }
+  }
+  if (n_started == 0) {
+    // no threads - work through the queue ourselves
+    workers[0].engine = engine;
+    workers[0].index = 0;
+    copy_worker(&workers[0]);
+  }
+  for (int i = 0; i < n_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < engine->n_workers; i++) {
+    pthread_mutex_destroy(&engine->deques[i].lock);
+  }
+  free(engine->deques);
+  engine->deques = NULL;
+  free(workers);
+  free(threads);
+
+  if (engine->failed) {
+    rc = EXIT_FAILURE;
+  }
+  return rc;
+}